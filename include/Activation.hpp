@@ -0,0 +1,20 @@
+#pragma once
+#include "Matrix.hpp"
+#include <cstddef>
+
+// Activation functions over whole matrices, one sample per column. Each one is a single pass that
+// writes into out, which may be the same matrix as vals to work in place. The exponential is a
+// polynomial evaluated in SIMD registers (AVX-512, AVX2 or portable, picked like the gemm kernels)
+// rather than a libm call per element.
+template <typename T> void sigmoid(const Matrix<T>& vals, Matrix<T>& out);
+template <typename T> void relu(const Matrix<T>& vals, Matrix<T>& out);
+// Normalizes every column on its own
+template <typename T> void softmax(const Matrix<T>& vals, Matrix<T>& out);
+
+// Backward passes: scale the deltas in place by the derivative, taken from the cached outputs of
+// the forward pass (a * (1 - a) for sigmoid, a > 0 for ReLU) so nothing is recomputed
+template <typename T> void sigmoid_derivative(const Matrix<T>& activations, Matrix<T>& deltas);
+template <typename T> void relu_derivative(const Matrix<T>& activations, Matrix<T>& deltas);
+
+// out[i] = e^in[i] for count values, in and out may be the same buffer
+template <typename T> void vectorExp(const T* in, T* out, size_t count);
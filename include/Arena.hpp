@@ -0,0 +1,37 @@
+#pragma once
+#include <cstddef>
+
+// Pool for matrix storage. Blocks are 64-byte aligned and rounded up to a size class (four classes
+// per power of two). Freed blocks are kept on per-thread free lists and handed back out to the next
+// request of the same class, so code that keeps allocating same-shaped matrices stops reaching the
+// system allocator after the first round. A block goes on the list of the thread that frees it,
+// not the one that allocated it, so blocks handed from one thread to another pile up with the
+// receiver. Each thread keeps at most MAX_CACHED_BYTES and frees whatever it releases past that.
+class Arena {
+  public:
+    static constexpr size_t ALIGNMENT = 64;
+    static constexpr size_t MAX_CACHED_BYTES = static_cast<size_t>(256) << 20;
+    static void* allocate(size_t bytes);
+    static void release(void* block, size_t bytes);
+    // Frees every block on the calling thread's free lists
+    static void trim();
+    // Number of blocks the pool requested from the system allocator since the program started.
+    // Only the pool's own blocks count, memory allocated any other way doesn't show here
+    static size_t systemBlocks();
+};
+
+template <typename T> struct ArenaAllocator {
+    using value_type = T;
+
+    ArenaAllocator() = default;
+    template <typename U> ArenaAllocator(const ArenaAllocator<U>&) {}
+    T* allocate(size_t count) {
+        return static_cast<T*>(Arena::allocate(count * sizeof(T)));
+    }
+    void deallocate(T* block, size_t count) {
+        Arena::release(block, count * sizeof(T));
+    }
+    template <typename U> bool operator==(const ArenaAllocator<U>&) const {
+        return true;
+    }
+};
@@ -0,0 +1,77 @@
+#pragma once
+#include "Dataset.hpp"
+#include "Matrix.hpp"
+#include "MatrixView.hpp"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// Assembles training batches on background threads while the current step computes. The samples
+// of each batch, picked by a list of dataset indices, are gathered into one of a ring of buffers
+// allocated up front, prefetch batches ahead of the one being trained on. Loader threads take
+// turns, thread t filling batches t, t + threads and so on. The trainer only waits when the
+// loaders fall behind, and that time is added up. Samples can also come from a stream read in
+// order, such as ShardedDataset::Stream, which a single loader thread drains.
+template <typename T> class BatchLoader {
+  public:
+    // Applied to every sample right after it is gathered, input and target pointing at its row in
+    // the batch. Loader threads call it concurrently, so it must not share mutable state
+    using Transform = std::function<void(T* input, T* target)>;
+    // Writes the next sample to input and target, false once there are none left
+    using Stream = std::function<bool(T* input, T* target)>;
+    struct Batch {
+        MatrixView<const T> input; // one sample per column, like NeuralNetwork::foward takes
+        MatrixView<const T> target;
+    };
+
+  private:
+    struct Slot {
+        Matrix<T> input; // one sample per row
+        Matrix<T> target;
+        std::atomic<long> filled; // batch number it holds, plus one
+        bool complete;            // false when the stream ran out partway through it
+    };
+
+    const Dataset<T>* data; // null when samples come from stream
+    Stream stream;
+    int featureCount;
+    int targetCount;
+    int batchSize;
+    int threadCount;
+    Transform transform;
+    std::vector<std::unique_ptr<Slot>> slots;
+    std::vector<std::thread> loaders;
+    std::vector<int> order; // samples of the current epoch, batch after batch
+    long epochFirst;        // number of the first batch of the current epoch
+    std::atomic<long> epochEnd;
+    std::atomic<long> released; // batches the trainer is done with
+    long taken;
+    double stallSeconds;
+    std::atomic<bool> stopping;
+
+    void start(int prefetch);
+    void run(int loaderIt);
+    bool gather(Slot& slot, long batch);
+    void queue(long batches);
+
+  public:
+    BatchLoader(const Dataset<T>& data, int batchSize, int prefetch = 2, int threads = 1,
+                Transform transform = nullptr);
+    BatchLoader(Stream stream, int featureCount, int targetCount, int batchSize, int prefetch = 2,
+                Transform transform = nullptr);
+    BatchLoader(const BatchLoader&) = delete;
+    BatchLoader& operator=(const BatchLoader&) = delete;
+    ~BatchLoader();
+    // Starts loading the batches of a new epoch, every batchSize samples of order making one. Every
+    // batch of the previous epoch must have been taken
+    void beginEpoch(const std::vector<int>& order);
+    // Same for a stream, which must be ready to give this many batches
+    void beginEpoch(int batches);
+    int batchCount() const;
+    // The next batch of the epoch, valid until the following call
+    Batch next();
+    // Time next has spent waiting for the loaders
+    double getStallSeconds() const;
+};
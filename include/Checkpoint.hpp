@@ -0,0 +1,56 @@
+#pragma once
+#include "Layer.hpp"
+#include "Matrix.hpp"
+#include <atomic>
+#include <functional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Everything a training run needs to carry on exactly where it was: the parameters and optimizer
+// state of every layer, how far it got, and the shuffle state as it was when that epoch began, so
+// the epoch's order can be drawn again. Files are written aside and renamed over the old one, a
+// crash mid-write leaves the previous checkpoint whole.
+template <typename T> struct Checkpoint {
+    std::vector<int> layersConfig;
+    std::vector<Matrix<T>> weights;
+    std::vector<Matrix<T>> biases;
+    std::vector<typename Layer<T>::OptimizerState> optimizerStates;
+    int epoch; // epochs done
+    int step;  // steps of the next epoch done
+    std::mt19937 generator;
+    std::vector<int> order; // samples or shards, see NeuralNetwork::TrainingRun
+    double bestCrossEntropy;
+    int staleValidations;
+
+    bool save(std::string path) const;
+    // False when the file can't be read, is cut short, or holds parameters or an order that don't
+    // fit its own layer sizes
+    bool load(std::string path);
+    // Whether every tensor has the shape its layer sizes call for and order is within range
+    bool fits() const;
+};
+
+// Writes checkpoints on a background thread. The trainer only waits while the state is copied into
+// the snapshot, the slow part happens while it goes on training
+template <typename T> class CheckpointWriter {
+  private:
+    std::string path;
+    Checkpoint<T> snapshot;
+    std::atomic<long> requested;
+    std::atomic<long> written;
+    std::atomic<bool> stopping;
+    std::thread writer;
+    void run();
+
+  public:
+    CheckpointWriter(std::string path);
+    CheckpointWriter(const CheckpointWriter&) = delete;
+    CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+    // Finishes the checkpoint being written
+    ~CheckpointWriter();
+    // Has fill copy the state into the snapshot and queues it. Skipped, returning false, while the
+    // previous one is still being written
+    bool write(const std::function<void(Checkpoint<T>& snapshot)>& fill);
+};
@@ -0,0 +1,60 @@
+#pragma once
+#include "Layer.hpp"
+#include "MatrixView.hpp"
+#include "Optimizer.hpp"
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// Data-parallel training step. Every batch is cut into one shard per worker thread. Each worker is
+// pinned to its own share of the cores and runs forward and backward over the shared layers with
+// its own activations and gradients, allocated from its own thread so they sit on its NUMA node.
+// Synchronous workers then wait for each other, and each one sums its slice of every gradient
+// across all workers into the layers (a reduce-scatter). That leaves the same averaged gradients a
+// single pass over the whole batch would. Hogwild workers skip the reduction: each updates the
+// shared layers with its own gradients as soon as they are ready, without locks, racing with the
+// other workers by design. Each worker update is one optimizer step, numbered from a shared
+// counter, and the weights are repacked for sparse input once all of them are done.
+template <typename T> class DataParallel {
+  private:
+    struct Worker {
+        std::vector<int> cores;
+        int first; // columns of the batch this worker trains on
+        int size;
+        std::vector<typename Layer<T>::Cache> caches; // [layer]
+        std::vector<typename Layer<T>::Gradients> gradients;
+        std::thread thread;
+    };
+
+    std::vector<Layer<T>>& layers;
+    std::vector<std::unique_ptr<Worker>> workers;
+    const Optimizer<T>* hogwild;
+    int batchSize;
+    MatrixView<const T> input;
+    MatrixView<const T> target;
+    T learningRate;
+    std::atomic<int> generation;    // bumped once per step to wake the workers
+    std::atomic<int> pending;       // workers still working on the current step
+    std::atomic<int> backwardDone;  // workers whose gradients are ready this step
+    std::atomic<long> hogwildSteps; // optimizer steps the Hogwild workers have taken
+    bool stopping;
+
+    void run(size_t workerIt);
+    void runStep(size_t workerIt);
+    void reduce(size_t workerIt, size_t layer, Matrix<T> Layer<T>::Gradients::*part);
+
+  public:
+    // With a null hogwild the workers reduce their gradients onto the layers, otherwise each one
+    // applies its own updates with that optimizer
+    DataParallel(std::vector<Layer<T>>& layers, int workerCount, int batchSize,
+                 const Optimizer<T>* hogwild = nullptr);
+    DataParallel(const DataParallel&) = delete;
+    DataParallel& operator=(const DataParallel&) = delete;
+    ~DataParallel();
+    // Forward and backward for one batch. Synchronous steps leave the gradients on the layers,
+    // ready for update. Hogwild steps have already applied theirs with learningRate
+    void step(MatrixView<const T> input, MatrixView<const T> target, T learningRate);
+    int getWorkerCount() const;
+    bool isHogwild() const;
+};
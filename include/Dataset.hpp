@@ -0,0 +1,78 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <string>
+#include <vector>
+
+// Cache-line aligned storage straight from the system. Datasets are allocated once and are too big
+// to be worth keeping on the Arena free lists after they are gone
+template <typename T> struct AlignedAllocator {
+    using value_type = T;
+    static constexpr size_t ALIGNMENT = 64;
+
+    AlignedAllocator() = default;
+    template <typename U> AlignedAllocator(const AlignedAllocator<U>&) {}
+    T* allocate(size_t count) {
+        return static_cast<T*>(::operator new(count * sizeof(T), std::align_val_t(ALIGNMENT)));
+    }
+    void deallocate(T* block, size_t) {
+        ::operator delete(block, std::align_val_t(ALIGNMENT));
+    }
+    template <typename U> bool operator==(const AlignedAllocator<U>&) const {
+        return true;
+    }
+};
+
+// Training samples in two contiguous, aligned buffers, one row of features and one row of targets
+// per sample. Features coming from 8-bit sources such as images can stay as bytes, scaled to T
+// only when a batch is gathered, which cuts the dataset to an eighth of its size in double.
+// Shuffles and train/test splits work on lists of sample indices, the samples never move.
+template <typename T> class Dataset {
+  private:
+    size_t sampleCount;
+    int featureCount;
+    int targetCount;
+    T byteScale; // feature value of one byte step, 0 when features are stored as T
+    std::vector<T, AlignedAllocator<T>> features;
+    std::vector<uint8_t, AlignedAllocator<uint8_t>> bytes;
+    std::vector<T, AlignedAllocator<T>> targets;
+
+  public:
+    Dataset();
+    Dataset(size_t samples, int featureCount, int targetCount);
+    // Features kept as bytes, each read back as byte * byteScale
+    Dataset(size_t samples, int featureCount, int targetCount, T byteScale);
+    size_t size() const;
+    int getFeatureCount() const;
+    int getTargetCount() const;
+    bool hasByteFeatures() const;
+    T getByteScale() const;
+    // Where a sample's features are, for the storage the dataset was created with
+    T* featuresOf(size_t sample);
+    const T* featuresOf(size_t sample) const;
+    uint8_t* bytesOf(size_t sample);
+    const uint8_t* bytesOf(size_t sample) const;
+    T* targetOf(size_t sample);
+    const T* targetOf(size_t sample) const;
+    // Writes the sample's features to out as T, whatever the storage
+    void copyFeatures(size_t sample, T* out) const;
+    // Saves the samples packed as a cache of the file they were parsed from: a 64-byte header with
+    // the shape, the byte scale and the size and modification time of source, then every feature
+    // as a byte and every label as a byte. Only works for one-hot targets and features that are
+    // byte steps, false saying why on std::cerr otherwise
+    bool saveCache(std::string path, std::string source) const;
+    // Loads a cache saved by saveCache in one read, false when there is none or source has changed
+    // since it was saved
+    bool loadCache(std::string path, std::string source);
+    // Reads MNIST's IDX files: byte images, samples x rows x columns, and a byte label for each.
+    // Pixels stay as bytes scaled to [0, 1], there is a class for every label up to the largest
+    bool loadIdx(std::string imagesPath, std::string labelsPath);
+    // Reads a CSV with the class of each sample in its first column and the features after it,
+    // skipping a header line if there is one. The mapped file is split into chunks at line breaks
+    // that threads parse straight into the dataset's buffers. Features are kept as bytes read back
+    // times byteScale when every one is a whole number from 0 to 255 and byteScale isn't 0, as T
+    // as written otherwise. Both loaders return false, saying why on std::cerr, when the files
+    // can't be read, and leave the dataset as it was
+    bool loadCsv(std::string path, T byteScale);
+};
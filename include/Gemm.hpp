@@ -0,0 +1,51 @@
+#pragma once
+#include <cstddef>
+
+// General matrix multiply over row-major buffers: C = op(A) * op(B), or C += op(A) * op(B) when
+// accumulate is set. op(X) is X, or X transposed when its trans flag is set, read straight from
+// the original storage. op(A) is m x k, op(B) is k x n and C is m x n. lda, ldb and ldc are the
+// row strides of the buffers as stored.
+template <typename T>
+void gemm(bool transA, bool transB, size_t m, size_t n, size_t k, const T* a, size_t lda,
+          const T* b, size_t ldb, T* c, size_t ldc, bool accumulate = false);
+
+// Plain triple loop, kept as the reference the blocked kernels are checked against and as the
+// fallback for scalar types without a dedicated kernel
+template <typename T>
+void gemmReference(bool transA, bool transB, size_t m, size_t n, size_t k, const T* a, size_t lda,
+                   const T* b, size_t ldb, T* c, size_t ldc, bool accumulate = false) {
+    const size_t rsA = transA ? 1 : lda, csA = transA ? lda : 1;
+    const size_t rsB = transB ? 1 : ldb, csB = transB ? ldb : 1;
+#pragma omp parallel for collapse(2) schedule(static)
+    for (size_t j = 0; j < m; ++j) {     // output rows
+        for (size_t l = 0; l < n; ++l) { // output cols
+            T sum = accumulate ? c[(j * ldc) + l] : static_cast<T>(0);
+            for (size_t i = 0; i < k; ++i) { // shared dim
+                sum += a[(j * rsA) + (i * csA)] * b[(i * rsB) + (l * csB)];
+            }
+            c[(j * ldc) + l] = sum;
+        }
+    }
+}
+
+template <typename T>
+void gemm(bool transA, bool transB, size_t m, size_t n, size_t k, const T* a, size_t lda,
+          const T* b, size_t ldb, T* c, size_t ldc, bool accumulate) {
+    gemmReference(transA, transB, m, n, k, a, lda, b, ldb, c, ldc, accumulate);
+}
+
+// Sizes the pack buffers of the calling thread, and of the OpenMP threads it would run on, for any
+// product up to m x n x k, so that those products don't allocate. Only float and double pack
+template <typename T> void gemmReserve(size_t m, size_t n, size_t k) {}
+
+// float and double go through the packed, cache-blocked kernels in Gemm.cpp. The micro-kernel
+// (AVX-512, AVX2 or portable) is picked once at runtime from the CPU features, NN_GEMM_ISA
+// (reference, generic, avx2, avx512) can force a specific one.
+template <>
+void gemm<float>(bool transA, bool transB, size_t m, size_t n, size_t k, const float* a,
+                 size_t lda, const float* b, size_t ldb, float* c, size_t ldc, bool accumulate);
+template <>
+void gemm<double>(bool transA, bool transB, size_t m, size_t n, size_t k, const double* a,
+                  size_t lda, const double* b, size_t ldb, double* c, size_t ldc, bool accumulate);
+template <> void gemmReserve<float>(size_t m, size_t n, size_t k);
+template <> void gemmReserve<double>(size_t m, size_t n, size_t k);
@@ -0,0 +1,82 @@
+#pragma once
+#include "NeuralNetwork.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <istream>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Serves one model to many clients at once. Requests wait in a queue until the batching thread
+// takes every one that arrived within maxDelay of the oldest, up to maxBatch, and runs them through
+// the model as one wide batch, so a lone request waits at most maxDelay for others to share the
+// GEMM with. Clients send one line per request over a Unix socket or a stream: the features of a
+// sample separated by spaces, answered by the top classes and their outputs as "class score"
+// pairs, best first. The line "stats" is answered with the counters instead.
+template <typename T> class InferenceServer {
+  public:
+    struct Prediction {
+        std::vector<int> classes; // best first
+        std::vector<T> scores;
+    };
+    struct Stats {
+        size_t requests;
+        size_t batches;
+        double requestsPerSecond; // since the server started
+        double p50Milliseconds;   // from arrival to answer, over the latest requests
+        double p99Milliseconds;
+    };
+
+  private:
+    struct Request {
+        const T* input;
+        int topK;
+        std::chrono::steady_clock::time_point arrival;
+        std::promise<Prediction> result;
+    };
+
+    const NeuralNetwork<T>& model;
+    int maxBatch;
+    std::chrono::microseconds maxDelay;
+    int featureCount;
+    int outputCount;
+    std::mutex mutex; // guards everything below
+    std::condition_variable arrived;
+    std::deque<Request*> queue;
+    bool stopping;
+    size_t requestCount;
+    size_t batchCount;
+    std::vector<double> latencies; // milliseconds, a ring of the latest requests
+    size_t latencyIt;
+    std::chrono::steady_clock::time_point started;
+    std::thread batcher;
+
+    void run();
+    // Throws unless topK is between one and the output count
+    void checkTopK(int topK) const;
+    void answerClient(int client, int topK);
+    std::string answer(const std::string& line, int topK);
+
+  public:
+    // model must outlive the server and not train while it runs
+    InferenceServer(const NeuralNetwork<T>& model, int maxBatch = 64,
+                    std::chrono::microseconds maxDelay = std::chrono::microseconds(2000));
+    InferenceServer(const InferenceServer&) = delete;
+    InferenceServer& operator=(const InferenceServer&) = delete;
+    // Answers the requests already queued before returning
+    ~InferenceServer();
+    // The topK classes for one sample's features, blocking until its batch has run. Any number of
+    // threads can call it at once
+    Prediction predict(const T* input, int topK = 1);
+    Stats getStats();
+    // Answers the requests read from in on out, one at a time, until in ends. Requests that fail
+    // are answered with a line starting with "error", a topK out of range throws up front
+    void serve(std::istream& in, std::ostream& out, int topK = 1);
+    // Listens at path and answers each client on its own thread, until accepting fails. A client
+    // sending a line longer than any request could be is answered with an error and dropped
+    void listen(std::string path, int topK = 1);
+};
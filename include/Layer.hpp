@@ -1,38 +1,116 @@
 #pragma once
 #include "Matrix.hpp"
+#include "Optimizer.hpp"
+#include "SparseInput.hpp"
 
-class Layer {
+template <typename T> class Layer {
   public:
     enum ActivationFunction { SIGMOID, RELU, SOFTMAX };
+    // Everything one pass through the layer leaves behind for its backward pass. The layer owns one
+    // for plain training, callers running several batches at once (the pipeline) bring their own
+    struct Cache {
+        MatrixView<const T> input; // caller keeps it alive until backwards
+        Matrix<T> activations;     // a
+        Matrix<T> deltas;
+        SparseInput<T> sparseInput; // nonzeros of input, active when the sparse path ran
+    };
+    // Weight and bias gradients, sums over the batch until averaged. The layer holds one set,
+    // data-parallel workers keep their own and reduce them into it
+    struct Gradients {
+        Matrix<T> dW;
+        Matrix<T> db;
+    };
+    // Optimizer buffers and step count, as checkpoints keep them. Unused buffers are empty
+    struct OptimizerState {
+        Matrix<T> weights[2];
+        Matrix<T> biases[2];
+        long steps;
+    };
 
   private:
     int nodeCount;
-    Matrix<double> weights;
-    Matrix<double> biases;
+    Matrix<T> weights;
+    Matrix<T> biases;
     ActivationFunction activationFunctionType;
-    Matrix<double> (*activationFunction)(Matrix<double>);
-    Matrix<double> (*activationDerivative)(Matrix<double>);
+    double sparseDensity;
+    Matrix<T> packedWeights; // weights laid out for SparseInput, kept only while it is on
+    // Parameters read in place from memory the layer doesn't own, empty unless mapped
+    MatrixView<const T> mappedWeights;
+    MatrixView<const T> mappedBiases;
+    MatrixView<const T> mappedPacked;
+    void (*activationFunction)(const Matrix<T>& vals, Matrix<T>& out); // see Activation.hpp
+    void (*activationDerivative)(const Matrix<T>& activations, Matrix<T>& deltas);
 
-    Matrix<double> previousLayerActivations;
-    Matrix<double> activations;    // a
-    Matrix<double> preActivations; // z
+    Cache cache;
+    Gradients gradients;
+    // Optimizer state (see Optimizer::Tensor), one pair of buffers per parameter tensor
+    Matrix<T> weightsState[2];
+    Matrix<T> biasesState[2];
+    long optimizerSteps;
 
-    Matrix<double> deltas;
-    Matrix<double> dW;
-    Matrix<double> db;
+    void computeGradients(Cache& cache, Gradients& gradients, bool accumulate);
+    void setActivation(ActivationFunction activationF);
+    void packWeights();
+    // Copies mapped parameters into the layer before anything changes them
+    void detach();
 
   public:
     Layer(int nodeCount, int previousLayerNodes = 0, ActivationFunction activationF = SIGMOID);
+    // Reads its weights and biases in place from memory the caller keeps alive and unchanged, such
+    // as a mapped model file (see ModelFile), packed being the weights as SparseInput::pack lays
+    // them out if at hand. Training copies them into the layer first
+    Layer(MatrixView<const T> weights, MatrixView<const T> biases, ActivationFunction activationF,
+          MatrixView<const T> packed = MatrixView<const T>());
     void initRandom();
-    int getNodeCount();
-    void setDeltas(Matrix<double> d);
-    void setWeights(Matrix<double> weights);
-    void setBiases(Matrix<double> biases);
-    Matrix<double> getWeights();
-    Matrix<double> getBiases();
-    Matrix<double> foward(Matrix<double>& input);
-    Matrix<double> foward_batch(Matrix<double>& input);
-    Matrix<double> backwards(Matrix<double> nextLayerWeights, Matrix<double> nextLayerDeltas);
-    Matrix<double> backwards_batch(Matrix<double>& input);
-    void update(double learning_rate);
+    int getNodeCount() const;
+    ActivationFunction getActivationFunction() const;
+    // Inputs with at most this fraction of nonzero entries skip the zero features in the forward
+    // product and the weight gradient (see SparseInput), 0 turns it off
+    void setSparseInput(double maxDensity);
+    void setDeltas(MatrixView<const T> d);
+    void setDeltas(MatrixView<const T> d, Cache& cache, bool accumulate);
+    void setDeltas(MatrixView<const T> d, Cache& cache, Gradients& gradients, bool accumulate);
+    void setWeights(Matrix<T> weights);
+    void setBiases(Matrix<T> biases);
+    void reserve(int batchSize);
+    void reserve(Cache& cache, int batchSize) const;
+    void reserve(Gradients& gradients) const;
+    // Allocates the optimizer state ahead of the first update, zeroed, unless it's already there
+    void reserve(const Optimizer<T>& optimizer);
+    MatrixView<const T> getWeights() const;
+    MatrixView<const T> getBiases() const;
+    // Weights as SparseInput::pack lays them out, empty while sparse input is off
+    MatrixView<const T> getPackedWeights() const;
+    const Matrix<T>& foward(MatrixView<const T> input);
+    const Matrix<T>& foward(MatrixView<const T> input, Cache& cache) const;
+    const Matrix<T>& backwards(MatrixView<const T> nextLayerWeights,
+                               MatrixView<const T> nextLayerDeltas);
+    // With accumulate set the gradients of this pass are added to the ones already held, which
+    // stay as sums until averageGradients divides them by the full batch size
+    const Matrix<T>& backwards(MatrixView<const T> nextLayerWeights,
+                               MatrixView<const T> nextLayerDeltas, Cache& cache, bool accumulate);
+    const Matrix<T>& backwards(MatrixView<const T> nextLayerWeights,
+                               MatrixView<const T> nextLayerDeltas, Cache& cache,
+                               Gradients& gradients, bool accumulate);
+    void averageGradients(int batchSize);
+    Gradients& getGradients();
+    double squaredGradientNorm() const;
+    static double squaredGradientNorm(const Gradients& gradients);
+    // Steps the weights and biases along the gradients held, scaled by gradientScale
+    void update(const Optimizer<T>& optimizer, T learningRate, T gradientScale = 1);
+    void update(const Gradients& gradients, const Optimizer<T>& optimizer, T learningRate,
+                T gradientScale = 1);
+    // The update of workers stepping the layer at the same time (see DataParallel). The optimizer
+    // state must be reserved, step is the optimizer step this update takes and isn't counted here,
+    // and the packed weights are left for finishConcurrentUpdates
+    void concurrentUpdate(const Gradients& gradients, const Optimizer<T>& optimizer,
+                          T learningRate, T gradientScale, long step);
+    // Once the workers are done, records steps as the optimizer steps taken and repacks the weights
+    void finishConcurrentUpdates(long steps);
+    long getOptimizerSteps() const;
+    // Drops the optimizer state, the next update starts from zeroed buffers
+    void resetOptimizer();
+    // Copies the optimizer state into state, reusing its buffers
+    void copyOptimizerState(OptimizerState& state) const;
+    void setOptimizerState(const OptimizerState& state);
 };
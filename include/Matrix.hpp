@@ -1,57 +1,284 @@
 #pragma once
+#include "Arena.hpp"
+#include "Gemm.hpp"
+#include "MatrixView.hpp"
+#include <concepts>
+#include <functional>
 #include <iostream>
 #include <stdexcept>
+#include <utility>
 #include <vector>
 
+template <typename T> class Matrix;
+
+// Anything that can be read element by element like a Matrix. Element-wise operators build
+// expression objects out of these instead of allocating a result; the whole chain is evaluated in
+// a single pass when it is assigned to a Matrix, in place if the shape already matches.
+template <typename E>
+concept MatrixExpression = requires(const E& expr, int x, int y) {
+    typename E::ValueType;
+    { expr.getWidth() } -> std::convertible_to<int>;
+    { expr.getHeight() } -> std::convertible_to<int>;
+    { expr.getValue(x, y) } -> std::convertible_to<typename E::ValueType>;
+};
+
+// Whether writing expr into target element by element could read an element already written. Views
+// answer for themselves (see MatrixView::aliases), expressions ask their operands, and a Matrix
+// operand is either target itself, read at the element being written, or other storage
+template <MatrixExpression E, typename T>
+bool expression_aliases(const E& expr, MatrixView<const T> target) {
+    if constexpr (requires { expr.aliases(target); }) {
+        return expr.aliases(target);
+    } else {
+        return false;
+    }
+}
+
+// Matrices are captured by reference, intermediate expressions by value
+template <typename E> struct ExpressionOperand {
+    using type = E;
+};
+template <typename T> struct ExpressionOperand<Matrix<T>> {
+    using type = const Matrix<T>&;
+};
+
+template <typename L, typename R, typename Op> class MatrixBinaryExpression {
+  private:
+    typename ExpressionOperand<L>::type lhs;
+    typename ExpressionOperand<R>::type rhs;
+
+  public:
+    using ValueType = typename L::ValueType;
+    MatrixBinaryExpression(const L& lhs, const R& rhs, const char* error) : lhs(lhs), rhs(rhs) {
+        if (lhs.getWidth() != rhs.getWidth() || lhs.getHeight() != rhs.getHeight()) {
+            throw std::invalid_argument(error);
+        }
+    }
+    int getWidth() const {
+        return this->lhs.getWidth();
+    }
+    int getHeight() const {
+        return this->lhs.getHeight();
+    }
+    ValueType getValue(int x, int y) const {
+        return Op{}(this->lhs.getValue(x, y), this->rhs.getValue(x, y));
+    }
+    bool aliases(MatrixView<const ValueType> target) const {
+        return expression_aliases(this->lhs, target) || expression_aliases(this->rhs, target);
+    }
+};
+
+template <typename E, typename Op> class MatrixScalarExpression {
+  private:
+    typename ExpressionOperand<E>::type expr;
+    typename E::ValueType scalar;
+
+  public:
+    using ValueType = typename E::ValueType;
+    MatrixScalarExpression(const E& expr, ValueType scalar) : expr(expr), scalar(scalar) {}
+    int getWidth() const {
+        return this->expr.getWidth();
+    }
+    int getHeight() const {
+        return this->expr.getHeight();
+    }
+    ValueType getValue(int x, int y) const {
+        return Op{}(this->expr.getValue(x, y), this->scalar);
+    }
+    bool aliases(MatrixView<const ValueType> target) const {
+        return expression_aliases(this->expr, target);
+    }
+};
+
+template <typename E> class MatrixMapExpression {
+  public:
+    using ValueType = typename E::ValueType;
+
+  private:
+    typename ExpressionOperand<E>::type expr;
+    ValueType (*funct)(ValueType);
+
+  public:
+    MatrixMapExpression(const E& expr, ValueType (*funct)(ValueType)) : expr(expr), funct(funct) {}
+    int getWidth() const {
+        return this->expr.getWidth();
+    }
+    int getHeight() const {
+        return this->expr.getHeight();
+    }
+    ValueType getValue(int x, int y) const {
+        return this->funct(this->expr.getValue(x, y));
+    }
+    bool aliases(MatrixView<const ValueType> target) const {
+        return expression_aliases(this->expr, target);
+    }
+};
+
+// A single column repeated width times, used to add the biases to a whole batch
+template <typename T> class MatrixBroadcastExpression {
+  private:
+    MatrixView<const T> column;
+    int width;
+
+  public:
+    using ValueType = T;
+    MatrixBroadcastExpression(MatrixView<const T> column, int width)
+        : column(column), width(width) {
+        if (column.getWidth() != 1) {
+            throw std::invalid_argument("Only single column matrices can be broadcast");
+        }
+    }
+    int getWidth() const {
+        return this->width;
+    }
+    int getHeight() const {
+        return this->column.getHeight();
+    }
+    T getValue(int, int y) const {
+        return this->column.getValue(0, y);
+    }
+    // Every column reads the same one, so any overlap with the target counts
+    bool aliases(MatrixView<const T> target) const {
+        return this->column.overlaps(target);
+    }
+};
+
+template <MatrixExpression L, MatrixExpression R>
+MatrixBinaryExpression<L, R, std::plus<>> operator+(const L& lhs, const R& rhs) {
+    return {lhs, rhs, "Matrix dimensions must match for addition"};
+}
+
+template <MatrixExpression L, MatrixExpression R>
+MatrixBinaryExpression<L, R, std::minus<>> operator-(const L& lhs, const R& rhs) {
+    return {lhs, rhs, "Matrix dimensions must match for subtraction"};
+}
+
+template <MatrixExpression E, typename S>
+    requires std::is_arithmetic_v<S>
+MatrixScalarExpression<E, std::multiplies<>> operator*(const E& expr, const S& scalar) {
+    return {expr, static_cast<typename E::ValueType>(scalar)};
+}
+
+template <MatrixExpression E, typename S>
+    requires std::is_arithmetic_v<S>
+MatrixScalarExpression<E, std::divides<>> operator/(const E& expr, const S& scalar) {
+    return {expr, static_cast<typename E::ValueType>(scalar)};
+}
+
 template <typename T> class Matrix {
+  public:
+    // 64-byte aligned storage recycled through the Arena pool
+    using Storage = std::vector<T, ArenaAllocator<T>>;
+
   private:
-    std::vector<T> values;
+    Storage values;
     int width;
     int height;
 
+    template <MatrixExpression E> void assign(const E& expr);
+    bool overlaps(MatrixView<const T> view) const;
+    void product(MatrixView<const T> a, MatrixView<const T> b, bool transA, bool transB,
+                 bool accumulate);
+
   public:
+    using ValueType = T;
     Matrix();
     Matrix(int w, int h, T initValue = 0);
     Matrix(int w, int h, std::vector<T> values);
+    Matrix(const Matrix<T>& mat);
+    Matrix(Matrix<T>&& mat) noexcept;
+    template <MatrixExpression E> Matrix(const E& expr);
     void setValue(int x, int y, T value);
     T getValue(int x, int y) const;
     int getWidth() const;
     int getHeight() const;
-    std::vector<T> getValuesVector();
-    Matrix<T> transpose();
-    Matrix<T> hadamard(const Matrix<T>& mat);
-    Matrix<T> apply(T (*funct)(T));
+    const Storage& getValuesVector() const;
+    T* data();
+    const T* data() const;
+    void resize(int w, int h);
+    MatrixView<T> view();
+    MatrixView<const T> view() const;
+    operator MatrixView<const T>() const;
+    Matrix<T> transpose() const;
+    template <typename U> Matrix<U> cast() const;
+    template <MatrixExpression E>
+    MatrixBinaryExpression<Matrix<T>, E, std::multiplies<>> hadamard(const E& mat) const;
+    MatrixMapExpression<Matrix<T>> apply(T (*funct)(T)) const;
+    MatrixBroadcastExpression<T> broadcastColumns(int w) const;
     Matrix<T>& operator=(const Matrix<T>& mat);
-    Matrix<T> operator*(const Matrix<T>& mat);
-    Matrix<T> operator*(const int& integer);
-    Matrix<T> operator*(const double& dou);
-    Matrix<T> operator/(const int& integer);
-    Matrix<T> operator-(const Matrix<T>& mat);
-    Matrix<T> operator+(const Matrix<T>& mat);
+    Matrix<T>& operator=(Matrix<T>&& mat) noexcept;
+    template <MatrixExpression E> Matrix<T>& operator=(const E& expr);
+    template <MatrixExpression E> Matrix<T>& operator+=(const E& expr);
+    template <MatrixExpression E> Matrix<T>& operator-=(const E& expr);
+    Matrix<T>& operator*=(T scalar);
+    Matrix<T>& operator/=(T scalar);
+    template <MatrixExpression E> Matrix<T>& axpy(T alpha, const E& x); // this += alpha * x
+    // In-place products: this = op(a) * op(b) and this += op(a) * op(b), op transposing the operand
+    // when its flag is set. The storage is reused whenever the shape allows it
+    Matrix<T>& assignProduct(MatrixView<const T> a, MatrixView<const T> b, bool transA = false,
+                             bool transB = false);
+    Matrix<T>& addProduct(MatrixView<const T> a, MatrixView<const T> b, bool transA = false,
+                          bool transB = false);
+    Matrix<T> operator*(MatrixView<const T> mat) const;
+    Matrix<T> transposedMultiply(MatrixView<const T> mat) const; // this^T * mat
+    Matrix<T> multiplyTransposed(MatrixView<const T> mat) const; // this * mat^T
 };
 
 // Implementation
 template <typename T> Matrix<T>::Matrix() {
     this->width = 0;
     this->height = 0;
-    this->values = std::vector<T>(0);
+    this->values = Storage(0);
 }
 
 template <typename T> Matrix<T>::Matrix(int w, int h, T initValue) {
     this->width = w;
     this->height = h;
-    this->values = std::vector<T>((h * w), initValue);
+    this->values = Storage((h * w), initValue);
 }
 
 template <typename T> Matrix<T>::Matrix(int w, int h, std::vector<T> values) {
     this->width = w;
     this->height = h;
-    this->values = values;
-    if (this->values.size() > w * h) {
-        this->values.resize(w * h);
-    } else if (this->values.size() < w * h) {
-        for (size_t i = 0; i < (w * h) - this->values.size(); i++) {
-            this->values.push_back(static_cast<T>(0));
+    this->values = Storage(values.begin(), values.end());
+    this->values.resize(w * h, static_cast<T>(0));
+}
+
+template <typename T> Matrix<T>::Matrix(const Matrix<T>& mat) {
+    this->width = mat.width;
+    this->height = mat.height;
+    this->values = mat.values;
+}
+
+template <typename T> Matrix<T>::Matrix(Matrix<T>&& mat) noexcept {
+    this->width = mat.width;
+    this->height = mat.height;
+    this->values = std::move(mat.values);
+    mat.width = 0;
+    mat.height = 0;
+}
+
+template <typename T>
+template <MatrixExpression E>
+Matrix<T>::Matrix(const E& expr) {
+    this->width = expr.getWidth();
+    this->height = expr.getHeight();
+    this->values = Storage(this->width * this->height);
+    this->assign(expr);
+}
+
+template <typename T>
+template <MatrixExpression E>
+void Matrix<T>::assign(const E& expr) {
+    if (expression_aliases(expr, MatrixView<const T>(*this))) {
+        // Reading this matrix elsewhere than the element being written, so it is built aside
+        *this = Matrix<T>(expr);
+        return;
+    }
+#pragma omp parallel for
+    for (size_t j = 0; j < this->height; ++j) {    // rows iterator
+        for (size_t i = 0; i < this->width; ++i) { // columns iterator
+            this->values[(j * this->width) + i] = expr.getValue(i, j);
         }
     }
 }
@@ -72,11 +299,38 @@ template <typename T> int Matrix<T>::getHeight() const {
     return this->height;
 }
 
-template <typename T> std::vector<T> Matrix<T>::getValuesVector() {
+template <typename T> const typename Matrix<T>::Storage& Matrix<T>::getValuesVector() const {
     return this->values;
 }
 
-template <typename T> Matrix<T> Matrix<T>::transpose() {
+template <typename T> T* Matrix<T>::data() {
+    return this->values.data();
+}
+
+template <typename T> const T* Matrix<T>::data() const {
+    return this->values.data();
+}
+
+// Changes the shape keeping the allocation when it is big enough, the contents are unspecified
+template <typename T> void Matrix<T>::resize(int w, int h) {
+    this->width = w;
+    this->height = h;
+    this->values.resize(w * h);
+}
+
+template <typename T> MatrixView<T> Matrix<T>::view() {
+    return MatrixView<T>(this->values.data(), this->width, this->height, this->width);
+}
+
+template <typename T> MatrixView<const T> Matrix<T>::view() const {
+    return MatrixView<const T>(this->values.data(), this->width, this->height, this->width);
+}
+
+template <typename T> Matrix<T>::operator MatrixView<const T>() const {
+    return this->view();
+}
+
+template <typename T> Matrix<T> Matrix<T>::transpose() const {
     Matrix<T> newMat(this->height, this->width);
 #pragma omp parallel for
     for (size_t j = 0; j < this->height; ++j) {
@@ -87,29 +341,28 @@ template <typename T> Matrix<T> Matrix<T>::transpose() {
     return newMat;
 }
 
-template <typename T> Matrix<T> Matrix<T>::hadamard(const Matrix<T>& mat) {
-    if (this->width != mat.getWidth() || this->height != mat.getHeight()) {
-        throw std::invalid_argument("Matrix dimensions must match for Hadamard product");
-    }
-    Matrix<T> newMat(this->width, this->height);
+template <typename T> template <typename U> Matrix<U> Matrix<T>::cast() const {
+    Matrix<U> newMat(this->width, this->height);
+    U* out = newMat.data();
 #pragma omp parallel for
-    for (size_t j = 0; j < this->height; ++j) {
-        for (size_t i = 0; i < this->width; ++i) {
-            newMat.setValue(i, j, this->values[(j * this->width) + i] * mat.getValue(i, j));
-        }
+    for (size_t i = 0; i < this->values.size(); ++i) {
+        out[i] = static_cast<U>(this->values[i]);
     }
     return newMat;
 }
 
-template <typename T> Matrix<T> Matrix<T>::apply(T (*funct)(T)) {
-    Matrix<T> newMat(this->width, this->height);
-#pragma omp parallel for
-    for (size_t j = 0; j < this->height; j++) {
-        for (size_t i = 0; i < this->width; i++) {
-            newMat.setValue(i, j, funct(this->values[(j * this->width) + i]));
-        }
-    }
-    return newMat;
+template <typename T>
+template <MatrixExpression E>
+MatrixBinaryExpression<Matrix<T>, E, std::multiplies<>> Matrix<T>::hadamard(const E& mat) const {
+    return {*this, mat, "Matrix dimensions must match for Hadamard product"};
+}
+
+template <typename T> MatrixMapExpression<Matrix<T>> Matrix<T>::apply(T (*funct)(T)) const {
+    return {*this, funct};
+}
+
+template <typename T> MatrixBroadcastExpression<T> Matrix<T>::broadcastColumns(int w) const {
+    return {this->view(), w};
 }
 
 template <typename T> Matrix<T>& Matrix<T>::operator=(const Matrix<T>& mat) {
@@ -121,84 +374,140 @@ template <typename T> Matrix<T>& Matrix<T>::operator=(const Matrix<T>& mat) {
     return *this;
 }
 
-template <typename T> Matrix<T> Matrix<T>::operator*(const Matrix<T>& mat) {
-    if (this->width != mat.getHeight()) {
-        throw std::invalid_argument("Matrix multiplication requires width of first matrix to equal "
-                                    "height of second matrix");
-    }
-    Matrix<T> newMat(mat.getWidth(), this->height);
-#pragma omp parallel for collapse(2) schedule(static)
-    for (size_t j = 0; j < this->height; ++j) {       // output rows
-        for (size_t k = 0; k < mat.getWidth(); ++k) { // output cols
-            T sum = static_cast<T>(0);
-            for (size_t i = 0; i < this->width; ++i) { // shared dim
-                sum += this->values[(j * this->width) + i] * mat.getValue(k, i);
-            }
-            newMat.setValue(k, j, sum);
-        }
+template <typename T> Matrix<T>& Matrix<T>::operator=(Matrix<T>&& mat) noexcept {
+    if (this != &mat) {
+        width = mat.width;
+        height = mat.height;
+        values = std::move(mat.values);
+        mat.width = 0;
+        mat.height = 0;
     }
-    return newMat;
+    return *this;
 }
 
-template <typename T> Matrix<T> Matrix<T>::operator*(const int& integer) {
-    Matrix<T> newMat(this->width, this->height);
-#pragma omp parallel for
-    for (size_t j = 0; j < this->height; ++j) {    // rows iterator
-        for (size_t i = 0; i < this->width; ++i) { // columns iterator
-            newMat.setValue(i, j, this->values[(j * this->width) + i] * static_cast<T>(integer));
-        }
+template <typename T>
+template <MatrixExpression E>
+Matrix<T>& Matrix<T>::operator=(const E& expr) {
+    if (this->width != expr.getWidth() || this->height != expr.getHeight()) {
+        // The expression may read this matrix, so build the result aside when the shape changes
+        return *this = Matrix<T>(expr);
     }
-    return newMat;
+    this->assign(expr);
+    return *this;
 }
 
-template <typename T> Matrix<T> Matrix<T>::operator*(const double& dou) {
-    Matrix<T> newMat(this->width, this->height);
-#pragma omp parallel for
-    for (size_t j = 0; j < this->height; ++j) {    // rows iterator
-        for (size_t i = 0; i < this->width; ++i) { // columns iterator
-            newMat.setValue(i, j, this->values[(j * this->width) + i] * static_cast<T>(dou));
-        }
-    }
-    return newMat;
+template <typename T>
+template <MatrixExpression E>
+Matrix<T>& Matrix<T>::operator+=(const E& expr) {
+    this->assign(*this + expr);
+    return *this;
 }
 
-template <typename T> Matrix<T> Matrix<T>::operator/(const int& integer) {
-    Matrix<T> newMat(this->width, this->height);
-#pragma omp parallel for
-    for (size_t j = 0; j < this->height; ++j) {    // rows iterator
-        for (size_t i = 0; i < this->width; ++i) { // columns iterator
-            newMat.setValue(i, j, this->values[(j * this->width) + i] / static_cast<T>(integer));
-        }
+template <typename T>
+template <MatrixExpression E>
+Matrix<T>& Matrix<T>::operator-=(const E& expr) {
+    this->assign(*this - expr);
+    return *this;
+}
+
+template <typename T> Matrix<T>& Matrix<T>::operator*=(T scalar) {
+    this->assign(*this * scalar);
+    return *this;
+}
+
+template <typename T> Matrix<T>& Matrix<T>::operator/=(T scalar) {
+    this->assign(*this / scalar);
+    return *this;
+}
+
+template <typename T>
+template <MatrixExpression E>
+Matrix<T>& Matrix<T>::axpy(T alpha, const E& x) {
+    this->assign(*this + (x * alpha));
+    return *this;
+}
+
+template <typename T> bool Matrix<T>::overlaps(MatrixView<const T> view) const {
+    return this->view().overlaps(view);
+}
+
+template <typename T>
+void Matrix<T>::product(MatrixView<const T> a, MatrixView<const T> b, bool transA, bool transB,
+                        bool accumulate) {
+    // gemm needs one unit stride per operand, anything more exotic is copied into a dense block
+    Matrix<T> denseA, denseB;
+    if (a.getColStride() != 1 && a.getRowStride() != 1) {
+        denseA = a;
+        a = denseA.view();
     }
-    return newMat;
+    if (b.getColStride() != 1 && b.getRowStride() != 1) {
+        denseB = b;
+        b = denseB.view();
+    }
+    int m = transA ? a.getWidth() : a.getHeight();
+    int k = transA ? a.getHeight() : a.getWidth();
+    int n = transB ? b.getHeight() : b.getWidth();
+    // A view with unit row stride is a transposed row-major block
+    bool rowMajorA = a.getColStride() == 1;
+    bool rowMajorB = b.getColStride() == 1;
+    gemm<T>(rowMajorA ? transA : !transA, rowMajorB ? transB : !transB, m, n, k, a.data(),
+            rowMajorA ? a.getRowStride() : a.getColStride(), b.data(),
+            rowMajorB ? b.getRowStride() : b.getColStride(), this->data(), this->width,
+            accumulate);
 }
 
-template <typename T> Matrix<T> Matrix<T>::operator+(const Matrix<T>& mat) {
-    if (this->width != mat.getWidth() || this->height != mat.getHeight()) {
-        throw std::invalid_argument("Matrix dimensions must match for addition");
+template <typename T>
+Matrix<T>& Matrix<T>::assignProduct(MatrixView<const T> a, MatrixView<const T> b, bool transA,
+                                    bool transB) {
+    int m = transA ? a.getWidth() : a.getHeight();
+    int k = transA ? a.getHeight() : a.getWidth();
+    int n = transB ? b.getHeight() : b.getWidth();
+    if (k != (transB ? b.getWidth() : b.getHeight())) {
+        throw std::invalid_argument("Matrix multiplication requires width of first matrix to equal "
+                                    "height of second matrix");
     }
-    Matrix<T> newMat(this->width, this->height);
-#pragma omp parallel for
-    for (size_t j = 0; j < this->height; ++j) {    // rows iterator
-        for (size_t i = 0; i < this->width; ++i) { // columns iterator
-            T newVal = this->values[(j * this->width) + i] + mat.getValue(i, j);
-            newMat.setValue(i, j, newVal);
-        }
+    if (this->overlaps(a) || this->overlaps(b)) {
+        throw std::invalid_argument("Matrix product can't be written over one of its operands");
     }
-    return newMat;
+    this->resize(n, m);
+    this->product(a, b, transA, transB, false);
+    return *this;
 }
 
-template <typename T> Matrix<T> Matrix<T>::operator-(const Matrix<T>& mat) {
-    if (this->width != mat.getWidth() || this->height != mat.getHeight()) {
-        throw std::invalid_argument("Matrix dimensions must match for subtraction");
+template <typename T>
+Matrix<T>& Matrix<T>::addProduct(MatrixView<const T> a, MatrixView<const T> b, bool transA,
+                                 bool transB) {
+    int m = transA ? a.getWidth() : a.getHeight();
+    int k = transA ? a.getHeight() : a.getWidth();
+    int n = transB ? b.getHeight() : b.getWidth();
+    if (k != (transB ? b.getWidth() : b.getHeight())) {
+        throw std::invalid_argument("Matrix multiplication requires width of first matrix to equal "
+                                    "height of second matrix");
     }
-    Matrix<T> newMat(this->width, this->height);
-#pragma omp parallel for
-    for (size_t j = 0; j < this->height; ++j) {    // rows iterator
-        for (size_t i = 0; i < this->width; ++i) { // columns iterator
-            T newVal = this->values[(j * this->width) + i] - mat.getValue(i, j);
-            newMat.setValue(i, j, newVal);
-        }
+    if (this->width != n || this->height != m) {
+        throw std::invalid_argument("Matrix dimensions must match the product for accumulation");
+    }
+    if (this->overlaps(a) || this->overlaps(b)) {
+        throw std::invalid_argument("Matrix product can't be written over one of its operands");
     }
+    this->product(a, b, transA, transB, true);
+    return *this;
+}
+
+template <typename T> Matrix<T> Matrix<T>::operator*(MatrixView<const T> mat) const {
+    Matrix<T> newMat;
+    newMat.assignProduct(*this, mat);
+    return newMat;
+}
+
+template <typename T> Matrix<T> Matrix<T>::transposedMultiply(MatrixView<const T> mat) const {
+    Matrix<T> newMat;
+    newMat.assignProduct(*this, mat, true, false);
     return newMat;
-}
\ No newline at end of file
+}
+
+template <typename T> Matrix<T> Matrix<T>::multiplyTransposed(MatrixView<const T> mat) const {
+    Matrix<T> newMat;
+    newMat.assignProduct(*this, mat, false, true);
+    return newMat;
+}
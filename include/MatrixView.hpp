@@ -0,0 +1,151 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <stdexcept>
+#include <type_traits>
+
+// Non-owning window over row-major (or strided) storage. rowStride and colStride are the distances
+// between consecutive rows and columns, so a transposed view or a range of rows or columns is just
+// a different set of numbers over the same memory. Views are cheap to copy and must not outlive the
+// storage they point to. MatrixView<const T> is the read-only form every Matrix operation and Layer
+// method accepts, a Matrix converts to it implicitly.
+template <typename T> class MatrixView {
+  private:
+    T* values;
+    int width;
+    int height;
+    size_t rowStride;
+    size_t colStride;
+
+  public:
+    using ValueType = std::remove_const_t<T>;
+    MatrixView();
+    MatrixView(T* values, int w, int h, size_t rowStride, size_t colStride = 1);
+    template <typename U>
+        requires std::is_convertible_v<U*, T*>
+    MatrixView(const MatrixView<U>& view);
+    T* data() const;
+    int getWidth() const;
+    int getHeight() const;
+    size_t getRowStride() const;
+    size_t getColStride() const;
+    ValueType getValue(int x, int y) const;
+    void setValue(int x, int y, ValueType value) const;
+    bool isContiguous() const;
+    // Whether any element of the view is also one of other's
+    bool overlaps(MatrixView<const ValueType> other) const;
+    // Whether reading the view while writing other could see an element other already changed,
+    // which takes overlapping storage laid out differently
+    bool aliases(MatrixView<const ValueType> other) const;
+    MatrixView<T> transpose() const;
+    MatrixView<T> rows(int first, int count) const;
+    MatrixView<T> columns(int first, int count) const;
+};
+
+// Implementation
+template <typename T> MatrixView<T>::MatrixView() {
+    this->values = nullptr;
+    this->width = 0;
+    this->height = 0;
+    this->rowStride = 0;
+    this->colStride = 1;
+}
+
+template <typename T>
+MatrixView<T>::MatrixView(T* values, int w, int h, size_t rowStride, size_t colStride) {
+    this->values = values;
+    this->width = w;
+    this->height = h;
+    this->rowStride = rowStride;
+    this->colStride = colStride;
+}
+
+template <typename T>
+template <typename U>
+    requires std::is_convertible_v<U*, T*>
+MatrixView<T>::MatrixView(const MatrixView<U>& view) {
+    this->values = view.data();
+    this->width = view.getWidth();
+    this->height = view.getHeight();
+    this->rowStride = view.getRowStride();
+    this->colStride = view.getColStride();
+}
+
+template <typename T> T* MatrixView<T>::data() const {
+    return this->values;
+}
+
+template <typename T> int MatrixView<T>::getWidth() const {
+    return this->width;
+}
+
+template <typename T> int MatrixView<T>::getHeight() const {
+    return this->height;
+}
+
+template <typename T> size_t MatrixView<T>::getRowStride() const {
+    return this->rowStride;
+}
+
+template <typename T> size_t MatrixView<T>::getColStride() const {
+    return this->colStride;
+}
+
+template <typename T>
+typename MatrixView<T>::ValueType MatrixView<T>::getValue(int x, int y) const {
+    return this->values[(y * this->rowStride) + (x * this->colStride)];
+}
+
+template <typename T> void MatrixView<T>::setValue(int x, int y, ValueType value) const {
+    static_assert(!std::is_const_v<T>, "Can't write through a read-only view");
+    this->values[(y * this->rowStride) + (x * this->colStride)] = value;
+}
+
+// True when the view covers one dense row-major block, as a whole Matrix or a range of its rows
+template <typename T> bool MatrixView<T>::isContiguous() const {
+    return this->colStride == 1 && (this->rowStride == this->width || this->height <= 1);
+}
+
+// Compares the spans from the first element to the last, which strided views may not fill
+template <typename T> bool MatrixView<T>::overlaps(MatrixView<const ValueType> other) const {
+    if (this->width <= 0 || this->height <= 0 || other.getWidth() <= 0 ||
+        other.getHeight() <= 0) {
+        return false;
+    }
+    const ValueType* begin = this->values;
+    const ValueType* end = begin + ((this->height - 1) * this->rowStride) +
+                           ((this->width - 1) * this->colStride) + 1;
+    const ValueType* otherBegin = other.data();
+    const ValueType* otherEnd = otherBegin + ((other.getHeight() - 1) * other.getRowStride()) +
+                                ((other.getWidth() - 1) * other.getColStride()) + 1;
+    std::less<const ValueType*> before;
+    return before(begin, otherEnd) && before(otherBegin, end);
+}
+
+template <typename T> bool MatrixView<T>::aliases(MatrixView<const ValueType> other) const {
+    bool sameLayout = this->values == other.data() && this->width == other.getWidth() &&
+                      this->height == other.getHeight() &&
+                      this->rowStride == other.getRowStride() &&
+                      this->colStride == other.getColStride();
+    return !sameLayout && this->overlaps(other);
+}
+
+template <typename T> MatrixView<T> MatrixView<T>::transpose() const {
+    return MatrixView<T>(this->values, this->height, this->width, this->colStride, this->rowStride);
+}
+
+template <typename T> MatrixView<T> MatrixView<T>::rows(int first, int count) const {
+    if (first < 0 || count < 0 || first + count > this->height) {
+        throw std::out_of_range("Row range outside of the view");
+    }
+    return MatrixView<T>(this->values + (first * this->rowStride), this->width, count,
+                         this->rowStride, this->colStride);
+}
+
+template <typename T> MatrixView<T> MatrixView<T>::columns(int first, int count) const {
+    if (first < 0 || count < 0 || first + count > this->width) {
+        throw std::out_of_range("Column range outside of the view");
+    }
+    return MatrixView<T>(this->values + (first * this->colStride), count, this->height,
+                         this->rowStride, this->colStride);
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Model files as NeuralNetwork::saveWeights writes them: a 64-byte header, a table with one entry
+// per section, then the sections, each 64-byte aligned and with its own checksum. Tensors are kept
+// row-major in the precision they were trained in, so a network of that precision reads them in
+// place from a read-only memory map. Loading then costs a few system calls, and every process
+// serving the same file shares one copy of it in the page cache. Files are written aside and
+// renamed over the old one, so processes still mapping the old one keep it whole.
+class ModelFile {
+  public:
+    enum SectionKind : uint32_t {
+        LAYERS = 1,  // int32 node counts of every layer, then the activation of every one but the
+                     // input, width being the layer count
+        WEIGHTS = 2, // one per layer after the input, nodes x inputs
+        BIASES = 3,  // one per layer after the input, nodes x 1
+        PACKED = 4,  // weights as SparseInput::pack lays them out, for layers taking sparse input
+    };
+    struct Section {
+        uint32_t kind;
+        uint32_t layer; // weighted layer the tensor belongs to, 0 for the first after the input
+        uint32_t width;
+        uint32_t height;
+        uint64_t offset; // from the start of the file
+        uint64_t bytes;
+        uint64_t checksum;
+        uint64_t reserved;
+    };
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t scalarBytes; // 4 for float tensors, 8 for double
+        uint32_t sectionCount;
+        uint32_t reserved;
+        uint64_t fileBytes;
+        uint64_t tableChecksum;
+        char padding[24];
+    };
+    // A section to write, its bytes taken from data
+    struct Blob {
+        uint32_t kind;
+        uint32_t layer;
+        uint32_t width;
+        uint32_t height;
+        const void* data;
+        size_t bytes;
+    };
+
+  private:
+    const unsigned char* mapped;
+    size_t mappedBytes;
+    const Header* header;
+    const Section* sections;
+    void close();
+
+  public:
+    ModelFile();
+    ModelFile(const ModelFile&) = delete;
+    ModelFile& operator=(const ModelFile&) = delete;
+    ~ModelFile();
+    // Whether path starts like a model file, older .bin files don't
+    static bool recognizes(std::string path);
+    static bool write(std::string path, uint32_t scalarBytes, const std::vector<Blob>& blobs);
+    // Maps path and checks the header and section table. Returns false, saying why on std::cerr,
+    // when it isn't a model file or is damaged. Section checksums are left to intact, reading
+    // every page is what mapping avoids
+    bool open(std::string path);
+    uint32_t getScalarBytes() const;
+    // The section of kind for layer, null when the file has none
+    const Section* find(SectionKind kind, uint32_t layer = 0) const;
+    const void* data(const Section& section) const;
+    // Reads section through to check its checksum
+    bool intact(const Section& section) const;
+};
@@ -1,40 +1,172 @@
 #pragma once
+#include "BatchLoader.hpp"
+#include "Checkpoint.hpp"
+#include "Dataset.hpp"
 #include "Layer.hpp"
 #include "Matrix.hpp"
+#include "ModelFile.hpp"
+#include "Optimizer.hpp"
+#include "RingAllreduce.hpp"
+#include "ShardedDataset.hpp"
+#include "Transport.hpp"
+#include <functional>
+#include <memory>
+#include <random>
 #include <vector>
 
-class NeuralNetwork {
+// T is the scalar type used for training and inference. Models are stored in the precision they
+// were trained in (see ModelFile), one saved by either precision loads into the other converted
+template <typename T = double> class NeuralNetwork {
   public:
+    // How the model does on a set of labelled samples
+    struct Evaluation {
+        size_t samples;
+        double accuracy;     // percentage whose highest output is their target class
+        double crossEntropy; // mean of -sum(target * log(output)) per sample
+        double averageCost;  // mean squared error per output, averaged over the samples
+        double minCost;      // lowest and highest of those per-sample errors
+        double maxCost;
+        std::vector<size_t> confusion; // targets x targets, row the true class, column the output
+    };
     struct TrainResponse {
         double averageCost;
         double minCost;
         double maxCost;
         double hitPercentage;
+        // Arena blocks (Matrix/GEMM storage) taken from the system after step one. Other heap
+        // allocations aren't counted
+        size_t steadyStateSystemBlocks;
+        double dataStallSeconds;       // training time spent waiting for the batch loader
+        double crossEntropy;
+        std::vector<size_t> confusion; // see Evaluation
+        int epochsTrained;             // fewer than asked for when validation stopped early
     };
-    struct Sample {
-        Matrix<double> input;
-        Matrix<double> output;
+    // Everything an inference writes, owned by the caller. Threads with a scratch each can run one
+    // network at the same time
+    struct Scratch {
+        std::vector<typename Layer<T>::Cache> caches; // only the activations are used
     };
 
   private:
+    // What every kind of training data shares: the link to the other ranks and a generator they
+    // all seed alike, so they agree on every shuffle
+    struct TrainingRun {
+        std::unique_ptr<RingAllreduce<T>> allreduce;
+        int rank;
+        int worldSize;
+        std::mt19937 generator;
+        std::vector<int> order; // shuffled sample indices, or training shard indices when sharded
+        std::shared_ptr<const Checkpoint<T>> resumed; // null unless carrying on from one
+    };
+
     std::vector<int> layersConfig;
-    std::vector<Layer> layers;
-    Matrix<double> output;
+    std::vector<Layer<T>> layers;
+    Matrix<T> output;
+    int pipelineStages;
+    int pipelineMicroBatches;
+    int dataParallelWorkers;
+    bool hogwild;
+    std::shared_ptr<Transport> transport;
+    int loaderThreads;
+    int prefetchBatches;
+    typename BatchLoader<T>::Transform batchTransform;
+    std::shared_ptr<const Optimizer<T>> optimizer;
+    int validationInterval;
+    int validationPatience;
+    // Evaluation keeps its own scratch, sized for its batches, out of the training caches
+    Scratch evaluationScratch;
+    Matrix<T> evaluationInput; // one sample per row
+    Matrix<T> evaluationTarget;
+    std::string checkpointPath;
+    int checkpointInterval;
+    std::shared_ptr<const Checkpoint<T>> resumeState; // taken by the next training run
+    std::shared_ptr<const ModelFile> modelFile;       // the layers read their parameters from it
     void randomize();
-    void backwards(Matrix<double> target);
+    void reserveWorkspace(int batchSize);
+    void backwards(MatrixView<const T> target);
     void update(double learningRate);
+    // Sets up the run, with order holding 0 to orderSize - 1 or the checkpoint's resumed order
+    TrainingRun beginTraining(int featureCount, int targetCount, size_t sampleCount,
+                              size_t orderSize);
+    // Trains for epochs on the batches of loader, beginEpoch shuffling the order of an epoch,
+    // queueing its batches from the given step on and returning how many it has in all, validate
+    // evaluating the held-out samples. Fills the allocation and epoch figures of response
+    void trainEpochs(TrainingRun& run, BatchLoader<T>& loader,
+                     const std::function<int(int firstStep)>& beginEpoch,
+                     const std::function<Evaluation()>& validate, int epochs, int batchSize,
+                     double learningRate, double learningRateUpdate, TrainResponse& response);
+    // Copies the parameters and optimizer state of every layer into checkpoint
+    void capture(Checkpoint<T>& checkpoint) const;
+    void loadLegacyWeights(std::string path);
+    void reserveEvaluation();
+    // Evaluates every sample next writes until it returns false
+    Evaluation evaluate(const std::function<bool(T* features, T* target)>& next);
+    static TrainResponse respond(const Evaluation& test);
 
   public:
     NeuralNetwork();
     NeuralNetwork(std::vector<int> layersConfig);
-    NeuralNetwork::TrainResponse train(std::vector<std::vector<double>> inputs,
-                                       std::vector<std::vector<double>> outputs,
-                                       float trainingUseRatio, int epochs = 1, int batchSize = 32,
+    // Trains on the first trainingUseRatio of a shuffle of data and tests on the rest. The learning
+    // rate is multiplied by learningRateUpdate before every epoch but the first and every tenth
+    NeuralNetwork::TrainResponse train(const Dataset<T>& data, float trainingUseRatio,
+                                       int epochs = 1, int batchSize = 32,
+                                       double learningRate = 0.01, double learningRateUpdate = 1);
+    // Same, streaming shards from disk. The first trainingUseRatio of the samples, in shard order,
+    // train and the rest test. Every epoch shuffles the training shards and the samples within
+    // the dataset's shuffle buffer. Distributed ranks take turns through the shuffled shards and
+    // step as many times as the one with the fewest samples can
+    NeuralNetwork::TrainResponse train(const ShardedDataset<T>& data, float trainingUseRatio,
+                                       int epochs = 1, int batchSize = 32,
                                        double learningRate = 0.01, double learningRateUpdate = 1);
-    Matrix<double> foward(Matrix<double> input);
+    const Matrix<T>& foward(MatrixView<const T> input);
+    // Scratch for inputs of up to batchSize samples, bigger ones resize it when they run
+    Scratch makeScratch(int batchSize = 1) const;
+    // Outputs for input, one sample per column, written to scratch and valid until its next use.
+    // Only reads the network, so any number of threads can share it while it isn't training. Big
+    // batches still spread over OpenMP threads, serving threads may want omp_set_num_threads(1)
+    const Matrix<T>& infer(MatrixView<const T> input, Scratch& scratch) const;
+    // Runs the given samples of data through the model in large batches and measures the outputs
+    // against their targets. Training caches are left alone, so it can run between epochs
+    Evaluation evaluate(const Dataset<T>& data, const std::vector<int>& samples);
+    const std::vector<Layer<T>>& getLayers() const;
     void setLayersConfig(std::vector<int> layersConfig);
-    void setLayerWeights(size_t layerIt, Matrix<double> weights);
-    void setLayerBiases(size_t layerIt, Matrix<double> biases);
-    void saveWeights(std::string path);
-    void loadWeights(std::string path);
-};
\ No newline at end of file
+    // Trains with the layers split over this many pipeline stages (see Pipeline), 1 turns it off.
+    // Batches are cut into microBatches pieces, so the batch size must be a multiple of it
+    void setPipeline(int stages, int microBatches);
+    // Trains with every batch split over this many worker threads (see DataParallel), 1 turns it
+    // off. Hogwild workers update the weights without waiting for each other. Pipelines and
+    // workers don't combine
+    void setDataParallel(int workers, bool hogwild = false);
+    // Trains as one rank of several processes linked by transport, null turns it off. Every rank
+    // loads the same samples, they agree on one shuffle and take turns through its batches, and
+    // the gradients are averaged over all ranks before each update (see RingAllreduce). Ranks
+    // combine with pipelines and synchronous workers but not with Hogwild ones
+    void setDistributed(std::shared_ptr<Transport> transport);
+    // Batches are gathered by this many background threads, prefetch of them ahead of the step
+    // being trained (see BatchLoader). transform, when set, runs on every gathered sample
+    void setDataLoader(int threads, int prefetch,
+                       typename BatchLoader<T>::Transform transform = nullptr);
+    // Evaluates the held-out samples every interval epochs while training, 0 turns it off. Training
+    // stops once patience evaluations in a row haven't lowered the cross-entropy, 0 never stops
+    void setValidation(int interval, int patience = 0);
+    // Optimizer the layers are trained with, plain SGD until one is set. Their state starts over
+    void setOptimizer(std::shared_ptr<const Optimizer<T>> optimizer);
+    // Saves a checkpoint to path every interval training steps, 0 turns it off. Files are written
+    // by a background thread while training goes on, a checkpoint falling due while the last one
+    // is still being written is skipped. Distributed runs leave them to rank 0
+    void setCheckpoints(std::string path, int interval);
+    // Loads the parameters and optimizer state of the checkpoint at path, and the next training
+    // run carries on from the step it was taken at, drawing the same batches, so given the same
+    // data and settings it ends with the weights an uninterrupted run would have. Distributed
+    // ranks all resume from the same file. The optimizer must be set before. False when it can't
+    // be read or doesn't fit the layers
+    bool resume(std::string path);
+    void setLayerWeights(size_t layerIt, Matrix<T> weights);
+    void setLayerBiases(size_t layerIt, Matrix<T> biases);
+    void saveWeights(std::string path) const;
+    // Loads a model saved by saveWeights. When it was saved in this precision the layers read the
+    // parameters in place from a memory map of the file, until training copies them. verify reads
+    // the whole file to check its checksums, which mapping otherwise skips. Older .bin files,
+    // doubles after the layer sizes, are read into memory
+    void loadWeights(std::string path, bool verify = false);
+};
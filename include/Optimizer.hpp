@@ -0,0 +1,70 @@
+#pragma once
+#include <cstddef>
+#include <span>
+
+// Turns the averaged gradients of a step into parameter updates. Layers keep the state buffers
+// next to their weights and biases and hand all their tensors over at once with their buffers. The
+// optimizer updates the parameters and the state of every tensor in a single parallel pass.
+template <typename T> class Optimizer {
+  public:
+    // One parameter tensor, its gradient and its state buffers, all count values long. Buffers
+    // past stateBuffers() are null
+    struct Tensor {
+        T* params;
+        const T* grads;
+        T* first;
+        T* second;
+        size_t count;
+    };
+
+  private:
+    double maxGradientNorm;
+
+  public:
+    Optimizer();
+    virtual ~Optimizer() = default;
+    // State buffers the method keeps per parameter tensor, zeroed before the first step
+    virtual int stateBuffers() const = 0;
+    // Applies training step number step (counting from 1) to the tensors, every gradient
+    // multiplied by gradientScale first. They are cut into chunks that threads share out together
+    virtual void update(std::span<const Tensor> tensors, T learningRate, T gradientScale,
+                        long step) const = 0;
+    // Steps whose gradient norm over all layers is above maxNorm get their gradients scaled down
+    // to it, 0 turns clipping off
+    void clipGradients(double maxNorm);
+    double getMaxGradientNorm() const;
+    // What gradients with this squared norm get multiplied by, 1 unless clipping cuts them
+    double clipScale(double squaredNorm) const;
+};
+
+// Stochastic gradient descent, with heavy-ball or Nesterov momentum when momentum is nonzero
+template <typename T> class SGD : public Optimizer<T> {
+  private:
+    T momentum;
+    bool nesterov;
+
+  public:
+    SGD(double momentum = 0, bool nesterov = false);
+    int stateBuffers() const override;
+    void update(std::span<const typename Optimizer<T>::Tensor> tensors, T learningRate,
+                T gradientScale, long step) const override;
+};
+
+// Adam. A nonzero weightDecay makes it AdamW: the decay shrinks the parameters directly instead of
+// going through the gradient and the moment estimates
+template <typename T> class Adam : public Optimizer<T> {
+  private:
+    T beta1;
+    T beta2;
+    T epsilon;
+    T weightDecay;
+
+  public:
+    Adam(double beta1 = 0.9, double beta2 = 0.999, double epsilon = 1e-8, double weightDecay = 0);
+    int stateBuffers() const override;
+    void update(std::span<const typename Optimizer<T>::Tensor> tensors, T learningRate,
+                T gradientScale, long step) const override;
+};
+
+// Sum of the squared values, gradient norms are built from it
+template <typename T> double squaredNorm(const T* values, size_t count);
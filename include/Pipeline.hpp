@@ -0,0 +1,48 @@
+#pragma once
+#include "Layer.hpp"
+#include "MatrixView.hpp"
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// Pipeline-parallel training step. The layers are split into contiguous stages of roughly equal
+// work, each run by its own thread pinned to its own set of cores, and every batch is cut into
+// micro-batches. A stage starts on micro-batch m as soon as the previous stage hands it over, so
+// the forward and backward passes of different micro-batches overlap across stages. All
+// micro-batches are flushed before step returns, leaving the same averaged gradients a single
+// pass over the whole batch would (GPipe schedule).
+template <typename T> class Pipeline {
+  private:
+    struct Stage {
+        size_t firstLayer;
+        size_t endLayer;
+        std::vector<int> cores;
+        std::atomic<int> fowardDone;   // micro-batches this stage has passed on
+        std::atomic<int> backwardDone; // deltas this stage has handed back
+        std::thread worker;
+    };
+
+    std::vector<Layer<T>>& layers;
+    std::vector<std::unique_ptr<Stage>> stages;
+    std::vector<std::vector<typename Layer<T>::Cache>> caches; // [layer][micro-batch]
+    int microBatches;
+    int microBatchSize;
+    MatrixView<const T> input;
+    MatrixView<const T> target;
+    std::atomic<int> generation; // bumped once per step to wake the workers
+    std::atomic<int> pending;    // stages still working on the current step
+    bool stopping;
+
+    void run(size_t stageIt);
+    void runStep(size_t stageIt);
+
+  public:
+    Pipeline(std::vector<Layer<T>>& layers, int stageCount, int microBatches, int batchSize);
+    Pipeline(const Pipeline&) = delete;
+    Pipeline& operator=(const Pipeline&) = delete;
+    ~Pipeline();
+    // Forward and backward for one batch. Gradients are left on the layers, ready for update
+    void step(MatrixView<const T> input, MatrixView<const T> target);
+    int getStageCount() const;
+};
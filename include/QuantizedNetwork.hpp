@@ -0,0 +1,69 @@
+#pragma once
+#include "Arena.hpp"
+#include "Matrix.hpp"
+#include "NeuralNetwork.hpp"
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Int8 inference for a trained network (ReLU hidden layers, softmax output). Weights get one
+// symmetric scale per output channel, and the activations entering each layer get one scale
+// calibrated on sample inputs. Layers accumulate 8-bit products into int32. Hidden layers
+// requantize with the ReLU folded in, so activations stay 8-bit from input to logits.
+class QuantizedNetwork {
+  public:
+    struct Report {
+        double floatAccuracy;     // % of samples the float model classifies correctly
+        double quantizedAccuracy; // same for the int8 model
+        double agreement;         // % of samples where both pick the same class
+        double maxProbabilityError;
+        double floatSeconds;
+        double quantizedSeconds;
+    };
+
+  private:
+    using Weights = std::vector<int8_t, ArenaAllocator<int8_t>>;
+    using Activations = std::vector<uint8_t, ArenaAllocator<uint8_t>>;
+    struct QuantizedLayer {
+        int inputs;
+        int outputs;
+        size_t stride; // inputs padded for the SIMD kernels
+        size_t rows;   // outputs padded to whole kernel tiles
+        bool relu;
+        float inputScale;
+        int inputOffset;             // zero point of the stored inputs
+        Weights weights;             // rows x stride, row-major
+        std::vector<float> scales;   // per output channel, weight scale * input scale
+        std::vector<float> requant;  // scales over the next layer's input scale, hidden only
+        std::vector<int32_t> biases; // in accumulator units, zero point folded in
+    };
+
+    std::vector<QuantizedLayer> layers;
+    std::vector<Activations> inputs; // activations entering each layer, one sample per row
+    std::vector<float> logits;
+    Matrix<float> output;
+
+    void allocate(QuantizedLayer& layer);
+    template <typename T> const Matrix<float>& run(MatrixView<const T> input);
+
+  public:
+    QuantizedNetwork();
+    // calibration holds sample inputs as columns, like NeuralNetwork::foward takes them. Defined
+    // for float and double models
+    template <typename T>
+    QuantizedNetwork(const NeuralNetwork<T>& model,
+                     std::type_identity_t<MatrixView<const T>> calibration);
+    const Matrix<float>& foward(MatrixView<const float> input);
+    const Matrix<float>& foward(MatrixView<const double> input);
+    // Runs both models over the labelled samples (one per column) in batches and compares them
+    template <typename T>
+    Report compare(const NeuralNetwork<T>& model,
+                   std::type_identity_t<MatrixView<const T>> samples,
+                   std::type_identity_t<MatrixView<const T>> labels, int batchSize = 256);
+    size_t weightBytes() const;
+    void save(std::string path);
+    // False, leaving no layers, when the file can't be read or holds a layer chain, zero point or
+    // scale run couldn't use
+    bool load(std::string path);
+};
@@ -0,0 +1,31 @@
+#pragma once
+#include "Layer.hpp"
+#include "Transport.hpp"
+#include <memory>
+#include <vector>
+
+// Collectives over a ring of trainer processes (see Transport). sum is the ring allreduce: the
+// values are cut into one chunk per rank, worldSize - 1 exchanges with the neighbours
+// (reduce-scatter) leave every rank owning one fully summed chunk, and worldSize - 1 more
+// (allgather) pass the summed chunks round. Each rank sends about twice the data whatever the
+// world size, and since every chunk is summed once, in one order, all ranks end bit-identical.
+template <typename T> class RingAllreduce {
+  private:
+    std::shared_ptr<Transport> transport;
+    std::vector<T> values;   // every layer's dW and db back to back
+    std::vector<T> incoming; // chunk received from the previous rank
+
+  public:
+    // Sizes its buffers for the layers' gradients, so training steps don't allocate
+    RingAllreduce(std::shared_ptr<Transport> transport, std::vector<Layer<T>>& layers);
+    int getRank() const;
+    int getWorldSize() const;
+    // Sums count values over all ranks, every rank ends with the result in place
+    void sum(T* values, size_t count);
+    // Overwrites bytes on every rank with rank 0's
+    void broadcast(void* data, size_t bytes);
+    // Replaces the layers' gradients with their average over all ranks
+    void averageGradients(std::vector<Layer<T>>& layers);
+    // Gives every rank rank 0's weights and biases
+    void broadcastParameters(std::vector<Layer<T>>& layers);
+};
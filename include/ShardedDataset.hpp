@@ -0,0 +1,89 @@
+#pragma once
+#include "Dataset.hpp"
+#include <cstddef>
+#include <random>
+#include <string>
+#include <vector>
+
+// Training samples kept on disk as shard files, prefix-00000.shard, prefix-00001.shard and so on,
+// and streamed through memory maps, so datasets far bigger than memory train in a bounded amount
+// of it and nothing has to be parsed before the first step. Each shard is a 64-byte header
+// followed by its features, one row per sample as bytes, float or double, and its targets as
+// float, each block 64-byte aligned. Opening a dataset only reads the headers.
+template <typename T> class ShardedDataset {
+  public:
+    // Samples first to end - 1 of a shard
+    struct Range {
+        int shard;
+        size_t first;
+        size_t end;
+    };
+
+    // Reads a list of ranges in order, one shard mapped at a time while the kernel reads ahead
+    // into the next. Samples pass through a shuffle buffer, each one handed out is picked at
+    // random among the next shuffleBuffer to read, so order within shards is mixed as well
+    class Stream {
+      private:
+        const ShardedDataset& data;
+        std::vector<Range> ranges;
+        size_t rangeIt;
+        size_t position; // next sample of the current range
+        int mappedShard;
+        const unsigned char* mapped;
+        size_t mappedBytes;
+        size_t capacity;
+        size_t buffered;
+        std::vector<T> bufferFeatures;
+        std::vector<T> bufferTargets;
+        std::mt19937 generator;
+        bool read(T* features, T* target);
+        void map(int shard);
+        void unmap();
+        void readAhead();
+
+      public:
+        // shuffleBuffer 0 reads the samples in order
+        Stream(const ShardedDataset& data, size_t shuffleBuffer);
+        Stream(const Stream&) = delete;
+        Stream& operator=(const Stream&) = delete;
+        ~Stream();
+        // Starts over on ranges, shuffling with seed
+        void reset(std::vector<Range> ranges, unsigned int seed);
+        // Writes the next sample, false once every range has been read
+        bool next(T* features, T* target);
+        // Reads past the next samples, returning how many there were
+        size_t skip(size_t samples);
+    };
+
+  private:
+    struct Shard {
+        std::string path;
+        size_t samples;
+        int featureBytes; // 1 for bytes scaled by byteScale, otherwise float or double
+        double byteScale;
+        size_t featuresOffset;
+        size_t targetsOffset;
+        size_t fileBytes;
+    };
+
+    std::vector<Shard> shards;
+    int featureCount;
+    int targetCount;
+    size_t sampleCount;
+    size_t shuffleBuffer;
+
+  public:
+    ShardedDataset();
+    // Opens every shard of prefix. Streams shuffle through shuffleBuffer samples
+    ShardedDataset(std::string prefix, size_t shuffleBuffer = 4096);
+    // Writes the samples of data in order as shards of samplesPerShard samples each, features
+    // keeping the dataset's storage. Returns the paths written, none when it fails
+    static std::vector<std::string> write(const Dataset<T>& data, const std::vector<int>& order,
+                                          std::string prefix, size_t samplesPerShard);
+    size_t size() const;
+    int getFeatureCount() const;
+    int getTargetCount() const;
+    int shardCount() const;
+    size_t shardSize(int shard) const;
+    size_t getShuffleBuffer() const;
+};
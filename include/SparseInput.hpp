@@ -0,0 +1,48 @@
+#pragma once
+#include "Arena.hpp"
+#include "Matrix.hpp"
+#include <vector>
+
+// Nonzero entries of a layer input (features x samples), one list per sample. Inputs like MNIST
+// digits are mostly exact zeros, so products against the input only need to visit these entries.
+// The forward product adds up one weight row per nonzero feature of a sample, reading the weights
+// from a panel layout (see pack) so each row it touches is one contiguous run. The weight gradient
+// runs the dense product over only the features some sample in the batch uses, when few enough are.
+template <typename T> class SparseInput {
+  private:
+    using Indices = std::vector<int, ArenaAllocator<int>>;
+    using Values = std::vector<T, ArenaAllocator<T>>;
+
+    bool active;
+    MatrixView<const T> input;
+    int features;
+    int samples;
+    Indices starts; // sample n owns entries starts[n] .. starts[n + 1]
+    Indices indices;
+    Values values;
+    Indices used;  // features nonzero in at least one sample, in order
+    Indices slots; // position of each feature in used, -1 when no sample uses it
+    Matrix<T> compacted;
+    Matrix<T> product;
+
+  public:
+    SparseInput();
+    // Lays a weight matrix (outputs x features) out the way multiply reads it: panels of a fixed
+    // number of outputs, each holding the feature rows of that panel one after the other
+    static void pack(MatrixView<const T> weights, Matrix<T>& packed);
+    // Outputs per panel, the width of a packed matrix
+    static int panelWidth();
+    // Indexes input when at most maxDensity of its entries are nonzero. Otherwise, or with a
+    // maxDensity of 0, the set is left inactive and the caller should take the dense path
+    bool build(MatrixView<const T> input, double maxDensity);
+    // Sizes every buffer build and multiplyTransposed use for inputs of up to features x samples,
+    // with deltas of outputs rows, so that no batch allocates whatever its density
+    void reserve(int features, int samples, int outputs, double maxDensity);
+    bool isActive() const;
+    double density() const;
+    // out (+)= W * input, packedWeights holding W (outputs x features) as laid out by pack
+    void multiply(MatrixView<const T> packedWeights, int outputs, Matrix<T>& out,
+                  bool accumulate) const;
+    // out (+)= deltas * input^T, the weight gradient of the layer that received the input
+    void multiplyTransposed(MatrixView<const T> deltas, Matrix<T>& out, bool accumulate);
+};
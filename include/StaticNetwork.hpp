@@ -0,0 +1,313 @@
+#pragma once
+#include "ModelFile.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <span>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define STATIC_NETWORK_X86
+#endif
+
+// Activation of a StaticNetwork layer, numbered like Layer::ActivationFunction in model files
+enum class StaticActivation : int32_t { SIGMOID = 0, RELU = 1, SOFTMAX = 2 };
+// The activation of every layer after the input, in order
+template <StaticActivation... Activations> struct StaticActivations {};
+
+template <typename T, typename Activations, int... Sizes> class StaticNetwork;
+
+// Inference for a network whose shape is fixed at compile time, Sizes being the node count of each
+// layer from input to output and Activations the activation of each layer after the input, such
+// as StaticActivations<RELU, SOFTMAX> for NeuralNetwork's hidden ReLU and softmax output. Models
+// saved with other activations are refused. Weights, biases and activations live in aligned member
+// arrays, so foward never allocates. Every loop runs over a compile-time trip count, and outputs
+// are padded to whole panels, so the kernels have no tails. It handles one sample per call, the
+// interactive case. Production shapes take megabytes, so create it with new rather than on the
+// stack.
+template <typename T, StaticActivation... Activations, int... Sizes>
+class StaticNetwork<T, StaticActivations<Activations...>, Sizes...> {
+    static_assert(std::is_same_v<T, float> || std::is_same_v<T, double>,
+                  "StaticNetwork runs in float or double");
+    static_assert(sizeof...(Sizes) >= 2, "A network needs an input and an output layer");
+    static_assert(((Sizes > 0) && ...), "Every layer needs at least one node");
+    static_assert(sizeof...(Activations) == sizeof...(Sizes) - 1,
+                  "Every layer after the input needs an activation");
+
+  public:
+    static constexpr std::array<int, sizeof...(Sizes)> SIZES = {Sizes...};
+    static constexpr std::array<StaticActivation, sizeof...(Activations)> ACTIVATIONS = {
+        Activations...};
+    static constexpr int LAYERS = sizeof...(Sizes) - 1;
+    static constexpr int INPUTS = SIZES.front();
+    static constexpr int OUTPUTS = SIZES.back();
+
+  private:
+    // Outputs one kernel pass keeps in registers, four AVX-512 or eight AVX2 accumulators
+    static constexpr int PANEL = 256 / sizeof(T);
+    static constexpr int MAX_INPUTS = *std::max_element(SIZES.begin(), SIZES.end() - 1);
+
+    template <int Inputs, int Outputs> struct DenseLayer {
+        static constexpr int PANELS = (Outputs + PANEL - 1) / PANEL;
+        // Panel p holds the weights of outputs p * PANEL .. (p + 1) * PANEL as one row of PANEL
+        // per input, so a nonzero input adds one contiguous row. Padding outputs have zero weights
+        alignas(64) std::array<T, PANELS * Inputs * PANEL> weights;
+        alignas(64) std::array<T, PANELS * PANEL> biases;
+        alignas(64) std::array<T, PANELS * PANEL> output;
+    };
+
+    template <size_t... I>
+    static std::tuple<DenseLayer<SIZES[I], SIZES[I + 1]>...> layer_types(std::index_sequence<I...>);
+    using Layers = decltype(layer_types(std::make_index_sequence<LAYERS>()));
+    using Kernel = void (StaticNetwork::*)(const T* input);
+
+    Layers layers;
+    // Nonzero inputs of the layer being computed, zero ones are skipped
+    alignas(64) std::array<int, MAX_INPUTS> active;
+    alignas(64) std::array<T, MAX_INPUTS> values;
+    Kernel kernel;
+
+    // output = activation(input * W + b) for one layer. Bytes is the vector width the panels are
+    // walked with, the ISA wrappers below pick it
+    template <int Bytes, StaticActivation Activation, int Inputs, int Outputs>
+    [[gnu::always_inline]] inline const T* layerProduct(DenseLayer<Inputs, Outputs>& layer,
+                                                        const T* input) {
+        typedef T Vec __attribute__((vector_size(Bytes)));
+        constexpr int LANES = Bytes / sizeof(T);
+        constexpr int VECTORS = std::min(8, PANEL / LANES);
+        int count = 0;
+        for (int k = 0; k < Inputs; ++k) {
+            this->active[count] = k;
+            this->values[count] = input[k];
+            count += input[k] != 0;
+        }
+        for (int p = 0; p < DenseLayer<Inputs, Outputs>::PANELS; ++p) {
+            const T* panel = layer.weights.data() + (p * Inputs * PANEL);
+            for (int part = p * PANEL; part < (p + 1) * PANEL; part += VECTORS * LANES) {
+                Vec acc[VECTORS];
+#pragma GCC unroll 8
+                for (int v = 0; v < VECTORS; ++v) {
+                    std::memcpy(&acc[v], layer.biases.data() + part + (v * LANES), Bytes);
+                }
+                const T* base = panel + (part - (p * PANEL));
+                for (int j = 0; j < count; ++j) {
+                    const T* row = base + (this->active[j] * PANEL);
+                    const T x = this->values[j];
+#pragma GCC unroll 8
+                    for (int v = 0; v < VECTORS; ++v) {
+                        Vec w;
+                        std::memcpy(&w, row + (v * LANES), Bytes);
+                        acc[v] += w * x;
+                    }
+                }
+#pragma GCC unroll 8
+                for (int v = 0; v < VECTORS; ++v) {
+                    std::memcpy(layer.output.data() + part + (v * LANES), &acc[v], Bytes);
+                }
+            }
+        }
+        T* out = layer.output.data();
+        if constexpr (Activation == StaticActivation::RELU) {
+#pragma omp simd
+            for (int o = 0; o < Outputs; ++o) {
+                out[o] = std::max(out[o], static_cast<T>(0));
+            }
+        } else if constexpr (Activation == StaticActivation::SIGMOID) {
+            for (int o = 0; o < Outputs; ++o) {
+                out[o] = 1 / (1 + std::exp(-out[o]));
+            }
+        } else {
+            T peak = *std::max_element(out, out + Outputs);
+            T sum = 0;
+            for (int o = 0; o < Outputs; ++o) {
+                out[o] = std::exp(out[o] - peak);
+                sum += out[o];
+            }
+            for (int o = 0; o < Outputs; ++o) {
+                out[o] /= sum;
+            }
+        }
+        return out;
+    }
+
+    template <int Bytes, size_t... I>
+    [[gnu::always_inline]] inline void run(const T* input, std::index_sequence<I...>) {
+        const T* current = input;
+        ((current = this->layerProduct<Bytes, ACTIVATIONS[I]>(std::get<I>(this->layers),
+                                                                current)),
+         ...);
+    }
+
+    void runGeneric(const T* input) {
+        this->run<16>(input, std::make_index_sequence<LAYERS>());
+    }
+#ifdef STATIC_NETWORK_X86
+    __attribute__((target("avx2,fma"))) void runAvx2(const T* input) {
+        this->run<32>(input, std::make_index_sequence<LAYERS>());
+    }
+    __attribute__((target("avx512f"))) void runAvx512(const T* input) {
+        this->run<64>(input, std::make_index_sequence<LAYERS>());
+    }
+#endif
+
+    // Follows NN_GEMM_ISA like the gemm kernels
+    static Kernel detectKernel() {
+        const char* forced = std::getenv("NN_GEMM_ISA");
+        std::string name(forced != nullptr ? forced : "");
+        if (name == "reference" || name == "generic") {
+            return &StaticNetwork::runGeneric;
+        }
+#ifdef STATIC_NETWORK_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && name != "avx2") {
+            return &StaticNetwork::runAvx512;
+        } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            return &StaticNetwork::runAvx2;
+        }
+#endif
+        return &StaticNetwork::runGeneric;
+    }
+
+    // Lays out one weight matrix (outputs x inputs, row-major) and bias column as panels
+    template <typename S, int Inputs, int Outputs>
+    static void fill_layer(const S* weights, const S* biases, DenseLayer<Inputs, Outputs>& layer) {
+        layer.weights.fill(0);
+        layer.biases.fill(0);
+        for (int o = 0; o < Outputs; ++o) {
+            T* column = layer.weights.data() + ((o / PANEL) * Inputs * PANEL) + (o % PANEL);
+            for (int k = 0; k < Inputs; ++k) {
+                column[k * PANEL] = static_cast<T>(weights[(o * Inputs) + k]);
+            }
+            layer.biases[o] = static_cast<T>(biases[o]);
+        }
+    }
+
+    // Reads one layer of an older .bin, stored as doubles
+    template <int Inputs, int Outputs>
+    static bool read_layer(std::ifstream& file, DenseLayer<Inputs, Outputs>& layer) {
+        std::vector<double> weights(static_cast<size_t>(Inputs) * Outputs);
+        std::vector<double> biases(Outputs);
+        file.read(reinterpret_cast<char*>(weights.data()), weights.size() * sizeof(double));
+        file.read(reinterpret_cast<char*>(biases.data()), biases.size() * sizeof(double));
+        if (!file) {
+            return false;
+        }
+        fill_layer(weights.data(), biases.data(), layer);
+        return true;
+    }
+
+    // Copies layer l of a model file, in whichever precision it was saved, after checking it
+    template <int Inputs, int Outputs>
+    static bool read_layer(const ModelFile& model, uint32_t l, DenseLayer<Inputs, Outputs>& layer) {
+        const ModelFile::Section* weights = model.find(ModelFile::WEIGHTS, l);
+        const ModelFile::Section* biases = model.find(ModelFile::BIASES, l);
+        size_t scalar = model.getScalarBytes();
+        if (!weights || !biases || weights->width != Inputs || weights->height != Outputs ||
+            weights->bytes != static_cast<size_t>(Inputs) * Outputs * scalar ||
+            biases->bytes != Outputs * scalar || !model.intact(*weights) ||
+            !model.intact(*biases)) {
+            return false;
+        }
+        if (scalar == sizeof(float)) {
+            fill_layer(static_cast<const float*>(model.data(*weights)),
+                       static_cast<const float*>(model.data(*biases)), layer);
+        } else {
+            fill_layer(static_cast<const double*>(model.data(*weights)),
+                       static_cast<const double*>(model.data(*biases)), layer);
+        }
+        return true;
+    }
+
+    // Model files are copied into the panels rather than read in place, so they are checked whole
+    bool loadModel(std::string path) {
+        ModelFile model;
+        if (!model.open(path)) {
+            return false;
+        }
+        const ModelFile::Section* layout = model.find(ModelFile::LAYERS);
+        std::array<int, sizeof...(Sizes)> config = {};
+        std::array<int32_t, LAYERS> activations = {};
+        if (layout && layout->width == config.size() &&
+            layout->bytes >= (config.size() + activations.size()) * sizeof(int32_t)) {
+            const int32_t* table = static_cast<const int32_t*>(model.data(*layout));
+            std::copy_n(table, config.size(), config.begin());
+            std::copy_n(table + config.size(), activations.size(), activations.begin());
+        }
+        if (config != SIZES) {
+            std::cerr << "Model topology doesn't match the network" << std::endl;
+            return false;
+        }
+        for (int l = 0; l < LAYERS; ++l) {
+            if (activations[l] != static_cast<int32_t>(ACTIVATIONS[l])) {
+                std::cerr << "Model activations don't match the network" << std::endl;
+                return false;
+            }
+        }
+        bool loaded = [&]<size_t... I>(std::index_sequence<I...>) {
+            return (read_layer(model, I, std::get<I>(this->layers)) && ...);
+        }(std::make_index_sequence<LAYERS>());
+        if (!loaded) {
+            std::cerr << "Model file is damaged" << std::endl;
+        }
+        return loaded;
+    }
+
+  public:
+    StaticNetwork() : layers(), active(), values(), kernel(detectKernel()) {}
+
+    // Loads a model saved by NeuralNetwork::saveWeights, or a .bin in the older format, which
+    // always has ReLU hidden layers and a softmax output. Returns false, saying why on std::cerr,
+    // when the file can't be read or holds a different topology or activations. Don't use the
+    // network then
+    bool load(std::string path) {
+        if (ModelFile::recognizes(path)) {
+            return this->loadModel(path);
+        }
+        for (int l = 0; l < LAYERS; ++l) {
+            StaticActivation legacy =
+                l + 1 < LAYERS ? StaticActivation::RELU : StaticActivation::SOFTMAX;
+            if (ACTIVATIONS[l] != legacy) {
+                std::cerr << "Model activations don't match the network" << std::endl;
+                return false;
+            }
+        }
+        std::ifstream file(path.c_str(), std::ios::binary);
+        if (!file.is_open()) {
+            std::cerr << "Couldnt open file" << std::endl;
+            return false;
+        }
+        size_t size = 0;
+        file.read(reinterpret_cast<char*>(&size), sizeof(size));
+        std::array<int, sizeof...(Sizes)> config = {};
+        if (file && size == config.size()) {
+            file.read(reinterpret_cast<char*>(config.data()), size * sizeof(int));
+        }
+        if (!file || config != SIZES) {
+            std::cerr << "Model topology doesn't match the network" << std::endl;
+            return false;
+        }
+        bool loaded = [&]<size_t... I>(std::index_sequence<I...>) {
+            return (read_layer(file, std::get<I>(this->layers)) && ...);
+        }(std::make_index_sequence<LAYERS>());
+        if (!loaded) {
+            std::cerr << "Model file is truncated" << std::endl;
+        }
+        return loaded;
+    }
+
+    // Outputs of the last layer for one sample, probabilities when it is softmax. The span points
+    // into the network and holds until the next call
+    std::span<const T, OUTPUTS> foward(std::span<const T, INPUTS> input) {
+        (this->*kernel)(input.data());
+        const T* out = std::get<LAYERS - 1>(this->layers).output.data();
+        return std::span<const T, OUTPUTS>(out, OUTPUTS);
+    }
+};
@@ -0,0 +1,15 @@
+#pragma once
+#include <atomic>
+#include <vector>
+
+// Helpers shared by the training threads (Pipeline stages, DataParallel workers)
+
+// Cores of part index when the cores the process may run on are split in parts equal shares,
+// wrapping around when there are more parts than cores
+std::vector<int> core_share(int index, int parts);
+// Cores of NUMA node index % node count, empty when the system reports no nodes
+std::vector<int> numa_share(int index);
+// Pins the calling thread to cores and sizes its OpenMP teams to match
+void pin_thread(const std::vector<int>& cores);
+// Blocks until counter reaches value
+void wait_for(std::atomic<int>& counter, int value);
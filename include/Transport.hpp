@@ -0,0 +1,61 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+// Links one trainer process to its neighbours in a ring of worldSize ranks: rank sends to
+// (rank + 1) % worldSize and receives from (rank - 1) % worldSize. Collectives such as
+// RingAllreduce are built on exchange alone, so a new link type only has to implement it. Broken
+// links throw std::runtime_error, training can't go on without its peers.
+class Transport {
+  private:
+    int rank;
+    int worldSize;
+
+  protected:
+    Transport(int rank, int worldSize);
+
+  public:
+    virtual ~Transport() = default;
+    Transport(const Transport&) = delete;
+    Transport& operator=(const Transport&) = delete;
+    int getRank() const;
+    int getWorldSize() const;
+    // Sends sendBytes to the next rank while receiving receiveBytes from the previous one, both
+    // done when it returns. Either side can be empty
+    virtual void exchange(const void* send, size_t sendBytes, void* receive,
+                          size_t receiveBytes) = 0;
+};
+
+// Ranks on the same machine, each link a single-producer ring buffer in a POSIX shared memory
+// segment named /<name>-<sender rank>. Segment names are removed as soon as both ends attach
+class SharedMemoryTransport : public Transport {
+  private:
+    struct Ring;
+    Ring* outgoing;
+    Ring* incoming;
+    size_t capacity;
+    std::string outgoingName;
+    void release();
+
+  public:
+    SharedMemoryTransport(std::string name, int rank, int worldSize, size_t capacity = 1 << 20);
+    ~SharedMemoryTransport() override;
+    void exchange(const void* send, size_t sendBytes, void* receive,
+                  size_t receiveBytes) override;
+};
+
+// Ranks linked by Unix domain stream sockets. Every rank listens on <path>-<rank>.sock and
+// connects to the next rank's socket
+class SocketTransport : public Transport {
+  private:
+    int next;     // connection to the next rank
+    int previous; // connection accepted from the previous rank
+    std::string listenPath;
+    void release();
+
+  public:
+    SocketTransport(std::string path, int rank, int worldSize);
+    ~SocketTransport() override;
+    void exchange(const void* send, size_t sendBytes, void* receive,
+                  size_t receiveBytes) override;
+};
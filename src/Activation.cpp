@@ -0,0 +1,257 @@
+#include "../include/Activation.hpp"
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ACTIVATION_X86
+#endif
+
+// Below this many elements the OpenMP fork costs more than it saves
+static constexpr size_t PARALLEL_THRESHOLD = 1 << 14;
+// Columns softmax normalizes together, the running maxima and sums stay on the stack
+static constexpr int SOFTMAX_BLOCK = 256;
+
+// e^x = 2^n * e^r with n = round(x / ln 2) and |r| <= ln 2 / 2, e^r from its Taylor series. Adding
+// a 1.5 * 2^52 (2^23 for float) constant rounds x / ln 2 into the low mantissa bits, where it can
+// be shifted straight into the exponent field without a float to integer conversion. Inputs are
+// clamped to the range where 2^n stays a normal number, which the activations never leave anyway.
+template <typename T> [[gnu::always_inline]] inline T exp_value(T x);
+
+template <> [[gnu::always_inline]] inline double exp_value(double x) {
+    constexpr double MAGIC = 6755399441055744.0;
+    constexpr double COEFFS[] = {1.0 / 479001600, 1.0 / 39916800, 1.0 / 3628800, 1.0 / 362880,
+                                 1.0 / 40320,     1.0 / 5040,     1.0 / 720,     1.0 / 120,
+                                 1.0 / 24,        1.0 / 6,        1.0 / 2,       1.0,
+                                 1.0};
+    x = std::min(std::max(x, -708.0), 709.0);
+    double k = (x * 1.4426950408889634) + MAGIC;
+    double n = k - MAGIC;
+    double r = (x - (n * 6.93147180369123816490e-01)) - (n * 1.90821492927058770002e-10);
+    double p = COEFFS[0];
+#pragma GCC unroll 13
+    for (int i = 1; i < 13; ++i) {
+        p = (p * r) + COEFFS[i];
+    }
+    uint64_t exponent = std::bit_cast<uint64_t>(k) - std::bit_cast<uint64_t>(MAGIC) + 1023;
+    return p * std::bit_cast<double>(exponent << 52);
+}
+
+template <> [[gnu::always_inline]] inline float exp_value(float x) {
+    constexpr float MAGIC = 12582912.0f;
+    constexpr float COEFFS[] = {1.0f / 40320, 1.0f / 5040, 1.0f / 720, 1.0f / 120,
+                                1.0f / 24,    1.0f / 6,    1.0f / 2,   1.0f,
+                                1.0f};
+    x = std::min(std::max(x, -87.0f), 88.0f);
+    float k = (x * 1.44269504f) + MAGIC;
+    float n = k - MAGIC;
+    float r = (x - (n * 0.693145752f)) - (n * 1.42860677e-06f);
+    float p = COEFFS[0];
+#pragma GCC unroll 9
+    for (int i = 1; i < 9; ++i) {
+        p = (p * r) + COEFFS[i];
+    }
+    uint32_t exponent = std::bit_cast<uint32_t>(k) - std::bit_cast<uint32_t>(MAGIC) + 127;
+    return p * std::bit_cast<float>(exponent << 23);
+}
+
+template <typename T>
+[[gnu::always_inline]] inline void exp_values(const T* in, T* out, size_t count) {
+#pragma omp simd
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = exp_value(in[i]);
+    }
+}
+
+template <typename T>
+[[gnu::always_inline]] inline void sigmoid_values(const T* in, T* out, size_t count) {
+#pragma omp simd
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = static_cast<T>(1) / (1 + exp_value(-in[i]));
+    }
+}
+
+// The same loops compiled for each instruction set, the vectorizer does the rest
+template <typename T> static void expGeneric(const T* in, T* out, size_t count) {
+    exp_values(in, out, count);
+}
+template <typename T> static void sigmoidGeneric(const T* in, T* out, size_t count) {
+    sigmoid_values(in, out, count);
+}
+
+#ifdef ACTIVATION_X86
+template <typename T>
+__attribute__((target("avx2,fma"))) static void expAvx2(const T* in, T* out, size_t count) {
+    exp_values(in, out, count);
+}
+template <typename T>
+__attribute__((target("avx2,fma"))) static void sigmoidAvx2(const T* in, T* out, size_t count) {
+    sigmoid_values(in, out, count);
+}
+template <typename T>
+__attribute__((target("avx512f"))) static void expAvx512(const T* in, T* out, size_t count) {
+    exp_values(in, out, count);
+}
+template <typename T>
+__attribute__((target("avx512f"))) static void sigmoidAvx512(const T* in, T* out, size_t count) {
+    sigmoid_values(in, out, count);
+}
+#endif
+
+template <typename T> struct ActivationKernels {
+    void (*exp)(const T* in, T* out, size_t count);
+    void (*sigmoid)(const T* in, T* out, size_t count);
+};
+
+// Follows NN_GEMM_ISA like the gemm kernels
+template <typename T> static ActivationKernels<T> detectKernels() {
+    const char* forced = std::getenv("NN_GEMM_ISA");
+    std::string name(forced != nullptr ? forced : "");
+    if (name == "reference" || name == "generic") {
+        return {expGeneric<T>, sigmoidGeneric<T>};
+    }
+#ifdef ACTIVATION_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && name != "avx2") {
+        return {expAvx512<T>, sigmoidAvx512<T>};
+    } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return {expAvx2<T>, sigmoidAvx2<T>};
+    }
+#endif
+    return {expGeneric<T>, sigmoidGeneric<T>};
+}
+
+template <typename T> static const ActivationKernels<T>& kernels() {
+    static const ActivationKernels<T> selected = detectKernels<T>();
+    return selected;
+}
+
+// Runs kernel over count values, split in chunks across threads when there are enough of them
+template <typename T>
+static void run_chunked(void (*kernel)(const T*, T*, size_t), const T* in, T* out, size_t count) {
+    constexpr size_t CHUNK = 4096;
+    size_t chunks = (count + CHUNK - 1) / CHUNK;
+#pragma omp parallel for schedule(static) if (count > PARALLEL_THRESHOLD)
+    for (size_t c = 0; c < chunks; ++c) {
+        size_t first = c * CHUNK;
+        kernel(in + first, out + first, std::min(CHUNK, count - first));
+    }
+}
+
+template <typename T> void vectorExp(const T* in, T* out, size_t count) {
+    run_chunked(kernels<T>().exp, in, out, count);
+}
+
+template <typename T> void sigmoid(const Matrix<T>& vals, Matrix<T>& out) {
+    out.resize(vals.getWidth(), vals.getHeight());
+    run_chunked(kernels<T>().sigmoid, vals.data(), out.data(),
+                static_cast<size_t>(vals.getWidth()) * vals.getHeight());
+}
+
+template <typename T> void relu(const Matrix<T>& vals, Matrix<T>& out) {
+    out.resize(vals.getWidth(), vals.getHeight());
+    const T* in = vals.data();
+    T* result = out.data();
+    size_t count = static_cast<size_t>(vals.getWidth()) * vals.getHeight();
+#pragma omp parallel for simd schedule(static) if (count > PARALLEL_THRESHOLD)
+    for (size_t i = 0; i < count; ++i) {
+        result[i] = in[i] > 0 ? in[i] : static_cast<T>(0);
+    }
+}
+
+template <typename T> void softmax(const Matrix<T>& vals, Matrix<T>& out) {
+    int width = vals.getWidth();
+    int height = vals.getHeight();
+    out.resize(width, height);
+    if (height == 0) {
+        return; // No first row to start the maxima from
+    }
+    const T* in = vals.data();
+    T* result = out.data();
+    auto exp = kernels<T>().exp;
+    int blocks = (width + SOFTMAX_BLOCK - 1) / SOFTMAX_BLOCK;
+    // Rows are walked in storage order and every step is vectorized across the block's columns
+    bool parallel = static_cast<size_t>(width) * height > PARALLEL_THRESHOLD;
+#pragma omp parallel for schedule(static) if (parallel)
+    for (int b = 0; b < blocks; ++b) {
+        int first = b * SOFTMAX_BLOCK;
+        int cols = std::min(SOFTMAX_BLOCK, width - first);
+        T peak[SOFTMAX_BLOCK];
+        T sum[SOFTMAX_BLOCK] = {};
+        std::copy_n(in + first, cols, peak);
+        for (int j = 1; j < height; ++j) {
+            const T* row = in + (j * width) + first;
+#pragma omp simd
+            for (int c = 0; c < cols; ++c) {
+                peak[c] = std::max(peak[c], row[c]);
+            }
+        }
+        for (int j = 0; j < height; ++j) {
+            const T* row = in + (j * width) + first;
+            T* dst = result + (j * width) + first;
+#pragma omp simd
+            for (int c = 0; c < cols; ++c) {
+                dst[c] = row[c] - peak[c];
+            }
+            exp(dst, dst, cols);
+#pragma omp simd
+            for (int c = 0; c < cols; ++c) {
+                sum[c] += dst[c];
+            }
+        }
+        for (int c = 0; c < cols; ++c) {
+            sum[c] = 1 / sum[c];
+        }
+        for (int j = 0; j < height; ++j) {
+            T* dst = result + (j * width) + first;
+#pragma omp simd
+            for (int c = 0; c < cols; ++c) {
+                dst[c] *= sum[c];
+            }
+        }
+    }
+}
+
+template <typename T> static void check_same_shape(const Matrix<T>& a, const Matrix<T>& b) {
+    if (a.getWidth() != b.getWidth() || a.getHeight() != b.getHeight()) {
+        throw std::invalid_argument("Activations and deltas must have the same shape");
+    }
+}
+
+template <typename T> void sigmoid_derivative(const Matrix<T>& activations, Matrix<T>& deltas) {
+    check_same_shape(activations, deltas);
+    const T* a = activations.data();
+    T* d = deltas.data();
+    size_t count = static_cast<size_t>(deltas.getWidth()) * deltas.getHeight();
+#pragma omp parallel for simd schedule(static) if (count > PARALLEL_THRESHOLD)
+    for (size_t i = 0; i < count; ++i) {
+        d[i] *= a[i] * (1 - a[i]);
+    }
+}
+
+template <typename T> void relu_derivative(const Matrix<T>& activations, Matrix<T>& deltas) {
+    check_same_shape(activations, deltas);
+    const T* a = activations.data();
+    T* d = deltas.data();
+    size_t count = static_cast<size_t>(deltas.getWidth()) * deltas.getHeight();
+#pragma omp parallel for simd schedule(static) if (count > PARALLEL_THRESHOLD)
+    for (size_t i = 0; i < count; ++i) {
+        d[i] = a[i] > 0 ? d[i] : static_cast<T>(0);
+    }
+}
+
+template void sigmoid(const Matrix<float>&, Matrix<float>&);
+template void sigmoid(const Matrix<double>&, Matrix<double>&);
+template void relu(const Matrix<float>&, Matrix<float>&);
+template void relu(const Matrix<double>&, Matrix<double>&);
+template void softmax(const Matrix<float>&, Matrix<float>&);
+template void softmax(const Matrix<double>&, Matrix<double>&);
+template void sigmoid_derivative(const Matrix<float>&, Matrix<float>&);
+template void sigmoid_derivative(const Matrix<double>&, Matrix<double>&);
+template void relu_derivative(const Matrix<float>&, Matrix<float>&);
+template void relu_derivative(const Matrix<double>&, Matrix<double>&);
+template void vectorExp(const float*, float*, size_t);
+template void vectorExp(const double*, double*, size_t);
@@ -0,0 +1,95 @@
+#include "../include/Arena.hpp"
+#include <atomic>
+#include <bit>
+#include <new>
+
+static constexpr size_t SIZE_CLASSES = 4 * 64;
+
+static std::atomic<size_t> systemBlockCount = 0;
+
+struct FreeBlock {
+    FreeBlock* next;
+};
+
+// Plain flag so blocks released during thread teardown, after the lists are gone, still get freed
+thread_local bool freeListsDestroyed = false;
+
+struct FreeLists {
+    FreeBlock* heads[SIZE_CLASSES] = {};
+    size_t cachedBytes = 0;
+
+    void clear() {
+        for (size_t i = 0; i < SIZE_CLASSES; ++i) {
+            while (this->heads[i] != nullptr) {
+                FreeBlock* block = this->heads[i];
+                this->heads[i] = block->next;
+                ::operator delete(block, std::align_val_t(Arena::ALIGNMENT));
+            }
+        }
+        this->cachedBytes = 0;
+    }
+
+    ~FreeLists() {
+        freeListsDestroyed = true;
+        this->clear();
+    }
+};
+
+thread_local FreeLists freeLists;
+
+// Maps a request to its size class and the block size that class hands out
+static size_t sizeClass(size_t bytes, size_t& classBytes) {
+    if (bytes <= Arena::ALIGNMENT) {
+        classBytes = Arena::ALIGNMENT;
+        return 0;
+    }
+    size_t exponent = std::bit_width(bytes - 1) - 1; // base < bytes <= 2 * base
+    size_t base = static_cast<size_t>(1) << exponent;
+    size_t step = base / 4;
+    size_t sub = (bytes - base + step - 1) / step; // 1 to 4
+    classBytes = base + (sub * step);
+    return ((exponent - 6) * 4) + sub;
+}
+
+void* Arena::allocate(size_t bytes) {
+    size_t classBytes;
+    size_t index = sizeClass(bytes, classBytes);
+    FreeBlock* block = freeLists.heads[index];
+    if (block != nullptr) {
+        freeLists.heads[index] = block->next;
+        freeLists.cachedBytes -= classBytes;
+        return block;
+    }
+    systemBlockCount.fetch_add(1, std::memory_order_relaxed);
+    return ::operator new(classBytes, std::align_val_t(ALIGNMENT));
+}
+
+void Arena::release(void* block, size_t bytes) {
+    if (block == nullptr) {
+        return;
+    }
+    if (freeListsDestroyed) {
+        ::operator delete(block, std::align_val_t(ALIGNMENT));
+        return;
+    }
+    size_t classBytes;
+    size_t index = sizeClass(bytes, classBytes);
+    if (freeLists.cachedBytes + classBytes > MAX_CACHED_BYTES) {
+        ::operator delete(block, std::align_val_t(ALIGNMENT));
+        return;
+    }
+    FreeBlock* freed = static_cast<FreeBlock*>(block);
+    freed->next = freeLists.heads[index];
+    freeLists.heads[index] = freed;
+    freeLists.cachedBytes += classBytes;
+}
+
+void Arena::trim() {
+    if (!freeListsDestroyed) {
+        freeLists.clear();
+    }
+}
+
+size_t Arena::systemBlocks() {
+    return systemBlockCount.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,160 @@
+#include "../include/BatchLoader.hpp"
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+template <typename T>
+BatchLoader<T>::BatchLoader(const Dataset<T>& data, int batchSize, int prefetch, int threads,
+                            Transform transform)
+    : data(&data), featureCount(data.getFeatureCount()), targetCount(data.getTargetCount()),
+      batchSize(batchSize), threadCount(threads), transform(std::move(transform)), epochFirst(0),
+      epochEnd(0), released(0), taken(0), stallSeconds(0), stopping(false) {
+    this->start(prefetch);
+}
+
+template <typename T>
+BatchLoader<T>::BatchLoader(Stream stream, int featureCount, int targetCount, int batchSize,
+                            int prefetch, Transform transform)
+    : data(nullptr), stream(std::move(stream)), featureCount(featureCount),
+      targetCount(targetCount), batchSize(batchSize), threadCount(1),
+      transform(std::move(transform)), epochFirst(0), epochEnd(0), released(0), taken(0),
+      stallSeconds(0), stopping(false) {
+    if (!this->stream) {
+        throw std::invalid_argument("Batch loading needs a stream");
+    }
+    this->start(prefetch);
+}
+
+template <typename T> void BatchLoader<T>::start(int prefetch) {
+    if (this->batchSize < 1 || prefetch < 1 || this->threadCount < 1) {
+        throw std::invalid_argument("Batch loading needs a batch size, prefetch and threads");
+    }
+    // The batch being trained on keeps its slot, prefetch more are filled meanwhile
+    for (int s = 0; s < prefetch + 1; ++s) {
+        std::unique_ptr<Slot> slot = std::make_unique<Slot>();
+        slot->input.resize(this->featureCount, this->batchSize);
+        slot->target.resize(this->targetCount, this->batchSize);
+        slot->filled.store(0);
+        slot->complete = false;
+        this->slots.push_back(std::move(slot));
+    }
+    for (int t = 0; t < this->threadCount; ++t) {
+        this->loaders.emplace_back(&BatchLoader<T>::run, this, t);
+    }
+}
+
+template <typename T> BatchLoader<T>::~BatchLoader() {
+    this->stopping.store(true);
+    this->epochEnd.fetch_add(1);
+    this->epochEnd.notify_all();
+    this->released.fetch_add(1);
+    this->released.notify_all();
+    for (std::thread& loader : this->loaders) {
+        loader.join();
+    }
+}
+
+template <typename T> void BatchLoader<T>::run(int loaderIt) {
+    long slotCount = this->slots.size();
+    for (long batch = loaderIt;; batch += this->threadCount) {
+        // The batch has to be part of an epoch and its slot done with by the trainer
+        long end, done;
+        while (!this->stopping.load() && batch >= (end = this->epochEnd.load())) {
+            this->epochEnd.wait(end);
+        }
+        while (!this->stopping.load() && batch - slotCount >= (done = this->released.load())) {
+            this->released.wait(done);
+        }
+        if (this->stopping.load()) {
+            return;
+        }
+        Slot& slot = *this->slots[batch % slotCount];
+        slot.complete = this->gather(slot, batch);
+        slot.filled.store(batch + 1);
+        slot.filled.notify_all();
+    }
+}
+
+template <typename T> bool BatchLoader<T>::gather(Slot& slot, long batch) {
+    const int* samples = nullptr;
+    if (this->data) {
+        samples = this->order.data() + ((batch - this->epochFirst) * this->batchSize);
+    }
+    for (int i = 0; i < this->batchSize; ++i) {
+        T* input = slot.input.data() + (i * this->featureCount);
+        T* target = slot.target.data() + (i * this->targetCount);
+        if (this->data) {
+            this->data->copyFeatures(samples[i], input);
+            std::copy_n(this->data->targetOf(samples[i]), this->targetCount, target);
+        } else if (!this->stream(input, target)) {
+            return false;
+        }
+        if (this->transform) {
+            this->transform(input, target);
+        }
+    }
+    return true;
+}
+
+template <typename T> void BatchLoader<T>::beginEpoch(const std::vector<int>& order) {
+    if (!this->data) {
+        throw std::invalid_argument("Streamed batches have no sample order");
+    }
+    if (this->taken != this->epochEnd.load()) {
+        throw std::invalid_argument("Every batch of an epoch must be taken before the next one");
+    }
+    // Loaders are done reading the previous order, every batch of it has been handed out
+    this->order = order;
+    this->queue(order.size() / this->batchSize);
+}
+
+template <typename T> void BatchLoader<T>::beginEpoch(int batches) {
+    if (this->data) {
+        throw std::invalid_argument("Dataset batches need a sample order");
+    }
+    if (this->taken != this->epochEnd.load()) {
+        throw std::invalid_argument("Every batch of an epoch must be taken before the next one");
+    }
+    this->queue(batches);
+}
+
+template <typename T> void BatchLoader<T>::queue(long batches) {
+    this->epochFirst = this->taken;
+    this->epochEnd.store(this->taken + batches);
+    this->epochEnd.notify_all();
+}
+
+template <typename T> int BatchLoader<T>::batchCount() const {
+    return this->epochEnd.load() - this->epochFirst;
+}
+
+template <typename T> typename BatchLoader<T>::Batch BatchLoader<T>::next() {
+    if (this->taken >= this->epochEnd.load()) {
+        throw std::invalid_argument("No batches left in the epoch");
+    }
+    // The batch handed out last time is done with, its slot can be refilled
+    this->released.store(this->taken);
+    this->released.notify_all();
+    long batch = this->taken++;
+    Slot& slot = *this->slots[batch % this->slots.size()];
+    if (slot.filled.load() != batch + 1) {
+        auto start = std::chrono::steady_clock::now();
+        long seen;
+        while ((seen = slot.filled.load()) != batch + 1) {
+            slot.filled.wait(seen);
+        }
+        this->stallSeconds +=
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    if (!slot.complete) {
+        throw std::runtime_error("The sample stream ended before the epoch did");
+    }
+    return {slot.input.view().transpose(), slot.target.view().transpose()};
+}
+
+template <typename T> double BatchLoader<T>::getStallSeconds() const {
+    return this->stallSeconds;
+}
+
+template class BatchLoader<float>;
+template class BatchLoader<double>;
@@ -0,0 +1,259 @@
+#include "../include/Checkpoint.hpp"
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+static constexpr char CHECKPOINT_MAGIC[8] = "NNCKPT";
+static constexpr uint32_t CHECKPOINT_VERSION = 1;
+
+template <typename V> static void write_value(std::ofstream& file, const V& value) {
+    file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename V> static bool read_value(std::ifstream& file, V& value) {
+    return static_cast<bool>(file.read(reinterpret_cast<char*>(&value), sizeof(value)));
+}
+
+// Shape then values, in the precision of the run
+template <typename T> static void write_tensor(std::ofstream& file, const Matrix<T>& mat) {
+    write_value<int32_t>(file, mat.getWidth());
+    write_value<int32_t>(file, mat.getHeight());
+    file.write(reinterpret_cast<const char*>(mat.data()),
+               mat.getValuesVector().size() * sizeof(T));
+}
+
+// Bytes from the read position to the end of a file fileBytes long, 0 once a read failed
+static uint64_t bytes_left(std::ifstream& file, uint64_t fileBytes) {
+    std::streamoff at = file.tellg();
+    return at < 0 || static_cast<uint64_t>(at) > fileBytes ? 0 : fileBytes - at;
+}
+
+template <typename T>
+static bool read_tensor(std::ifstream& file, uint64_t fileBytes, Matrix<T>& mat) {
+    int32_t w, h;
+    if (!read_value(file, w) || !read_value(file, h) || w < 0 || h < 0 ||
+        static_cast<uint64_t>(w) * h > bytes_left(file, fileBytes) / sizeof(T)) {
+        return false;
+    }
+    mat.resize(w, h);
+    return static_cast<bool>(
+        file.read(reinterpret_cast<char*>(mat.data()), mat.getValuesVector().size() * sizeof(T)));
+}
+
+template <typename T> bool Checkpoint<T>::save(std::string path) const {
+    std::string partial = path + ".tmp";
+    std::ofstream file(partial, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Couldnt create file " << partial << std::endl;
+        return false;
+    }
+    file.write(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    write_value(file, CHECKPOINT_VERSION);
+    write_value<uint32_t>(file, sizeof(T));
+    write_value<uint64_t>(file, this->layersConfig.size());
+    file.write(reinterpret_cast<const char*>(this->layersConfig.data()),
+               this->layersConfig.size() * sizeof(int));
+    write_value<int32_t>(file, this->epoch);
+    write_value<int32_t>(file, this->step);
+    write_value(file, this->bestCrossEntropy);
+    write_value<int32_t>(file, this->staleValidations);
+    std::ostringstream generator;
+    generator << this->generator;
+    write_value<uint64_t>(file, generator.str().size());
+    file << generator.str();
+    write_value<uint64_t>(file, this->order.size());
+    file.write(reinterpret_cast<const char*>(this->order.data()),
+               this->order.size() * sizeof(int));
+    for (size_t i = 0; i < this->weights.size(); ++i) {
+        write_tensor(file, this->weights[i]);
+        write_tensor(file, this->biases[i]);
+        const typename Layer<T>::OptimizerState& state = this->optimizerStates[i];
+        for (int b = 0; b < 2; ++b) {
+            write_tensor(file, state.weights[b]);
+            write_tensor(file, state.biases[b]);
+        }
+        write_value<int64_t>(file, state.steps);
+    }
+    file.close();
+    if (!file) {
+        std::cerr << "Couldnt write checkpoint " << partial << std::endl;
+        return false;
+    }
+    std::error_code error;
+    std::filesystem::rename(partial, path, error);
+    if (error) {
+        std::cerr << "Couldnt replace checkpoint " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Whether mat is w by h, or empty for optimizer buffers that aren't used
+template <typename T> static bool shaped(const Matrix<T>& mat, int w, int h, bool optional) {
+    return (optional && mat.getValuesVector().empty()) ||
+           (mat.getWidth() == w && mat.getHeight() == h);
+}
+
+template <typename T> bool Checkpoint<T>::fits() const {
+    size_t layers = this->layersConfig.size() - 1;
+    if (this->layersConfig.size() < 2 || this->weights.size() != layers ||
+        this->biases.size() != layers || this->optimizerStates.size() != layers ||
+        this->epoch < 0 || this->step < 0 || this->staleValidations < 0) {
+        return false;
+    }
+    for (int nodes : this->layersConfig) {
+        if (nodes <= 0) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < this->weights.size(); ++i) {
+        int inputs = this->layersConfig[i], nodes = this->layersConfig[i + 1];
+        const typename Layer<T>::OptimizerState& state = this->optimizerStates[i];
+        if (!shaped(this->weights[i], inputs, nodes, false) ||
+            !shaped(this->biases[i], 1, nodes, false) || state.steps < 0) {
+            return false;
+        }
+        for (int b = 0; b < 2; ++b) {
+            if (!shaped(state.weights[b], inputs, nodes, true) ||
+                !shaped(state.biases[b], 1, nodes, true)) {
+                return false;
+            }
+        }
+    }
+    // A permutation of the samples or shards it was taken training on
+    for (int index : this->order) {
+        if (index < 0 || static_cast<size_t>(index) >= this->order.size()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <typename T> bool Checkpoint<T>::load(std::string path) {
+    std::ifstream file(path, std::ios::binary);
+    std::error_code error;
+    uint64_t fileBytes = std::filesystem::file_size(path, error);
+    if (!file.is_open() || error) {
+        std::cerr << "Couldnt open file " << path << std::endl;
+        return false;
+    }
+    char magic[sizeof(CHECKPOINT_MAGIC)];
+    uint32_t version, scalarBytes;
+    uint64_t layerCount, generatorBytes, orderSize;
+    int32_t epoch = 0, step = 0, stale = 0;
+    if (!file.read(magic, sizeof(magic)) ||
+        std::memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) != 0 || !read_value(file, version) ||
+        version != CHECKPOINT_VERSION || !read_value(file, scalarBytes) ||
+        !read_value(file, layerCount) || layerCount < 2) {
+        std::cerr << "Couldnt read checkpoint " << path << std::endl;
+        return false;
+    }
+    if (scalarBytes != sizeof(T)) {
+        std::cerr << "Checkpoint " << path << " was taken in the other precision" << std::endl;
+        return false;
+    }
+    // Every count is checked against the bytes left before it sizes an allocation
+    bool complete = layerCount <= bytes_left(file, fileBytes) / sizeof(int);
+    if (complete) {
+        this->layersConfig.resize(layerCount);
+        complete = file.read(reinterpret_cast<char*>(this->layersConfig.data()),
+                             layerCount * sizeof(int)) &&
+                   read_value(file, epoch) && read_value(file, step) &&
+                   read_value(file, this->bestCrossEntropy) && read_value(file, stale) &&
+                   read_value(file, generatorBytes) &&
+                   generatorBytes <= bytes_left(file, fileBytes);
+    }
+    this->epoch = epoch;
+    this->step = step;
+    this->staleValidations = stale;
+    if (complete) {
+        std::string generator(generatorBytes, '\0');
+        complete = static_cast<bool>(file.read(generator.data(), generatorBytes));
+        std::istringstream state(generator);
+        complete = complete && state >> this->generator && read_value(file, orderSize) &&
+                   orderSize <= bytes_left(file, fileBytes) / sizeof(int);
+    }
+    if (complete) {
+        this->order.resize(orderSize);
+        complete = static_cast<bool>(
+            file.read(reinterpret_cast<char*>(this->order.data()), orderSize * sizeof(int)));
+    }
+    size_t layers = complete ? layerCount - 1 : 0;
+    this->weights.resize(layers);
+    this->biases.resize(layers);
+    this->optimizerStates.resize(layers);
+    for (size_t i = 0; complete && i < layers; ++i) {
+        typename Layer<T>::OptimizerState& state = this->optimizerStates[i];
+        int64_t steps = 0;
+        complete = read_tensor(file, fileBytes, this->weights[i]) &&
+                   read_tensor(file, fileBytes, this->biases[i]) &&
+                   read_tensor(file, fileBytes, state.weights[0]) &&
+                   read_tensor(file, fileBytes, state.biases[0]) &&
+                   read_tensor(file, fileBytes, state.weights[1]) &&
+                   read_tensor(file, fileBytes, state.biases[1]) && read_value(file, steps);
+        state.steps = steps;
+    }
+    if (!complete) {
+        std::cerr << "Checkpoint " << path << " is incomplete" << std::endl;
+        return false;
+    }
+    if (!this->fits()) {
+        std::cerr << "Checkpoint " << path << " is damaged" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+template <typename T>
+CheckpointWriter<T>::CheckpointWriter(std::string path)
+    : path(std::move(path)), requested(0), written(0), stopping(false) {
+    this->writer = std::thread(&CheckpointWriter<T>::run, this);
+}
+
+template <typename T> CheckpointWriter<T>::~CheckpointWriter() {
+    // The checkpoint being written is finished, then the writer wakes up to stop
+    long queued = this->requested.load();
+    long done;
+    while ((done = this->written.load()) != queued) {
+        this->written.wait(done);
+    }
+    this->stopping.store(true);
+    this->requested.fetch_add(1);
+    this->requested.notify_all();
+    this->writer.join();
+}
+
+template <typename T> void CheckpointWriter<T>::run() {
+    for (long next = 1;; ++next) {
+        long seen;
+        while ((seen = this->requested.load()) < next) {
+            this->requested.wait(seen);
+        }
+        if (this->stopping.load()) {
+            return;
+        }
+        this->snapshot.save(this->path);
+        this->written.store(next);
+        this->written.notify_all();
+    }
+}
+
+template <typename T>
+bool CheckpointWriter<T>::write(const std::function<void(Checkpoint<T>& snapshot)>& fill) {
+    long queued = this->requested.load();
+    if (this->written.load() != queued) {
+        return false;
+    }
+    fill(this->snapshot);
+    this->requested.store(queued + 1);
+    this->requested.notify_all();
+    return true;
+}
+
+template struct Checkpoint<float>;
+template struct Checkpoint<double>;
+template class CheckpointWriter<float>;
+template class CheckpointWriter<double>;
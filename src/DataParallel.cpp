@@ -0,0 +1,193 @@
+#include "../include/DataParallel.hpp"
+#include "../include/Threads.hpp"
+#include <algorithm>
+#include <stdexcept>
+
+// Values the reduction sums over all workers at a time, small enough to stay in L1
+static constexpr size_t REDUCE_BLOCK = 1024;
+
+template <typename T>
+DataParallel<T>::DataParallel(std::vector<Layer<T>>& layers, int workerCount, int batchSize,
+                              const Optimizer<T>* hogwild)
+    : layers(layers), hogwild(hogwild), batchSize(batchSize), learningRate(0), generation(0),
+      pending(0), backwardDone(0), hogwildSteps(0), stopping(false) {
+    if (workerCount < 1) {
+        throw std::invalid_argument("Data-parallel training needs at least one worker");
+    }
+    if (batchSize < workerCount) {
+        throw std::invalid_argument("Batch size must be at least the number of workers");
+    }
+    for (Layer<T>& layer : layers) {
+        layer.reserve(layer.getGradients());
+        if (hogwild != nullptr) {
+            // Workers update concurrently, none of them may be the one allocating the state
+            layer.reserve(*hogwild);
+        }
+    }
+    for (int w = 0; w < workerCount; ++w) {
+        std::unique_ptr<Worker> worker = std::make_unique<Worker>();
+        worker->cores = core_share(w, workerCount);
+        worker->first = (batchSize * w) / workerCount;
+        worker->size = ((batchSize * (w + 1)) / workerCount) - worker->first;
+        this->workers.push_back(std::move(worker));
+    }
+
+    // Workers allocate their own buffers, the constructor returns once all of them have
+    this->pending.store(workerCount);
+    for (size_t w = 0; w < this->workers.size(); ++w) {
+        this->workers[w]->thread = std::thread(&DataParallel<T>::run, this, w);
+    }
+    int left;
+    while ((left = this->pending.load()) != 0) {
+        this->pending.wait(left);
+    }
+}
+
+template <typename T> DataParallel<T>::~DataParallel() {
+    this->stopping = true;
+    this->generation.fetch_add(1);
+    this->generation.notify_all();
+    for (std::unique_ptr<Worker>& worker : this->workers) {
+        worker->thread.join();
+    }
+}
+
+template <typename T> int DataParallel<T>::getWorkerCount() const {
+    return this->workers.size();
+}
+
+template <typename T> bool DataParallel<T>::isHogwild() const {
+    return this->hogwild != nullptr;
+}
+
+template <typename T> void DataParallel<T>::run(size_t workerIt) {
+    Worker& worker = *this->workers[workerIt];
+    pin_thread(worker.cores);
+    worker.caches.resize(this->layers.size());
+    worker.gradients.resize(this->layers.size());
+    for (size_t l = 0; l < this->layers.size(); ++l) {
+        this->layers[l].reserve(worker.caches[l], worker.size);
+        this->layers[l].reserve(worker.gradients[l]);
+    }
+    if (this->pending.fetch_sub(1) == 1) {
+        this->pending.notify_all();
+    }
+
+    int seen = 0;
+    while (true) {
+        this->generation.wait(seen);
+        seen = this->generation.load();
+        if (this->stopping) {
+            return;
+        }
+        this->runStep(workerIt);
+        if (this->pending.fetch_sub(1) == 1) {
+            this->pending.notify_all();
+        }
+    }
+}
+
+template <typename T> void DataParallel<T>::runStep(size_t workerIt) {
+    Worker& worker = *this->workers[workerIt];
+    size_t last = this->layers.size() - 1;
+
+    MatrixView<const T> current = this->input.columns(worker.first, worker.size);
+    for (size_t l = 0; l < this->layers.size(); ++l) {
+        current = this->layers[l].foward(current, worker.caches[l]);
+    }
+    // Output layer deltas are the output minus the target, built in place
+    worker.caches[last].activations -= this->target.columns(worker.first, worker.size);
+    this->layers[last].setDeltas(worker.caches[last].activations, worker.caches[last],
+                                 worker.gradients[last], false);
+    for (size_t l = last; l-- > 0;) {
+        this->layers[l].backwards(this->layers[l + 1].getWeights(), worker.caches[l + 1].deltas,
+                                  worker.caches[l], worker.gradients[l], false);
+    }
+
+    if (this->hogwild != nullptr) {
+        // The gradients are sums over the shard, the update scale averages and clips them
+        double squaredNorm = 0;
+        if (this->hogwild->getMaxGradientNorm() > 0) {
+            for (size_t l = 0; l < this->layers.size(); ++l) {
+                squaredNorm += Layer<T>::squaredGradientNorm(worker.gradients[l]);
+            }
+        }
+        double size = worker.size;
+        T scale = this->hogwild->clipScale(squaredNorm / (size * size)) / size;
+        long step = this->hogwildSteps.fetch_add(1) + 1;
+        for (size_t l = 0; l < this->layers.size(); ++l) {
+            this->layers[l].concurrentUpdate(worker.gradients[l], *this->hogwild,
+                                             this->learningRate, scale, step);
+        }
+        return;
+    }
+
+    this->backwardDone.fetch_add(1);
+    this->backwardDone.notify_all();
+    wait_for(this->backwardDone, this->workers.size());
+    for (size_t l = 0; l < this->layers.size(); ++l) {
+        this->reduce(workerIt, l, &Layer<T>::Gradients::dW);
+        this->reduce(workerIt, l, &Layer<T>::Gradients::db);
+    }
+}
+
+// Sums the slice of one gradient owned by workerIt over all workers into the layer's, averaged
+// over the batch. Slices are whole cache lines so no two workers write the same one
+template <typename T>
+void DataParallel<T>::reduce(size_t workerIt, size_t layer, Matrix<T> Layer<T>::Gradients::*part) {
+    constexpr size_t LINE = 64 / sizeof(T);
+    Matrix<T>& total = this->layers[layer].getGradients().*part;
+    size_t count = total.getValuesVector().size();
+    size_t lines = (count + LINE - 1) / LINE;
+    size_t workerCount = this->workers.size();
+    size_t first = std::min(count, (lines * workerIt / workerCount) * LINE);
+    size_t end = std::min(count, (lines * (workerIt + 1) / workerCount) * LINE);
+    const T scale = static_cast<T>(1) / this->batchSize;
+    for (size_t block = first; block < end; block += REDUCE_BLOCK) {
+        size_t size = std::min(REDUCE_BLOCK, end - block);
+        T* out = total.data() + block;
+        const T* own = (this->workers[0]->gradients[layer].*part).data() + block;
+        std::copy_n(own, size, out);
+        for (size_t w = 1; w < workerCount; ++w) {
+            const T* other = (this->workers[w]->gradients[layer].*part).data() + block;
+#pragma omp simd
+            for (size_t i = 0; i < size; ++i) {
+                out[i] += other[i];
+            }
+        }
+#pragma omp simd
+        for (size_t i = 0; i < size; ++i) {
+            out[i] *= scale;
+        }
+    }
+}
+
+template <typename T>
+void DataParallel<T>::step(MatrixView<const T> input, MatrixView<const T> target,
+                           T learningRate) {
+    if (input.getWidth() != this->batchSize || target.getWidth() != input.getWidth()) {
+        throw std::invalid_argument("Data-parallel step batch size doesn't match its shards");
+    }
+    this->input = input;
+    this->target = target;
+    this->learningRate = learningRate;
+    this->backwardDone.store(0);
+    if (this->hogwild != nullptr) {
+        this->hogwildSteps.store(this->layers.front().getOptimizerSteps());
+    }
+    this->pending.store(this->workers.size());
+    this->generation.fetch_add(1);
+    this->generation.notify_all();
+    int left;
+    while ((left = this->pending.load()) != 0) {
+        this->pending.wait(left);
+    }
+    if (this->hogwild != nullptr) {
+        for (Layer<T>& layer : this->layers) {
+            layer.finishConcurrentUpdates(this->hogwildSteps.load());
+        }
+    }
+}
+
+template class DataParallel<float>;
+template class DataParallel<double>;
@@ -0,0 +1,567 @@
+#include "../include/Dataset.hpp"
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <omp.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+static constexpr char CACHE_MAGIC[8] = "NNCACHE";
+static constexpr uint32_t CACHE_VERSION = 1;
+// Byte levels further than this from a whole step don't fit the cache
+static constexpr double BYTE_TOLERANCE = 1e-3;
+
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t featureCount;
+    uint64_t samples;
+    uint32_t classes;
+    uint32_t reserved;
+    double byteScale;     // feature value of one byte step
+    uint64_t sourceBytes; // size and modification time of the file the cache was made from
+    int64_t sourceTime;
+    char padding[8];
+};
+static_assert(sizeof(CacheHeader) == 64, "Cache header is one cache line");
+
+// IDX headers start with two zero bytes, the element type (0x08 for unsigned bytes) and the
+// number of dimensions
+static constexpr uint32_t IDX_IMAGES = 0x00000803;
+static constexpr uint32_t IDX_LABELS = 0x00000801;
+
+// CSVs are parsed in chunks of at least this many bytes, several per thread so that chunks of
+// longer lines don't hold the others up
+static constexpr size_t CSV_CHUNK_BYTES = 1 << 20;
+static constexpr int CSV_CHUNKS_PER_THREAD = 8;
+// Labels above this are taken as a damaged file rather than as that many classes
+static constexpr int CSV_MAX_LABEL = 1 << 16;
+static constexpr size_t NO_ROW = std::numeric_limits<size_t>::max();
+
+// A chunk of a CSV, from the start of a line to the start of another
+struct CsvChunk {
+    const char* first;
+    const char* last;
+    size_t rows;
+    int maxLabel;
+    size_t failedRow; // of the chunk, NO_ROW when every row parsed
+};
+
+// A read-only mapping of a whole file, gone with the object
+class MappedText {
+  public:
+    const char* begin = nullptr;
+    size_t bytes = 0;
+
+    MappedText(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0 || info.st_size == 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            return;
+        }
+        void* mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping != MAP_FAILED) {
+            madvise(mapping, info.st_size, MADV_SEQUENTIAL);
+            this->begin = static_cast<const char*>(mapping);
+            this->bytes = info.st_size;
+        }
+    }
+    MappedText(const MappedText&) = delete;
+    MappedText& operator=(const MappedText&) = delete;
+    ~MappedText() {
+        if (this->begin) {
+            munmap(const_cast<char*>(this->begin), this->bytes);
+        }
+    }
+};
+
+static bool read_big_endian(std::ifstream& file, uint32_t& value) {
+    unsigned char bytes[4];
+    if (!file.read(reinterpret_cast<char*>(bytes), sizeof(bytes))) {
+        return false;
+    }
+    value = (static_cast<uint32_t>(bytes[0]) << 24) | (static_cast<uint32_t>(bytes[1]) << 16) |
+            (static_cast<uint32_t>(bytes[2]) << 8) | bytes[3];
+    return true;
+}
+
+// Spaces, tabs and the carriage returns of Windows line breaks don't count
+static const char* skip_blanks(const char* it, const char* end) {
+    while (it < end && (*it == ' ' || *it == '\t' || *it == '\r')) {
+        ++it;
+    }
+    return it;
+}
+
+// Each parser reads one field and the blanks around it, returning where it stopped or null when
+// the field isn't what it expects
+static const char* parse_label(const char* it, const char* end, int& label) {
+    it = skip_blanks(it, end);
+    double value;
+    auto [next, error] = std::from_chars(it, end, value);
+    if (error != std::errc() || value < 0 || value > CSV_MAX_LABEL || value != std::floor(value)) {
+        return nullptr;
+    }
+    label = value;
+    return skip_blanks(next, end);
+}
+
+static const char* parse_byte(const char* it, const char* end, uint8_t& value) {
+    it = skip_blanks(it, end);
+    const char* digits = it;
+    unsigned level = 0;
+    while (it < end && *it >= '0' && *it <= '9' && level <= 255) {
+        level = (level * 10) + (*it - '0');
+        ++it;
+    }
+    if (it == digits || level > 255) {
+        return nullptr;
+    }
+    value = level;
+    return skip_blanks(it, end);
+}
+
+template <typename T> static const char* parse_value(const char* it, const char* end, T& value) {
+    it = skip_blanks(it, end);
+    if (it < end && *it == '+') {
+        ++it;
+    }
+    auto [next, error] = std::from_chars(it, end, value);
+    if (error != std::errc()) {
+        return nullptr;
+    }
+    return skip_blanks(next, end);
+}
+
+// Parses a line of a label and featureCount features into either bytes or features
+template <typename T>
+static bool parse_row(const char* it, const char* end, int featureCount, int& label, uint8_t* bytes,
+                      T* features) {
+    it = parse_label(it, end, label);
+    for (int f = 0; it && f < featureCount; ++f) {
+        if (it == end || *it != ',') {
+            return false;
+        }
+        it = bytes ? parse_byte(it + 1, end, bytes[f]) : parse_value(it + 1, end, features[f]);
+    }
+    return it == end;
+}
+
+// Calls row with the bounds of every line of the chunk with something on it, until it returns
+// false
+template <typename F> static void for_each_line(const CsvChunk& chunk, F row) {
+    for (const char* line = chunk.first; line < chunk.last;) {
+        const char* newline =
+            static_cast<const char*>(std::memchr(line, '\n', chunk.last - line));
+        const char* end = newline ? newline : chunk.last;
+        if (skip_blanks(line, end) != end && !row(line, end)) {
+            return;
+        }
+        line = end + 1;
+    }
+}
+
+// A changed source file changes its size or its modification time
+static bool source_stamp(const std::string& source, uint64_t& bytes, int64_t& time) {
+    std::error_code error;
+    bytes = std::filesystem::file_size(source, error);
+    if (error) {
+        return false;
+    }
+    time = std::filesystem::last_write_time(source, error).time_since_epoch().count();
+    return !error;
+}
+
+template <typename T> Dataset<T>::Dataset() {
+    this->sampleCount = 0;
+    this->featureCount = 0;
+    this->targetCount = 0;
+    this->byteScale = 0;
+}
+
+template <typename T> Dataset<T>::Dataset(size_t samples, int featureCount, int targetCount) {
+    if (featureCount < 1 || targetCount < 1) {
+        throw std::invalid_argument("Samples need at least one feature and one target");
+    }
+    this->sampleCount = samples;
+    this->featureCount = featureCount;
+    this->targetCount = targetCount;
+    this->byteScale = 0;
+    this->features.resize(samples * featureCount);
+    this->targets.resize(samples * targetCount);
+}
+
+template <typename T>
+Dataset<T>::Dataset(size_t samples, int featureCount, int targetCount, T byteScale) {
+    if (featureCount < 1 || targetCount < 1) {
+        throw std::invalid_argument("Samples need at least one feature and one target");
+    }
+    if (byteScale <= 0) {
+        throw std::invalid_argument("Byte features need a positive scale");
+    }
+    this->sampleCount = samples;
+    this->featureCount = featureCount;
+    this->targetCount = targetCount;
+    this->byteScale = byteScale;
+    this->bytes.resize(samples * featureCount);
+    this->targets.resize(samples * targetCount);
+}
+
+template <typename T> size_t Dataset<T>::size() const {
+    return this->sampleCount;
+}
+
+template <typename T> int Dataset<T>::getFeatureCount() const {
+    return this->featureCount;
+}
+
+template <typename T> int Dataset<T>::getTargetCount() const {
+    return this->targetCount;
+}
+
+template <typename T> bool Dataset<T>::hasByteFeatures() const {
+    return this->byteScale != 0;
+}
+
+template <typename T> T Dataset<T>::getByteScale() const {
+    return this->byteScale;
+}
+
+template <typename T> T* Dataset<T>::featuresOf(size_t sample) {
+    return const_cast<T*>(std::as_const(*this).featuresOf(sample));
+}
+
+template <typename T> const T* Dataset<T>::featuresOf(size_t sample) const {
+    if (this->hasByteFeatures()) {
+        throw std::invalid_argument("Dataset stores its features as bytes");
+    }
+    return this->features.data() + (sample * this->featureCount);
+}
+
+template <typename T> uint8_t* Dataset<T>::bytesOf(size_t sample) {
+    return const_cast<uint8_t*>(std::as_const(*this).bytesOf(sample));
+}
+
+template <typename T> const uint8_t* Dataset<T>::bytesOf(size_t sample) const {
+    if (!this->hasByteFeatures()) {
+        throw std::invalid_argument("Dataset doesn't store its features as bytes");
+    }
+    return this->bytes.data() + (sample * this->featureCount);
+}
+
+template <typename T> T* Dataset<T>::targetOf(size_t sample) {
+    return this->targets.data() + (sample * this->targetCount);
+}
+
+template <typename T> const T* Dataset<T>::targetOf(size_t sample) const {
+    return this->targets.data() + (sample * this->targetCount);
+}
+
+template <typename T> void Dataset<T>::copyFeatures(size_t sample, T* out) const {
+    size_t first = sample * this->featureCount;
+    if (!this->hasByteFeatures()) {
+        std::copy_n(this->features.data() + first, this->featureCount, out);
+        return;
+    }
+    const uint8_t* values = this->bytes.data() + first;
+    const T scale = this->byteScale;
+    int count = this->featureCount;
+#pragma omp simd
+    for (int i = 0; i < count; ++i) {
+        out[i] = values[i] * scale;
+    }
+}
+
+template <typename T> bool Dataset<T>::saveCache(std::string path, std::string source) const {
+    CacheHeader header = {};
+    std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = CACHE_VERSION;
+    header.featureCount = this->featureCount;
+    header.samples = this->sampleCount;
+    header.classes = this->targetCount;
+    if (!source_stamp(source, header.sourceBytes, header.sourceTime)) {
+        std::cerr << "Couldnt read " << source << std::endl;
+        return false;
+    }
+    if (this->targetCount > 256) {
+        std::cerr << "Too many classes to cache as bytes" << std::endl;
+        return false;
+    }
+    std::vector<uint8_t> labels(this->sampleCount);
+    for (size_t s = 0; s < this->sampleCount; ++s) {
+        const T* target = this->targetOf(s);
+        const T* hot = std::max_element(target, target + this->targetCount);
+        int zeros = std::count(target, target + this->targetCount, static_cast<T>(0));
+        if (*hot != 1 || zeros != this->targetCount - 1) {
+            std::cerr << "Targets aren't one-hot, the dataset can't be cached" << std::endl;
+            return false;
+        }
+        labels[s] = hot - target;
+    }
+    // Features stored as T are cached when every one is a whole number of byte steps
+    std::vector<uint8_t> converted;
+    const uint8_t* values = this->bytes.data();
+    header.byteScale = this->byteScale;
+    if (!this->hasByteFeatures()) {
+        T peak = this->features.empty()
+                     ? 0
+                     : *std::max_element(this->features.begin(), this->features.end());
+        header.byteScale = peak > 0 ? peak / 255.0 : 1;
+        converted.resize(this->features.size());
+        for (size_t i = 0; i < this->features.size(); ++i) {
+            double level = this->features[i] / header.byteScale;
+            double step = std::round(level);
+            if (step < 0 || step > 255 || std::abs(level - step) > BYTE_TOLERANCE) {
+                std::cerr << "Features aren't byte steps, the dataset can't be cached" << std::endl;
+                return false;
+            }
+            converted[i] = step;
+        }
+        values = converted.data();
+    }
+
+    std::string partial = path + ".tmp";
+    std::ofstream file(partial, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Couldnt create file " << partial << std::endl;
+        return false;
+    }
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(values), this->sampleCount * this->featureCount);
+    file.write(reinterpret_cast<const char*>(labels.data()), labels.size());
+    file.close();
+    std::error_code error;
+    if (file) {
+        std::filesystem::rename(partial, path, error);
+    }
+    if (!file || error) {
+        std::cerr << "Couldnt write cache " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+template <typename T> bool Dataset<T>::loadCache(std::string path, std::string source) {
+    std::ifstream file(path, std::ios::binary);
+    CacheHeader header;
+    uint64_t sourceBytes;
+    int64_t sourceTime;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 ||
+        header.version != CACHE_VERSION || !source_stamp(source, sourceBytes, sourceTime) ||
+        header.sourceBytes != sourceBytes || header.sourceTime != sourceTime) {
+        return false;
+    }
+    // The shape is checked against the cache's size before it sizes any allocation
+    std::error_code error;
+    uint64_t cacheBytes = std::filesystem::file_size(path, error);
+    T byteScale = header.byteScale;
+    bool shaped = !error && header.featureCount > 0 &&
+                  header.featureCount <= std::numeric_limits<int>::max() && header.classes > 0 &&
+                  header.classes <= 256 && std::isfinite(byteScale) && byteScale > 0 &&
+                  header.samples <= (cacheBytes - sizeof(header)) / (header.featureCount + 1ull) &&
+                  sizeof(header) + (header.samples * (header.featureCount + 1ull)) == cacheBytes;
+    if (!shaped) {
+        std::cerr << "Cache " << path << " is damaged" << std::endl;
+        return false;
+    }
+    // The features go straight into the dataset's buffer, the labels are expanded to targets
+    Dataset<T> loaded(header.samples, header.featureCount, header.classes, byteScale);
+    std::vector<uint8_t> labels(header.samples);
+    file.read(reinterpret_cast<char*>(loaded.bytes.data()), loaded.bytes.size());
+    file.read(reinterpret_cast<char*>(labels.data()), labels.size());
+    if (!file) {
+        std::cerr << "Cache " << path << " is truncated" << std::endl;
+        return false;
+    }
+    for (size_t s = 0; s < labels.size(); ++s) {
+        if (labels[s] >= header.classes) {
+            std::cerr << "Cache " << path << " is damaged" << std::endl;
+            return false;
+        }
+        loaded.targetOf(s)[labels[s]] = 1;
+    }
+    *this = std::move(loaded);
+    return true;
+}
+
+template <typename T>
+bool Dataset<T>::loadIdx(std::string imagesPath, std::string labelsPath) {
+    std::ifstream images(imagesPath, std::ios::binary);
+    std::ifstream labels(labelsPath, std::ios::binary);
+    if (!images.is_open() || !labels.is_open()) {
+        std::cerr << "Couldnt open file " << (images.is_open() ? labelsPath : imagesPath)
+                  << std::endl;
+        return false;
+    }
+    uint32_t magic, samples, rows, columns, labelCount;
+    if (!read_big_endian(images, magic) || magic != IDX_IMAGES ||
+        !read_big_endian(images, samples) || !read_big_endian(images, rows) ||
+        !read_big_endian(images, columns) || rows == 0 || columns == 0 ||
+        static_cast<uint64_t>(rows) * columns > std::numeric_limits<int>::max()) {
+        std::cerr << imagesPath << " isnt an IDX file of byte images" << std::endl;
+        return false;
+    }
+    if (!read_big_endian(labels, magic) || magic != IDX_LABELS ||
+        !read_big_endian(labels, labelCount)) {
+        std::cerr << labelsPath << " isnt an IDX file of byte labels" << std::endl;
+        return false;
+    }
+    if (labelCount != samples) {
+        std::cerr << labelsPath << " has " << labelCount << " labels for " << samples
+                  << " images" << std::endl;
+        return false;
+    }
+    std::vector<uint8_t> classes(samples);
+    if (!labels.read(reinterpret_cast<char*>(classes.data()), classes.size())) {
+        std::cerr << labelsPath << " is truncated" << std::endl;
+        return false;
+    }
+    int classCount = classes.empty() ? 1 : *std::max_element(classes.begin(), classes.end()) + 1;
+    // The pixels are already laid out as the dataset keeps them, one read fills it
+    Dataset<T> loaded(samples, rows * columns, classCount, 1.0 / 255.0);
+    if (!images.read(reinterpret_cast<char*>(loaded.bytes.data()), loaded.bytes.size())) {
+        std::cerr << imagesPath << " is truncated" << std::endl;
+        return false;
+    }
+    for (size_t s = 0; s < classes.size(); ++s) {
+        loaded.targetOf(s)[classes[s]] = 1;
+    }
+    *this = std::move(loaded);
+    return true;
+}
+
+template <typename T> bool Dataset<T>::loadCsv(std::string path, T byteScale) {
+    MappedText text(path);
+    if (!text.begin) {
+        std::cerr << "Couldnt map file " << path << ", or it is empty" << std::endl;
+        return false;
+    }
+    const char* end = text.begin + text.bytes;
+
+    // The first line is a header unless it starts with a label. The features are counted on the
+    // first line of samples, every other one must have as many
+    CsvChunk all = {text.begin, end, 0, 0, NO_ROW};
+    const char* start = nullptr;
+    int featureCount = 0;
+    bool firstLine = true;
+    for_each_line(all, [&](const char* line, const char* lineEnd) {
+        int label;
+        if (firstLine && !parse_label(line, lineEnd, label)) {
+            firstLine = false;
+            return true;
+        }
+        start = line;
+        featureCount = std::count(line, lineEnd, ',');
+        return false;
+    });
+    if (!start || featureCount < 1) {
+        std::cerr << path << " has no rows of a label and features" << std::endl;
+        return false;
+    }
+
+    // Chunk bounds are moved forward to the next line start, chunks may end up empty
+    size_t bytes = end - start;
+    int threads = omp_get_max_threads();
+    size_t chunkCount = std::clamp<size_t>(bytes / CSV_CHUNK_BYTES, 1,
+                                           static_cast<size_t>(threads) * CSV_CHUNKS_PER_THREAD);
+    std::vector<CsvChunk> chunks(chunkCount);
+    const char* bound = start;
+    for (size_t c = 0; c < chunkCount; ++c) {
+        chunks[c] = {bound, end, 0, 0, NO_ROW};
+        if (c > 0) {
+            chunks[c - 1].last = bound;
+        }
+        const char* split = start + (bytes * (c + 1) / chunkCount);
+        const char* newline =
+            split < end ? static_cast<const char*>(std::memchr(split - 1, '\n', end - split + 1))
+                        : nullptr;
+        bound = std::max(bound, newline ? newline + 1 : end);
+    }
+
+    // First pass: rows and largest label of every chunk, which size the dataset
+#pragma omp parallel for schedule(dynamic)
+    for (size_t c = 0; c < chunkCount; ++c) {
+        CsvChunk& chunk = chunks[c];
+        for_each_line(chunk, [&](const char* line, const char* lineEnd) {
+            int label;
+            if (!parse_label(line, lineEnd, label)) {
+                chunk.failedRow = chunk.rows;
+                return false;
+            }
+            chunk.maxLabel = std::max(chunk.maxLabel, label);
+            chunk.rows++;
+            return true;
+        });
+    }
+    std::vector<size_t> firstRows(chunkCount);
+    size_t samples = 0;
+    int maxLabel = 0;
+    for (size_t c = 0; c < chunkCount; ++c) {
+        if (chunks[c].failedRow != NO_ROW) {
+            std::cerr << "Row " << samples + chunks[c].failedRow + 1 << " of " << path
+                      << " doesnt start with a label" << std::endl;
+            return false;
+        }
+        firstRows[c] = samples;
+        samples += chunks[c].rows;
+        maxLabel = std::max(maxLabel, chunks[c].maxLabel);
+    }
+
+    // Second pass: every chunk parses its rows into their place in the dataset. A feature that
+    // isn't a byte has the whole file parsed again as T
+    bool asBytes = byteScale > 0;
+    for (;;) {
+        Dataset<T> loaded = asBytes ? Dataset<T>(samples, featureCount, maxLabel + 1, byteScale)
+                                    : Dataset<T>(samples, featureCount, maxLabel + 1);
+#pragma omp parallel for schedule(dynamic)
+        for (size_t c = 0; c < chunkCount; ++c) {
+            CsvChunk& chunk = chunks[c];
+            size_t row = firstRows[c];
+            for_each_line(chunk, [&](const char* line, const char* lineEnd) {
+                int label;
+                if (!parse_row(line, lineEnd, featureCount, label,
+                               asBytes ? loaded.bytesOf(row) : nullptr,
+                               asBytes ? nullptr : loaded.featuresOf(row))) {
+                    chunk.failedRow = row - firstRows[c];
+                    return false;
+                }
+                loaded.targetOf(row)[label] = 1;
+                row++;
+                return true;
+            });
+        }
+        auto failed = std::find_if(chunks.begin(), chunks.end(),
+                                   [](const CsvChunk& chunk) { return chunk.failedRow != NO_ROW; });
+        if (failed == chunks.end()) {
+            *this = std::move(loaded);
+            return true;
+        }
+        if (!asBytes) {
+            std::cerr << "Row " << firstRows[failed - chunks.begin()] + failed->failedRow + 1
+                      << " of " << path << " isnt a label and " << featureCount << " features"
+                      << std::endl;
+            return false;
+        }
+        for (CsvChunk& chunk : chunks) {
+            chunk.failedRow = NO_ROW;
+        }
+        asBytes = false;
+    }
+}
+
+template class Dataset<float>;
+template class Dataset<double>;
@@ -0,0 +1,450 @@
+#include "../include/Gemm.hpp"
+#include "../include/Arena.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <omp.h>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GEMM_X86
+#endif
+
+// Blocking sizes: a KC x NR panel of B stays in L1 while the micro-kernel sweeps it, an MC x KC
+// block of packed A stays in L2 and the whole KC x NC panel of packed B stays in L3
+static constexpr size_t KC = 256;
+static constexpr size_t MC = 96;
+static constexpr size_t NC = 4096;
+
+// Below this many multiply-adds the OpenMP fork costs more than it saves
+static constexpr size_t PARALLEL_THRESHOLD = 64 * 64 * 64;
+
+enum GemmIsa { REFERENCE, GENERIC, AVX2, AVX512 };
+
+static GemmIsa detectIsa() {
+    GemmIsa best = GENERIC;
+#ifdef GEMM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        best = AVX512;
+    } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        best = AVX2;
+    }
+#endif
+    const char* forced = std::getenv("NN_GEMM_ISA");
+    if (forced == nullptr) {
+        return best;
+    }
+    std::string name(forced);
+    if (name == "reference") {
+        return REFERENCE;
+    } else if (name == "generic") {
+        return GENERIC;
+    } else if (name == "avx2" && best >= AVX2) {
+        return AVX2;
+    } else if (name == "avx512" && best >= AVX512) {
+        return AVX512;
+    }
+    return best;
+}
+
+static GemmIsa gemmIsa() {
+    static const GemmIsa isa = detectIsa();
+    return isa;
+}
+
+static size_t roundUp(size_t value, size_t multiple) {
+    return ((value + multiple - 1) / multiple) * multiple;
+}
+
+// Grow-only, 64-byte aligned scratch for the packed panels. One per thread so concurrent gemm
+// calls never share it
+template <typename T> struct PackBuffer {
+    T* data = nullptr;
+    size_t capacity = 0;
+
+    T* get(size_t count) {
+        if (count > this->capacity) {
+            Arena::release(this->data, this->capacity * sizeof(T));
+            this->data = static_cast<T*>(Arena::allocate(count * sizeof(T)));
+            this->capacity = count;
+        }
+        return this->data;
+    }
+    ~PackBuffer() {
+        Arena::release(this->data, this->capacity * sizeof(T));
+    }
+};
+// Only one kernel runs in a process, so its instances all share these
+template <typename T> thread_local PackBuffer<T> packedA;
+template <typename T> thread_local PackBuffer<T> packedB;
+
+// Rows of A each thread packs at a time, short matrices get smaller blocks so every thread still
+// gets work
+template <int MR> static size_t rowBlock(size_t m, size_t threads) {
+    return std::min(MC, std::max<size_t>(MR, roundUp((m + threads - 1) / threads, MR)));
+}
+
+// Copies an mc x kc block of A into panels of MR rows, stored column by column so the kernel reads
+// MR consecutive values per step of k. The last panel is padded with zeros. rs and cs are the
+// distances between consecutive rows and columns, so a transposed A is packed straight from its
+// original storage
+template <typename T, int MR>
+static void packA(size_t mc, size_t kc, const T* a, size_t rs, size_t cs, T* packed) {
+    for (size_t ir = 0; ir < mc; ir += MR) {
+        size_t rows = std::min<size_t>(MR, mc - ir);
+        if (cs == 1) {
+            for (size_t r = 0; r < MR; ++r) {
+                const T* row = a + ((ir + r) * rs);
+                for (size_t p = 0; p < kc; ++p) {
+                    packed[(p * MR) + r] = r < rows ? row[p] : static_cast<T>(0);
+                }
+            }
+        } else {
+            for (size_t p = 0; p < kc; ++p) {
+                const T* col = a + (ir * rs) + (p * cs);
+                for (size_t r = 0; r < MR; ++r) {
+                    packed[(p * MR) + r] = r < rows ? col[r * rs] : static_cast<T>(0);
+                }
+            }
+        }
+        packed += MR * kc;
+    }
+}
+
+// Copies one kc x NR panel of B row by row, padding the missing columns with zeros. Same stride
+// convention as packA
+template <typename T, int NR>
+static void packBPanel(size_t cols, size_t kc, const T* b, size_t rs, size_t cs, T* packed) {
+    if (cs == 1) {
+        for (size_t p = 0; p < kc; ++p) {
+            const T* row = b + (p * rs);
+            for (size_t l = 0; l < NR; ++l) {
+                packed[(p * NR) + l] = l < cols ? row[l] : static_cast<T>(0);
+            }
+        }
+    } else {
+        for (size_t l = 0; l < NR; ++l) {
+            const T* col = b + (l * cs);
+            for (size_t p = 0; p < kc; ++p) {
+                packed[(p * NR) + l] = l < cols ? col[p * rs] : static_cast<T>(0);
+            }
+        }
+    }
+}
+
+// Micro-kernels: multiply an MR x kc panel of packed A by a kc x NR panel of packed B and write
+// (or add, when accumulate is set) the MR x NR result tile into C
+template <typename T, int MR, int NR>
+static void kernelGeneric(size_t kc, const T* a, const T* b, T* c, size_t ldc, bool accumulate) {
+    T acc[MR][NR] = {};
+    for (size_t p = 0; p < kc; ++p) {
+        for (int r = 0; r < MR; ++r) {
+            for (int l = 0; l < NR; ++l) {
+                acc[r][l] += a[(p * MR) + r] * b[(p * NR) + l];
+            }
+        }
+    }
+    for (int r = 0; r < MR; ++r) {
+        for (int l = 0; l < NR; ++l) {
+            c[(r * ldc) + l] = accumulate ? c[(r * ldc) + l] + acc[r][l] : acc[r][l];
+        }
+    }
+}
+
+#ifdef GEMM_X86
+__attribute__((target("avx2,fma"))) static void kernelAvx2(size_t kc, const double* a,
+                                                            const double* b, double* c, size_t ldc,
+                                                            bool accumulate) {
+    __m256d acc[6][2];
+#pragma GCC unroll 6
+    for (int r = 0; r < 6; ++r) {
+        acc[r][0] = _mm256_setzero_pd();
+        acc[r][1] = _mm256_setzero_pd();
+    }
+    for (size_t p = 0; p < kc; ++p) {
+        __m256d b0 = _mm256_load_pd(b + (p * 8));
+        __m256d b1 = _mm256_load_pd(b + (p * 8) + 4);
+#pragma GCC unroll 6
+        for (int r = 0; r < 6; ++r) {
+            __m256d av = _mm256_broadcast_sd(a + (p * 6) + r);
+            acc[r][0] = _mm256_fmadd_pd(av, b0, acc[r][0]);
+            acc[r][1] = _mm256_fmadd_pd(av, b1, acc[r][1]);
+        }
+    }
+#pragma GCC unroll 6
+    for (int r = 0; r < 6; ++r) {
+        double* row = c + (r * ldc);
+        if (accumulate) {
+            acc[r][0] = _mm256_add_pd(acc[r][0], _mm256_loadu_pd(row));
+            acc[r][1] = _mm256_add_pd(acc[r][1], _mm256_loadu_pd(row + 4));
+        }
+        _mm256_storeu_pd(row, acc[r][0]);
+        _mm256_storeu_pd(row + 4, acc[r][1]);
+    }
+}
+
+__attribute__((target("avx2,fma"))) static void kernelAvx2(size_t kc, const float* a,
+                                                            const float* b, float* c, size_t ldc,
+                                                            bool accumulate) {
+    __m256 acc[6][2];
+#pragma GCC unroll 6
+    for (int r = 0; r < 6; ++r) {
+        acc[r][0] = _mm256_setzero_ps();
+        acc[r][1] = _mm256_setzero_ps();
+    }
+    for (size_t p = 0; p < kc; ++p) {
+        __m256 b0 = _mm256_load_ps(b + (p * 16));
+        __m256 b1 = _mm256_load_ps(b + (p * 16) + 8);
+#pragma GCC unroll 6
+        for (int r = 0; r < 6; ++r) {
+            __m256 av = _mm256_broadcast_ss(a + (p * 6) + r);
+            acc[r][0] = _mm256_fmadd_ps(av, b0, acc[r][0]);
+            acc[r][1] = _mm256_fmadd_ps(av, b1, acc[r][1]);
+        }
+    }
+#pragma GCC unroll 6
+    for (int r = 0; r < 6; ++r) {
+        float* row = c + (r * ldc);
+        if (accumulate) {
+            acc[r][0] = _mm256_add_ps(acc[r][0], _mm256_loadu_ps(row));
+            acc[r][1] = _mm256_add_ps(acc[r][1], _mm256_loadu_ps(row + 8));
+        }
+        _mm256_storeu_ps(row, acc[r][0]);
+        _mm256_storeu_ps(row + 8, acc[r][1]);
+    }
+}
+
+__attribute__((target("avx512f"))) static void kernelAvx512(size_t kc, const double* a,
+                                                             const double* b, double* c,
+                                                             size_t ldc, bool accumulate) {
+    __m512d acc[8][2];
+#pragma GCC unroll 8
+    for (int r = 0; r < 8; ++r) {
+        acc[r][0] = _mm512_setzero_pd();
+        acc[r][1] = _mm512_setzero_pd();
+    }
+    for (size_t p = 0; p < kc; ++p) {
+        __m512d b0 = _mm512_load_pd(b + (p * 16));
+        __m512d b1 = _mm512_load_pd(b + (p * 16) + 8);
+#pragma GCC unroll 8
+        for (int r = 0; r < 8; ++r) {
+            __m512d av = _mm512_set1_pd(a[(p * 8) + r]);
+            acc[r][0] = _mm512_fmadd_pd(av, b0, acc[r][0]);
+            acc[r][1] = _mm512_fmadd_pd(av, b1, acc[r][1]);
+        }
+    }
+#pragma GCC unroll 8
+    for (int r = 0; r < 8; ++r) {
+        double* row = c + (r * ldc);
+        if (accumulate) {
+            acc[r][0] = _mm512_add_pd(acc[r][0], _mm512_loadu_pd(row));
+            acc[r][1] = _mm512_add_pd(acc[r][1], _mm512_loadu_pd(row + 8));
+        }
+        _mm512_storeu_pd(row, acc[r][0]);
+        _mm512_storeu_pd(row + 8, acc[r][1]);
+    }
+}
+
+__attribute__((target("avx512f"))) static void kernelAvx512(size_t kc, const float* a,
+                                                             const float* b, float* c, size_t ldc,
+                                                             bool accumulate) {
+    __m512 acc[8][2];
+#pragma GCC unroll 8
+    for (int r = 0; r < 8; ++r) {
+        acc[r][0] = _mm512_setzero_ps();
+        acc[r][1] = _mm512_setzero_ps();
+    }
+    for (size_t p = 0; p < kc; ++p) {
+        __m512 b0 = _mm512_load_ps(b + (p * 32));
+        __m512 b1 = _mm512_load_ps(b + (p * 32) + 16);
+#pragma GCC unroll 8
+        for (int r = 0; r < 8; ++r) {
+            __m512 av = _mm512_set1_ps(a[(p * 8) + r]);
+            acc[r][0] = _mm512_fmadd_ps(av, b0, acc[r][0]);
+            acc[r][1] = _mm512_fmadd_ps(av, b1, acc[r][1]);
+        }
+    }
+#pragma GCC unroll 8
+    for (int r = 0; r < 8; ++r) {
+        float* row = c + (r * ldc);
+        if (accumulate) {
+            acc[r][0] = _mm512_add_ps(acc[r][0], _mm512_loadu_ps(row));
+            acc[r][1] = _mm512_add_ps(acc[r][1], _mm512_loadu_ps(row + 16));
+        }
+        _mm512_storeu_ps(row, acc[r][0]);
+        _mm512_storeu_ps(row + 16, acc[r][1]);
+    }
+}
+#endif
+
+// Goto/BLIS style loop nest: B is packed once per (jc, pc) panel and shared by all threads, each
+// thread packs its own MC x KC block of A and sweeps it with the micro-kernel
+template <typename T, int MR, int NR, void (*Kernel)(size_t, const T*, const T*, T*, size_t, bool)>
+static void gemmBlocked(bool transA, bool transB, size_t m, size_t n, size_t k, const T* a,
+                        size_t lda, const T* b, size_t ldb, T* c, size_t ldc, bool accumulate) {
+    if (m == 0 || n == 0) {
+        return;
+    }
+    if (k == 0) {
+        if (!accumulate) {
+            for (size_t j = 0; j < m; ++j) {
+                std::fill(c + (j * ldc), c + (j * ldc) + n, static_cast<T>(0));
+            }
+        }
+        return;
+    }
+
+    const size_t rsA = transA ? 1 : lda, csA = transA ? lda : 1;
+    const size_t rsB = transB ? 1 : ldb, csB = transB ? ldb : 1;
+
+    const bool parallel = (m * n * k) >= PARALLEL_THRESHOLD;
+    const size_t threads = parallel ? static_cast<size_t>(omp_get_max_threads()) : 1;
+    const size_t mc = rowBlock<MR>(m, threads);
+    T* bPack = packedB<T>.get(KC * roundUp(std::min(n, NC), NR));
+
+    for (size_t jc = 0; jc < n; jc += NC) {
+        size_t nc = std::min(NC, n - jc);
+        for (size_t pc = 0; pc < k; pc += KC) {
+            size_t kc = std::min(KC, k - pc);
+            bool acc = accumulate || pc != 0;
+#pragma omp parallel if (parallel)
+            {
+#pragma omp for schedule(static)
+                for (size_t jr = 0; jr < nc; jr += NR) {
+                    packBPanel<T, NR>(std::min<size_t>(NR, nc - jr), kc,
+                                      b + (pc * rsB) + ((jc + jr) * csB), rsB, csB,
+                                      bPack + (jr * kc));
+                }
+
+                T* aPack = packedA<T>.get(mc * kc);
+#pragma omp for schedule(dynamic)
+                for (size_t ic = 0; ic < m; ic += mc) {
+                    size_t mcCur = std::min(mc, m - ic);
+                    packA<T, MR>(mcCur, kc, a + (ic * rsA) + (pc * csA), rsA, csA, aPack);
+                    for (size_t jr = 0; jr < nc; jr += NR) {
+                        size_t cols = std::min<size_t>(NR, nc - jr);
+                        for (size_t ir = 0; ir < mcCur; ir += MR) {
+                            size_t rows = std::min<size_t>(MR, mcCur - ir);
+                            T* cTile = c + ((ic + ir) * ldc) + jc + jr;
+                            if (rows == MR && cols == NR) {
+                                Kernel(kc, aPack + (ir * kc), bPack + (jr * kc), cTile, ldc, acc);
+                                continue;
+                            }
+                            // Edge tile: compute the full tile aside and copy the valid part
+                            alignas(64) T tile[MR * NR];
+                            Kernel(kc, aPack + (ir * kc), bPack + (jr * kc), tile, NR, false);
+                            for (size_t r = 0; r < rows; ++r) {
+                                for (size_t l = 0; l < cols; ++l) {
+                                    T value = tile[(r * NR) + l];
+                                    cTile[(r * ldc) + l] =
+                                        acc ? cTile[(r * ldc) + l] + value : value;
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Sizes the buffers of gemmBlocked for its products up to m x n x k. Serial products have the
+// calling thread pack the tallest blocks of A, parallel ones have every thread pack its own
+template <typename T, int MR, int NR> static void reserveBlocked(size_t m, size_t n, size_t k) {
+    if (m == 0 || n == 0 || k == 0) {
+        return;
+    }
+    const size_t kc = std::min(KC, k);
+    packedB<T>.get(KC * roundUp(std::min(n, NC), NR));
+    packedA<T>.get(rowBlock<MR>(m, 1) * kc);
+    if ((m * n * k) >= PARALLEL_THRESHOLD) {
+        const size_t mc = rowBlock<MR>(m, omp_get_max_threads());
+#pragma omp parallel
+        packedA<T>.get(mc * kc);
+    }
+}
+
+template <>
+void gemm<float>(bool transA, bool transB, size_t m, size_t n, size_t k, const float* a,
+                 size_t lda, const float* b, size_t ldb, float* c, size_t ldc, bool accumulate) {
+    switch (gemmIsa()) {
+#ifdef GEMM_X86
+    case AVX512:
+        gemmBlocked<float, 8, 32, kernelAvx512>(transA, transB, m, n, k, a, lda, b, ldb, c, ldc,
+                                                accumulate);
+        break;
+    case AVX2:
+        gemmBlocked<float, 6, 16, kernelAvx2>(transA, transB, m, n, k, a, lda, b, ldb, c, ldc,
+                                              accumulate);
+        break;
+#endif
+    case REFERENCE:
+        gemmReference(transA, transB, m, n, k, a, lda, b, ldb, c, ldc, accumulate);
+        break;
+    default:
+        gemmBlocked<float, 4, 8, kernelGeneric<float, 4, 8>>(transA, transB, m, n, k, a, lda, b,
+                                                             ldb, c, ldc, accumulate);
+        break;
+    }
+}
+
+template <>
+void gemm<double>(bool transA, bool transB, size_t m, size_t n, size_t k, const double* a,
+                  size_t lda, const double* b, size_t ldb, double* c, size_t ldc, bool accumulate) {
+    switch (gemmIsa()) {
+#ifdef GEMM_X86
+    case AVX512:
+        gemmBlocked<double, 8, 16, kernelAvx512>(transA, transB, m, n, k, a, lda, b, ldb, c, ldc,
+                                                 accumulate);
+        break;
+    case AVX2:
+        gemmBlocked<double, 6, 8, kernelAvx2>(transA, transB, m, n, k, a, lda, b, ldb, c, ldc,
+                                              accumulate);
+        break;
+#endif
+    case REFERENCE:
+        gemmReference(transA, transB, m, n, k, a, lda, b, ldb, c, ldc, accumulate);
+        break;
+    default:
+        gemmBlocked<double, 4, 4, kernelGeneric<double, 4, 4>>(transA, transB, m, n, k, a, lda, b,
+                                                               ldb, c, ldc, accumulate);
+        break;
+    }
+}
+
+template <> void gemmReserve<float>(size_t m, size_t n, size_t k) {
+    switch (gemmIsa()) {
+#ifdef GEMM_X86
+    case AVX512:
+        reserveBlocked<float, 8, 32>(m, n, k);
+        break;
+    case AVX2:
+        reserveBlocked<float, 6, 16>(m, n, k);
+        break;
+#endif
+    case REFERENCE:
+        break;
+    default:
+        reserveBlocked<float, 4, 8>(m, n, k);
+        break;
+    }
+}
+
+template <> void gemmReserve<double>(size_t m, size_t n, size_t k) {
+    switch (gemmIsa()) {
+#ifdef GEMM_X86
+    case AVX512:
+        reserveBlocked<double, 8, 16>(m, n, k);
+        break;
+    case AVX2:
+        reserveBlocked<double, 6, 8>(m, n, k);
+        break;
+#endif
+    case REFERENCE:
+        break;
+    default:
+        reserveBlocked<double, 4, 4>(m, n, k);
+        break;
+    }
+}
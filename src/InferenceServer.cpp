@@ -0,0 +1,316 @@
+#include "../include/InferenceServer.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <numeric>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Latest requests the latency percentiles are taken over
+static constexpr size_t LATENCY_WINDOW = 1 << 14;
+// Longest a feature is expected to be written, a client line longer than this many per feature
+// can't be a request and the client is dropped
+static constexpr size_t MAX_FEATURE_CHARS = 64;
+
+template <typename T>
+InferenceServer<T>::InferenceServer(const NeuralNetwork<T>& model, int maxBatch,
+                                    std::chrono::microseconds maxDelay)
+    : model(model), maxBatch(maxBatch), maxDelay(maxDelay), stopping(false), requestCount(0),
+      batchCount(0), latencyIt(0) {
+    if (maxBatch < 1 || maxDelay.count() < 0) {
+        throw std::invalid_argument("Batches need at least one request and a delay of 0 or more");
+    }
+    if (model.getLayers().empty()) {
+        throw std::invalid_argument("Model has no layers to serve");
+    }
+    this->featureCount = model.getLayers().front().getWeights().getWidth();
+    this->outputCount = model.getLayers().back().getNodeCount();
+    this->latencies.reserve(LATENCY_WINDOW);
+    this->started = std::chrono::steady_clock::now();
+    this->batcher = std::thread(&InferenceServer<T>::run, this);
+}
+
+template <typename T> InferenceServer<T>::~InferenceServer() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->arrived.notify_all();
+    this->batcher.join();
+}
+
+template <typename T> void InferenceServer<T>::run() {
+    // Allocated once, every batch reuses them
+    typename NeuralNetwork<T>::Scratch scratch = this->model.makeScratch(this->maxBatch);
+    Matrix<T> input(this->featureCount, this->maxBatch); // one sample per row
+    std::vector<Request*> batch;
+    batch.reserve(this->maxBatch);
+    std::vector<int> ranking(this->outputCount);
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->arrived.wait(lock, [&] { return this->stopping || !this->queue.empty(); });
+            if (this->queue.empty()) {
+                return;
+            }
+            // The oldest request waits for company until its deadline or a full batch
+            auto deadline = this->queue.front()->arrival + this->maxDelay;
+            this->arrived.wait_until(lock, deadline, [&] {
+                return this->stopping || this->queue.size() >= static_cast<size_t>(this->maxBatch);
+            });
+            size_t count = std::min<size_t>(this->queue.size(), this->maxBatch);
+            batch.assign(this->queue.begin(), this->queue.begin() + count);
+            this->queue.erase(this->queue.begin(), this->queue.begin() + count);
+        }
+
+        int size = batch.size();
+        for (int i = 0; i < size; ++i) {
+            std::copy_n(batch[i]->input, this->featureCount,
+                        input.data() + (i * this->featureCount));
+        }
+        // A batch that fails fails the requests not yet answered, the batcher goes on to the next
+        int answered = 0;
+        try {
+            const Matrix<T>& output =
+                this->model.infer(input.view().rows(0, size).transpose(), scratch);
+
+            // Requests go away once answered, so they are timed first
+            auto done = std::chrono::steady_clock::now();
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                this->requestCount += size;
+                this->batchCount++;
+                for (Request* request : batch) {
+                    double latency =
+                        std::chrono::duration<double, std::milli>(done - request->arrival).count();
+                    if (this->latencies.size() < LATENCY_WINDOW) {
+                        this->latencies.push_back(latency);
+                    } else {
+                        this->latencies[this->latencyIt] = latency;
+                    }
+                    this->latencyIt = (this->latencyIt + 1) % LATENCY_WINDOW;
+                }
+            }
+            for (int i = 0; i < size; ++i) {
+                Prediction prediction;
+                int topK = batch[i]->topK;
+                std::iota(ranking.begin(), ranking.end(), 0);
+                std::partial_sort(ranking.begin(), ranking.begin() + topK, ranking.end(),
+                                  [&](int a, int b) {
+                                      return output.getValue(i, a) > output.getValue(i, b);
+                                  });
+                for (int k = 0; k < topK; ++k) {
+                    prediction.classes.push_back(ranking[k]);
+                    prediction.scores.push_back(output.getValue(i, ranking[k]));
+                }
+                batch[i]->result.set_value(std::move(prediction));
+                answered++;
+            }
+        } catch (...) {
+            std::exception_ptr error = std::current_exception();
+            for (int i = answered; i < size; ++i) {
+                batch[i]->result.set_exception(error);
+            }
+        }
+    }
+}
+
+template <typename T> void InferenceServer<T>::checkTopK(int topK) const {
+    if (topK < 1 || topK > this->outputCount) {
+        throw std::invalid_argument("Top classes must be between 1 and " +
+                                    std::to_string(this->outputCount));
+    }
+}
+
+template <typename T>
+typename InferenceServer<T>::Prediction InferenceServer<T>::predict(const T* input, int topK) {
+    this->checkTopK(topK);
+    Request request;
+    request.input = input;
+    request.topK = topK;
+    request.arrival = std::chrono::steady_clock::now();
+    std::future<Prediction> result = request.result.get_future();
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (this->stopping) {
+            throw std::runtime_error("Inference server is stopping");
+        }
+        this->queue.push_back(&request);
+    }
+    this->arrived.notify_one();
+    return result.get();
+}
+
+template <typename T> typename InferenceServer<T>::Stats InferenceServer<T>::getStats() {
+    std::vector<double> window;
+    Stats stats = {};
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        stats.requests = this->requestCount;
+        stats.batches = this->batchCount;
+        window = this->latencies;
+    }
+    double seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - this->started).count();
+    stats.requestsPerSecond = stats.requests / seconds;
+    if (!window.empty()) {
+        auto percentile = [&](double fraction) {
+            auto nth = window.begin() + static_cast<size_t>(fraction * (window.size() - 1));
+            std::nth_element(window.begin(), nth, window.end());
+            return *nth;
+        };
+        stats.p50Milliseconds = percentile(0.5);
+        stats.p99Milliseconds = percentile(0.99);
+    }
+    return stats;
+}
+
+template <typename T>
+std::string InferenceServer<T>::answer(const std::string& line, int topK) {
+    char text[128];
+    if (line == "stats") {
+        Stats stats = this->getStats();
+        std::snprintf(text, sizeof(text),
+                      "requests %zu batches %zu throughput %.1f/s p50 %.3fms p99 %.3fms",
+                      stats.requests, stats.batches, stats.requestsPerSecond,
+                      stats.p50Milliseconds, stats.p99Milliseconds);
+        return text;
+    }
+    std::vector<T> features;
+    features.reserve(this->featureCount);
+    const char* next = line.c_str();
+    for (;;) {
+        char* end;
+        double value = std::strtod(next, &end);
+        if (end == next) {
+            break;
+        }
+        features.push_back(value);
+        next = end;
+    }
+    next += std::strspn(next, " \t\r");
+    if (*next != '\0' || features.size() != static_cast<size_t>(this->featureCount)) {
+        return "error expected " + std::to_string(this->featureCount) + " numbers";
+    }
+    // A request that can't be answered gets an error line, the connection and server go on
+    Prediction prediction;
+    try {
+        prediction = this->predict(features.data(), topK);
+    } catch (const std::exception& error) {
+        return std::string("error ") + error.what();
+    }
+    std::string reply;
+    for (size_t k = 0; k < prediction.classes.size(); ++k) {
+        std::snprintf(text, sizeof(text), "%s%d %.6g", k == 0 ? "" : " ", prediction.classes[k],
+                      static_cast<double>(prediction.scores[k]));
+        reply += text;
+    }
+    return reply;
+}
+
+template <typename T>
+void InferenceServer<T>::serve(std::istream& in, std::ostream& out, int topK) {
+    this->checkTopK(topK);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty()) {
+            continue;
+        }
+        out << this->answer(line, topK) << std::endl;
+    }
+}
+
+template <typename T> void InferenceServer<T>::answerClient(int client, int topK) {
+    size_t maxLine = std::max<size_t>(sizeof("stats"), this->featureCount * MAX_FEATURE_CHARS);
+    std::string pending;
+    char chunk[1 << 16];
+    for (;;) {
+        ssize_t received = recv(client, chunk, sizeof(chunk), 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return;
+        }
+        pending.append(chunk, received);
+        // Every complete line is a request, a partial one waits for the rest
+        size_t first = 0;
+        for (size_t newline; (newline = pending.find('\n', first)) != std::string::npos;
+             first = newline + 1) {
+            std::string line = pending.substr(first, newline - first);
+            if (line.empty()) {
+                continue;
+            }
+            std::string reply = this->answer(line, topK) + "\n";
+            for (size_t sent = 0; sent < reply.size();) {
+                ssize_t written = send(client, reply.data() + sent, reply.size() - sent,
+                                       MSG_NOSIGNAL);
+                if (written < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (written <= 0) {
+                    return;
+                }
+                sent += written;
+            }
+        }
+        pending.erase(0, first);
+        if (pending.size() > maxLine) {
+            const char reply[] = "error request line too long\n";
+            send(client, reply, sizeof(reply) - 1, MSG_NOSIGNAL);
+            return;
+        }
+    }
+}
+
+template <typename T> void InferenceServer<T>::listen(std::string path, int topK) {
+    this->checkTopK(topK);
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw std::invalid_argument("Socket path is too long: " + path);
+    }
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path.c_str()); // left behind by a server that crashed
+    if (listener < 0 ||
+        bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        ::listen(listener, SOMAXCONN) != 0) {
+        if (listener >= 0) {
+            close(listener);
+        }
+        throw std::runtime_error("Couldn't listen on " + path);
+    }
+
+    std::atomic<int> clients = 0;
+    for (;;) {
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0 && errno == EINTR) {
+            continue;
+        }
+        if (client < 0) {
+            break;
+        }
+        clients.fetch_add(1);
+        std::thread([this, client, topK, &clients] {
+            this->answerClient(client, topK);
+            close(client);
+            clients.fetch_sub(1);
+            clients.notify_all();
+        }).detach();
+    }
+    close(listener);
+    unlink(path.c_str());
+    for (int open; (open = clients.load()) != 0;) {
+        clients.wait(open);
+    }
+}
+
+template class InferenceServer<float>;
+template class InferenceServer<double>;
@@ -1,81 +1,47 @@
 #include "../include/Layer.hpp"
+#include "../include/Activation.hpp"
 #include <cmath>
 #include <iostream>
 #include <random>
 
-template <typename T> Matrix<T> sigmoid(Matrix<T> vals) {
-    Matrix<T> newMat(vals.getWidth(), vals.getHeight());
-
-    for (size_t i = 0; i < vals.getWidth(); ++i) {
-        for (size_t j = 0; j < vals.getHeight(); ++j) {
-            newMat.setValue(i, j, (static_cast<T>(1) / (1 + pow(M_E, -vals.getValue(i, j)))));
-        }
-    }
-    return newMat;
-}
-template <typename T> Matrix<T> sigmoid_derivative(Matrix<T> vals) {
-    Matrix<T> newMat(vals.getWidth(), vals.getHeight());
-    for (size_t i = 0; i < vals.getWidth(); ++i) {
-        for (size_t j = 0; j < vals.getHeight(); ++j) {
-            newMat.setValue(
-                i, j,
-                (pow(M_E, -vals.getValue(i, j)) / pow((1 + pow(M_E, -vals.getValue(i, j))), 2)));
-        }
-    }
-    return newMat;
-}
-template <typename T> Matrix<T> relu(Matrix<T> vals) {
-    Matrix<T> newMat(vals.getWidth(), vals.getHeight());
-    for (size_t i = 0; i < vals.getWidth(); ++i) {
-        for (size_t j = 0; j < vals.getHeight(); ++j) {
-            newMat.setValue(i, j, std::max(static_cast<T>(0), vals.getValue(i, j)));
-        }
-    }
-    return newMat;
-}
-template <typename T> Matrix<T> relu_derivative(Matrix<T> vals) {
-    Matrix<T> newMat(vals.getWidth(), vals.getHeight());
-    for (size_t i = 0; i < vals.getWidth(); ++i) {
-        for (size_t j = 0; j < vals.getHeight(); ++j) {
-            newMat.setValue(i, j, vals.getValue(i, j) > 0 ? 1 : 0);
-        }
-    }
-    return newMat;
+template <typename T>
+Layer<T>::Layer(int nodeCount, int previousLayerNodes, ActivationFunction activationF) {
+    this->nodeCount = nodeCount;
+    this->weights = Matrix<T>(previousLayerNodes, nodeCount);
+    this->biases = Matrix<T>(1, nodeCount);
+    this->sparseDensity = 0;
+    this->optimizerSteps = 0;
+    this->setActivation(activationF);
 }
-template <typename T> Matrix<T> softmax(Matrix<T> vals) {
-    Matrix<T> newMat(vals.getWidth(), vals.getHeight());
-    for (size_t i = 0; i < vals.getWidth(); ++i) {
-        T maxVal = vals.getValue(i, 0);
-        for (size_t j = 1; j < vals.getHeight(); ++j) {
-            maxVal = std::max(maxVal, vals.getValue(i, j));
-        }
-        T sum = 0;
-        for (size_t j = 0; j < vals.getHeight(); ++j) {
-            sum += exp(vals.getValue(i, j) - maxVal);
-        }
-        for (size_t j = 0; j < vals.getHeight(); ++j) {
-            newMat.setValue(i, j, exp(vals.getValue(i, j) - maxVal) / sum);
-        }
+
+template <typename T>
+Layer<T>::Layer(MatrixView<const T> weights, MatrixView<const T> biases,
+                ActivationFunction activationF, MatrixView<const T> packed) {
+    if (biases.getWidth() != 1 || biases.getHeight() != weights.getHeight()) {
+        throw std::invalid_argument("Biases must be one column with a row per node");
     }
-    return newMat;
+    this->nodeCount = weights.getHeight();
+    this->mappedWeights = weights;
+    this->mappedBiases = biases;
+    this->mappedPacked = packed;
+    this->sparseDensity = 0;
+    this->optimizerSteps = 0;
+    this->setActivation(activationF);
 }
 
-Layer::Layer(int nodeCount, int previousLayerNodes, ActivationFunction activationF) {
-    this->nodeCount = nodeCount;
-    this->weights = Matrix<double>(previousLayerNodes, nodeCount);
-    this->biases = Matrix<double>(1, nodeCount);
+template <typename T> void Layer<T>::setActivation(ActivationFunction activationF) {
     this->activationFunctionType = activationF;
     switch (activationF) {
     case SIGMOID:
-        this->activationFunction = sigmoid<double>;
-        this->activationDerivative = sigmoid_derivative<double>;
+        this->activationFunction = sigmoid<T>;
+        this->activationDerivative = sigmoid_derivative<T>;
         break;
     case RELU:
-        this->activationFunction = relu<double>;
-        this->activationDerivative = relu_derivative<double>;
+        this->activationFunction = relu<T>;
+        this->activationDerivative = relu_derivative<T>;
         break;
     case SOFTMAX:
-        this->activationFunction = softmax<double>;
+        this->activationFunction = softmax<T>;
         this->activationDerivative = nullptr;
         break;
 
@@ -84,7 +50,8 @@ Layer::Layer(int nodeCount, int previousLayerNodes, ActivationFunction activatio
     }
 }
 
-void Layer::initRandom() {
+template <typename T> void Layer<T>::initRandom() {
+    this->detach();
     std::random_device rand_dev;
     std::mt19937 generator(rand_dev());
     // Xavier initialization: sqrt(6 / (fan_in + fan_out))
@@ -108,7 +75,7 @@ void Layer::initRandom() {
     }
     for (size_t j = 0; j < this->weights.getHeight(); ++j) {
         for (size_t i = 0; i < this->weights.getWidth(); i++) {
-            this->weights.setValue(i, j, distr(generator));
+            this->weights.setValue(i, j, static_cast<T>(distr(generator)));
         }
     }
     for (size_t j = 0; j < this->biases.getHeight(); ++j) {
@@ -116,99 +83,289 @@ void Layer::initRandom() {
             this->biases.setValue(i, j, 0.0);
         }
     }
+    this->packWeights();
+    this->resetOptimizer();
 }
 
-int Layer::getNodeCount() {
+template <typename T> int Layer<T>::getNodeCount() const {
     return this->nodeCount;
 }
 
-void Layer::setDeltas(Matrix<double> d) {
-    this->deltas = d;
+template <typename T>
+typename Layer<T>::ActivationFunction Layer<T>::getActivationFunction() const {
+    return this->activationFunctionType;
+}
 
-    // Calculate db: average of deltas across batch
-    Matrix<double> avgDeltas(1, this->deltas.getHeight());
-    for (size_t j = 0; j < d.getHeight(); j++) {
-        double sum = 0;
-        for (size_t i = 0; i < d.getWidth(); i++) {
-            sum += d.getValue(i, j);
-        }
-        avgDeltas.setValue(0, j, sum / d.getWidth());
+template <typename T> void Layer<T>::setSparseInput(double maxDensity) {
+    this->sparseDensity = maxDensity;
+    if (maxDensity > 0) {
+        this->packWeights();
+    } else {
+        this->packedWeights = Matrix<T>();
+    }
+}
+
+// The packed copy follows every change to the weights, mapped ones come packed already
+template <typename T> void Layer<T>::packWeights() {
+    if (this->sparseDensity > 0 && !this->mappedPacked.data()) {
+        SparseInput<T>::pack(this->getWeights(), this->packedWeights);
     }
-    this->db = avgDeltas;
+}
 
-    // Calculate dW: (A^T * deltas) / batchSize
-    this->dW = d * this->previousLayerActivations.transpose();
-    // Average over batch
-    for (size_t i = 0; i < this->dW.getWidth(); i++) {
-        for (size_t j = 0; j < this->dW.getHeight(); j++) {
-            this->dW.setValue(i, j, this->dW.getValue(i, j) / d.getWidth());
+template <typename T> void Layer<T>::detach() {
+    if (this->mappedWeights.data()) {
+        this->weights = this->mappedWeights;
+        this->mappedWeights = MatrixView<const T>();
+    }
+    if (this->mappedBiases.data()) {
+        this->biases = this->mappedBiases;
+        this->mappedBiases = MatrixView<const T>();
+    }
+    if (this->mappedPacked.data()) {
+        this->mappedPacked = MatrixView<const T>();
+        this->packWeights();
+    }
+}
+
+template <typename T>
+void Layer<T>::computeGradients(Cache& cache, Gradients& gradients, bool accumulate) {
+    // db: sum of deltas across the batch
+    gradients.db.resize(1, cache.deltas.getHeight());
+    for (size_t j = 0; j < cache.deltas.getHeight(); j++) {
+        T sum = accumulate ? gradients.db.getValue(0, j) : 0;
+        for (size_t i = 0; i < cache.deltas.getWidth(); i++) {
+            sum += cache.deltas.getValue(i, j);
         }
+        gradients.db.setValue(0, j, sum);
+    }
+
+    // dW: deltas * A^T, summed over the batch
+    if (cache.sparseInput.isActive()) {
+        cache.sparseInput.multiplyTransposed(cache.deltas, gradients.dW, accumulate);
+    } else if (accumulate) {
+        gradients.dW.addProduct(cache.deltas, cache.input, false, true);
+    } else {
+        gradients.dW.assignProduct(cache.deltas, cache.input, false, true);
     }
 }
 
-void Layer::setWeights(Matrix<double> weights) {
-    this->weights = weights;
+template <typename T> void Layer<T>::averageGradients(int batchSize) {
+    this->gradients.dW /= batchSize;
+    this->gradients.db /= batchSize;
 }
-void Layer::setBiases(Matrix<double> biases) {
-    this->biases = biases;
+
+template <typename T> typename Layer<T>::Gradients& Layer<T>::getGradients() {
+    return this->gradients;
+}
+
+template <typename T> void Layer<T>::setDeltas(MatrixView<const T> d) {
+    this->setDeltas(d, this->cache, false);
+    this->averageGradients(d.getWidth());
 }
 
-Matrix<double> Layer::getWeights() {
-    return this->weights;
+template <typename T>
+void Layer<T>::setDeltas(MatrixView<const T> d, Cache& cache, bool accumulate) {
+    this->setDeltas(d, cache, this->gradients, accumulate);
 }
 
-Matrix<double> Layer::getBiases() {
-    return this->biases;
+template <typename T>
+void Layer<T>::setDeltas(MatrixView<const T> d, Cache& cache, Gradients& gradients,
+                         bool accumulate) {
+    cache.deltas = d;
+    this->computeGradients(cache, gradients, accumulate);
+}
+
+template <typename T> void Layer<T>::setWeights(Matrix<T> weights) {
+    this->weights = std::move(weights);
+    this->mappedWeights = MatrixView<const T>();
+    this->mappedPacked = MatrixView<const T>();
+    this->packWeights();
+    this->resetOptimizer();
+}
+template <typename T> void Layer<T>::setBiases(Matrix<T> biases) {
+    this->biases = std::move(biases);
+    this->mappedBiases = MatrixView<const T>();
+    this->resetOptimizer();
+}
+
+// Gives every per-batch buffer its final shape up front so training never grows them
+template <typename T> void Layer<T>::reserve(int batchSize) {
+    this->detach();
+    this->reserve(this->cache, batchSize);
+    this->reserve(this->gradients);
+}
+
+template <typename T> void Layer<T>::reserve(Cache& cache, int batchSize) const {
+    cache.activations.resize(batchSize, this->nodeCount);
+    cache.deltas.resize(batchSize, this->nodeCount);
+    if (this->sparseDensity > 0) {
+        cache.sparseInput.reserve(this->getWeights().getWidth(), batchSize, this->nodeCount,
+                                  this->sparseDensity);
+    }
 }
 
-Matrix<double> Layer::foward(Matrix<double>& input) {
-    this->previousLayerActivations = input;
-    this->preActivations = (this->weights * input);
-    for (size_t i = 0; i < this->preActivations.getWidth(); ++i) {
-        for (size_t j = 0; j < this->preActivations.getHeight(); ++j) {
-            this->preActivations.setValue(
-                i, j, this->preActivations.getValue(i, j) + this->biases.getValue(0, j));
+template <typename T> void Layer<T>::reserve(Gradients& gradients) const {
+    gradients.dW.resize(this->getWeights().getWidth(), this->nodeCount);
+    gradients.db.resize(1, this->nodeCount);
+}
+
+template <typename T> void Layer<T>::reserve(const Optimizer<T>& optimizer) {
+    for (int b = 0; b < optimizer.stateBuffers(); ++b) {
+        if (this->weightsState[b].getValuesVector().empty()) {
+            this->weightsState[b] = Matrix<T>(this->getWeights().getWidth(), this->nodeCount);
+            this->biasesState[b] = Matrix<T>(1, this->nodeCount);
         }
     }
+}
+
+template <typename T> MatrixView<const T> Layer<T>::getWeights() const {
+    return this->mappedWeights.data() ? this->mappedWeights : this->weights.view();
+}
+
+template <typename T> MatrixView<const T> Layer<T>::getBiases() const {
+    return this->mappedBiases.data() ? this->mappedBiases : this->biases.view();
+}
+
+template <typename T> MatrixView<const T> Layer<T>::getPackedWeights() const {
+    if (this->sparseDensity == 0) {
+        return MatrixView<const T>();
+    }
+    return this->mappedPacked.data() ? this->mappedPacked : this->packedWeights.view();
+}
+
+template <typename T> const Matrix<T>& Layer<T>::foward(MatrixView<const T> input) {
+    return this->foward(input, this->cache);
+}
+
+template <typename T>
+const Matrix<T>& Layer<T>::foward(MatrixView<const T> input, Cache& cache) const {
+    if (input.getHeight() != this->getWeights().getWidth()) {
+        throw std::invalid_argument("Layer input height must match the previous layer size");
+    }
+    cache.input = input;
+    // Start from the broadcast biases, let the GEMM accumulate on top of them and activate in place
+    cache.activations = MatrixBroadcastExpression<T>(this->getBiases(), input.getWidth());
+    if (cache.sparseInput.build(input, this->sparseDensity)) {
+        cache.sparseInput.multiply(this->getPackedWeights(), this->nodeCount, cache.activations,
+                                   true);
+    } else {
+        cache.activations.addProduct(this->getWeights(), input);
+    }
 
-    this->activations = this->activationFunction(this->preActivations);
-    return this->activations;
+    this->activationFunction(cache.activations, cache.activations);
+    return cache.activations;
 }
 
-Matrix<double> Layer::backwards(Matrix<double> nextLayerWeights, Matrix<double> nextLayerDeltas) {
-    Matrix<double> deltas(nextLayerDeltas.getWidth(), this->nodeCount);
+template <typename T>
+const Matrix<T>& Layer<T>::backwards(MatrixView<const T> nextLayerWeights,
+                                     MatrixView<const T> nextLayerDeltas) {
+    this->backwards(nextLayerWeights, nextLayerDeltas, this->cache, false);
+    this->averageGradients(nextLayerDeltas.getWidth());
+    return this->cache.deltas;
+}
 
+template <typename T>
+const Matrix<T>& Layer<T>::backwards(MatrixView<const T> nextLayerWeights,
+                                     MatrixView<const T> nextLayerDeltas, Cache& cache,
+                                     bool accumulate) {
+    return this->backwards(nextLayerWeights, nextLayerDeltas, cache, this->gradients, accumulate);
+}
+
+template <typename T>
+const Matrix<T>& Layer<T>::backwards(MatrixView<const T> nextLayerWeights,
+                                     MatrixView<const T> nextLayerDeltas, Cache& cache,
+                                     Gradients& gradients, bool accumulate) {
     if (this->activationFunctionType != SOFTMAX) {
-        deltas = (nextLayerWeights.transpose() * nextLayerDeltas);
-        deltas = deltas.hadamard(this->activationDerivative(this->preActivations));
+        cache.deltas.assignProduct(nextLayerWeights, nextLayerDeltas, true, false);
+        this->activationDerivative(cache.activations, cache.deltas);
     } else {
-        deltas = nextLayerDeltas;
+        cache.deltas = nextLayerDeltas;
     }
-    this->deltas = deltas;
+    this->computeGradients(cache, gradients, accumulate);
 
-    // Calculate db: average of deltas across batch
-    Matrix<double> avgDeltas(1, this->deltas.getHeight());
-    for (size_t j = 0; j < deltas.getHeight(); j++) {
-        double sum = 0;
-        for (size_t i = 0; i < deltas.getWidth(); i++) {
-            sum += deltas.getValue(i, j);
-        }
-        avgDeltas.setValue(0, j, sum / deltas.getWidth());
-    }
-    this->db = avgDeltas;
-    // Calculate dW: (A^T * deltas) / batchSize
-    this->dW = deltas * this->previousLayerActivations.transpose();
-    // Average over batch
-    for (size_t i = 0; i < this->dW.getWidth(); i++) {
-        for (size_t j = 0; j < this->dW.getHeight(); j++) {
-            this->dW.setValue(i, j, this->dW.getValue(i, j) / deltas.getWidth());
-        }
+    return cache.deltas;
+}
+
+template <typename T> double Layer<T>::squaredGradientNorm() const {
+    return squaredGradientNorm(this->gradients);
+}
+
+template <typename T> double Layer<T>::squaredGradientNorm(const Gradients& gradients) {
+    return squaredNorm(gradients.dW.data(), gradients.dW.getValuesVector().size()) +
+           squaredNorm(gradients.db.data(), gradients.db.getValuesVector().size());
+}
+
+template <typename T>
+void Layer<T>::update(const Optimizer<T>& optimizer, T learningRate, T gradientScale) {
+    this->update(this->gradients, optimizer, learningRate, gradientScale);
+}
+
+template <typename T>
+void Layer<T>::update(const Gradients& gradients, const Optimizer<T>& optimizer, T learningRate,
+                      T gradientScale) {
+    this->detach();
+    this->reserve(optimizer);
+    this->concurrentUpdate(gradients, optimizer, learningRate, gradientScale,
+                           ++this->optimizerSteps);
+    this->packWeights();
+}
+
+template <typename T>
+void Layer<T>::concurrentUpdate(const Gradients& gradients, const Optimizer<T>& optimizer,
+                                T learningRate, T gradientScale, long step) {
+    int buffers = optimizer.stateBuffers();
+    // Weights and biases go through the optimizer together, one pass over both
+    const typename Optimizer<T>::Tensor tensors[] = {
+        {this->weights.data(), gradients.dW.data(),
+         buffers > 0 ? this->weightsState[0].data() : nullptr,
+         buffers > 1 ? this->weightsState[1].data() : nullptr,
+         this->weights.getValuesVector().size()},
+        {this->biases.data(), gradients.db.data(),
+         buffers > 0 ? this->biasesState[0].data() : nullptr,
+         buffers > 1 ? this->biasesState[1].data() : nullptr,
+         this->biases.getValuesVector().size()},
+    };
+    optimizer.update(tensors, learningRate, gradientScale, step);
+}
+
+template <typename T> void Layer<T>::finishConcurrentUpdates(long steps) {
+    this->optimizerSteps = steps;
+    this->packWeights();
+}
+
+template <typename T> long Layer<T>::getOptimizerSteps() const {
+    return this->optimizerSteps;
+}
+
+template <typename T> void Layer<T>::resetOptimizer() {
+    for (int b = 0; b < 2; ++b) {
+        this->weightsState[b] = Matrix<T>();
+        this->biasesState[b] = Matrix<T>();
+    }
+    this->optimizerSteps = 0;
+}
+
+template <typename T> void Layer<T>::copyOptimizerState(OptimizerState& state) const {
+    for (int b = 0; b < 2; ++b) {
+        state.weights[b] = this->weightsState[b];
+        state.biases[b] = this->biasesState[b];
     }
+    state.steps = this->optimizerSteps;
+}
 
-    return deltas;
+template <typename T> void Layer<T>::setOptimizerState(const OptimizerState& state) {
+    for (int b = 0; b < 2; ++b) {
+        bool empty = state.weights[b].getValuesVector().empty();
+        if (!empty && (state.weights[b].getWidth() != this->getWeights().getWidth() ||
+                       state.weights[b].getHeight() != this->nodeCount ||
+                       state.biases[b].getHeight() != this->nodeCount)) {
+            throw std::invalid_argument("Optimizer state doesn't match the layer size");
+        }
+        this->weightsState[b] = state.weights[b];
+        this->biasesState[b] = state.biases[b];
+    }
+    this->optimizerSteps = state.steps;
 }
 
-void Layer::update(double learning_rate) {
-    this->weights = this->weights - (this->dW * learning_rate);
-    this->biases = this->biases - (this->db * learning_rate);
-}
\ No newline at end of file
+template class Layer<float>;
+template class Layer<double>;
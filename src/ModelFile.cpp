@@ -0,0 +1,173 @@
+#include "../include/ModelFile.hpp"
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static constexpr char MODEL_MAGIC[8] = "NNMODEL";
+static constexpr uint32_t MODEL_VERSION = 1;
+static constexpr size_t MODEL_ALIGNMENT = 64;
+static_assert(sizeof(ModelFile::Header) == MODEL_ALIGNMENT, "The table starts one block in");
+static_assert(sizeof(ModelFile::Section) == 48, "Table entries are read in place");
+
+static size_t align_up(size_t offset) {
+    return (offset + MODEL_ALIGNMENT - 1) / MODEL_ALIGNMENT * MODEL_ALIGNMENT;
+}
+
+// FNV-1a over 8-byte words, quick enough to check a model as it is read
+static uint64_t checksum(const unsigned char* bytes, size_t count) {
+    constexpr uint64_t PRIME = 0x100000001b3;
+    uint64_t hash = 0xcbf29ce484222325;
+    size_t words = count / sizeof(uint64_t);
+    for (size_t i = 0; i < words; ++i) {
+        uint64_t word;
+        std::memcpy(&word, bytes + (i * sizeof(uint64_t)), sizeof(word));
+        hash = (hash ^ word) * PRIME;
+    }
+    for (size_t i = words * sizeof(uint64_t); i < count; ++i) {
+        hash = (hash ^ bytes[i]) * PRIME;
+    }
+    return hash;
+}
+
+ModelFile::ModelFile() : mapped(nullptr), mappedBytes(0), header(nullptr), sections(nullptr) {}
+
+ModelFile::~ModelFile() {
+    this->close();
+}
+
+void ModelFile::close() {
+    if (this->mapped) {
+        munmap(const_cast<unsigned char*>(this->mapped), this->mappedBytes);
+    }
+    this->mapped = nullptr;
+    this->mappedBytes = 0;
+    this->header = nullptr;
+    this->sections = nullptr;
+}
+
+bool ModelFile::recognizes(std::string path) {
+    std::ifstream file(path, std::ios::binary);
+    char magic[sizeof(MODEL_MAGIC)];
+    return file.read(magic, sizeof(magic)) &&
+           std::memcmp(magic, MODEL_MAGIC, sizeof(MODEL_MAGIC)) == 0;
+}
+
+bool ModelFile::write(std::string path, uint32_t scalarBytes, const std::vector<Blob>& blobs) {
+    Header header = {};
+    std::memcpy(header.magic, MODEL_MAGIC, sizeof(MODEL_MAGIC));
+    header.version = MODEL_VERSION;
+    header.scalarBytes = scalarBytes;
+    header.sectionCount = blobs.size();
+    std::vector<Section> table(blobs.size());
+    size_t offset = align_up(sizeof(Header) + (table.size() * sizeof(Section)));
+    for (size_t i = 0; i < blobs.size(); ++i) {
+        const Blob& blob = blobs[i];
+        table[i] = {blob.kind, blob.layer, blob.width, blob.height, offset, blob.bytes,
+                    checksum(static_cast<const unsigned char*>(blob.data), blob.bytes), 0};
+        offset = align_up(offset + blob.bytes);
+    }
+    header.fileBytes = offset;
+    header.tableChecksum = checksum(reinterpret_cast<const unsigned char*>(table.data()),
+                                    table.size() * sizeof(Section));
+
+    std::string partial = path + ".tmp";
+    std::ofstream file(partial, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Couldnt create file " << partial << std::endl;
+        return false;
+    }
+    static const char zeros[MODEL_ALIGNMENT] = {};
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(Section));
+    size_t written = sizeof(Header) + (table.size() * sizeof(Section));
+    for (size_t i = 0; i < blobs.size(); ++i) {
+        file.write(zeros, table[i].offset - written);
+        file.write(static_cast<const char*>(blobs[i].data), blobs[i].bytes);
+        written = table[i].offset + blobs[i].bytes;
+    }
+    file.write(zeros, header.fileBytes - written);
+    file.close();
+    if (!file) {
+        std::cerr << "Couldnt write model " << partial << std::endl;
+        return false;
+    }
+    std::error_code error;
+    std::filesystem::rename(partial, path, error);
+    if (error) {
+        std::cerr << "Couldnt replace model " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool ModelFile::open(std::string path) {
+    this->close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        std::cerr << "Couldnt open file " << path << std::endl;
+        return false;
+    }
+    size_t bytes = info.st_size;
+    void* mapping = bytes >= sizeof(Header)
+                        ? mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0)
+                        : MAP_FAILED;
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Couldnt map model " << path << std::endl;
+        return false;
+    }
+    this->mapped = static_cast<const unsigned char*>(mapping);
+    this->mappedBytes = bytes;
+    this->header = reinterpret_cast<const Header*>(this->mapped);
+    this->sections = reinterpret_cast<const Section*>(this->mapped + sizeof(Header));
+
+    const Header& header = *this->header;
+    size_t tableBytes = static_cast<size_t>(header.sectionCount) * sizeof(Section);
+    bool valid = std::memcmp(header.magic, MODEL_MAGIC, sizeof(MODEL_MAGIC)) == 0 &&
+                 header.version == MODEL_VERSION && header.fileBytes == bytes &&
+                 (header.scalarBytes == sizeof(float) || header.scalarBytes == sizeof(double)) &&
+                 sizeof(Header) + tableBytes <= bytes &&
+                 checksum(reinterpret_cast<const unsigned char*>(this->sections), tableBytes) ==
+                     header.tableChecksum;
+    for (uint32_t i = 0; valid && i < header.sectionCount; ++i) {
+        const Section& section = this->sections[i];
+        valid = section.offset % MODEL_ALIGNMENT == 0 && section.offset <= bytes &&
+                section.bytes <= bytes - section.offset;
+    }
+    if (!valid) {
+        this->close();
+        std::cerr << "Model " << path << " is damaged or from another version" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+uint32_t ModelFile::getScalarBytes() const {
+    return this->header->scalarBytes;
+}
+
+const ModelFile::Section* ModelFile::find(SectionKind kind, uint32_t layer) const {
+    for (uint32_t i = 0; i < this->header->sectionCount; ++i) {
+        if (this->sections[i].kind == kind && this->sections[i].layer == layer) {
+            return &this->sections[i];
+        }
+    }
+    return nullptr;
+}
+
+const void* ModelFile::data(const Section& section) const {
+    return this->mapped + section.offset;
+}
+
+bool ModelFile::intact(const Section& section) const {
+    return checksum(this->mapped + section.offset, section.bytes) == section.checksum;
+}
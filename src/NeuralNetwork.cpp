@@ -1,238 +1,873 @@
 #include "../include/NeuralNetwork.hpp"
+#include "../include/DataParallel.hpp"
+#include "../include/Pipeline.hpp"
+#include "../include/RingAllreduce.hpp"
+#include <algorithm>
 #include <cmath>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <numeric>
 #include <random>
 
-std::vector<NeuralNetwork::Sample> create_sample_vector(std::vector<std::vector<double>> input,
-                                                        std::vector<std::vector<double>> output) {
-    std::vector<NeuralNetwork::Sample> result;
-    for (size_t i = 0; i < input.size(); i++) {
-        Matrix<double> newInputMat(1, input[i].size());
-        for (size_t j = 0; j < input[i].size(); j++) {
-            newInputMat.setValue(0, j, input[i][j]);
-        }
-        Matrix<double> newOutputMat(1, output[i].size(), 0.0);
-        for (size_t j = 0; j < output[i].size(); j++) {
-            newOutputMat.setValue(0, j, output[i][j]);
-        }
-        result.push_back({newInputMat, newOutputMat});
+// Raw inputs such as digit images are mostly zeros, below this density the first layer skips them
+static constexpr double SPARSE_INPUT_DENSITY = 0.3;
+// Samples evaluated per pass, far more than training batches since no gradients are kept
+static constexpr int EVALUATION_BATCH = 1024;
+// Batches at least this big have their metrics reduced on several threads
+static constexpr int PARALLEL_EVALUATION = 256;
+// Outputs are clamped to this before taking logs, a confident miss costs a lot but not infinity
+static constexpr double MIN_PROBABILITY = 1e-12;
+
+// Older .bin files always hold doubles, other precisions are converted on the way in
+template <typename T> Matrix<T> read_matrix(std::ifstream& file, int w, int h) {
+    Matrix<double> mat(w, h);
+    file.read(reinterpret_cast<char*>(mat.data()), (w * h) * sizeof(double));
+    if constexpr (std::is_same_v<T, double>) {
+        return mat;
+    } else {
+        return mat.template cast<T>();
     }
-    return result;
 }
 
-NeuralNetwork::NeuralNetwork() {
+template <typename T> NeuralNetwork<T>::NeuralNetwork() {
     this->layersConfig = {};
     this->layers = {};
+    this->pipelineStages = 1;
+    this->pipelineMicroBatches = 1;
+    this->dataParallelWorkers = 1;
+    this->hogwild = false;
+    this->loaderThreads = 1;
+    this->prefetchBatches = 2;
+    this->validationInterval = 0;
+    this->validationPatience = 0;
+    this->checkpointInterval = 0;
+    this->optimizer = std::make_shared<SGD<T>>();
 }
 
-NeuralNetwork::NeuralNetwork(std::vector<int> layersConfig) {
+template <typename T> NeuralNetwork<T>::NeuralNetwork(std::vector<int> layersConfig) {
     this->layersConfig = layersConfig;
+    this->pipelineStages = 1;
+    this->pipelineMicroBatches = 1;
+    this->dataParallelWorkers = 1;
+    this->hogwild = false;
+    this->loaderThreads = 1;
+    this->prefetchBatches = 2;
+    this->validationInterval = 0;
+    this->validationPatience = 0;
+    this->checkpointInterval = 0;
+    this->optimizer = std::make_shared<SGD<T>>();
     for (size_t i = 1; i < layersConfig.size() - 1;
          ++i) { // Creates the layers ignoring the first one since it doesnt need weights or biases
-        Layer newLayer(layersConfig[i], layersConfig[i - 1], Layer::RELU);
-        this->layers.push_back(newLayer);
+        this->layers.emplace_back(layersConfig[i], layersConfig[i - 1], Layer<T>::RELU);
+    }
+    this->layers.emplace_back(layersConfig[layersConfig.size() - 1],
+                              layersConfig[layersConfig.size() - 2], Layer<T>::SOFTMAX);
+    this->layers[0].setSparseInput(SPARSE_INPUT_DENSITY);
+}
+
+// Bytes of a width x height tensor of scalar-byte values, false when the product overflows, as it
+// can for sizes read from a damaged file
+static bool tensor_bytes(uint64_t width, uint64_t height, uint64_t scalar, uint64_t& bytes) {
+    return !__builtin_mul_overflow(width, height, &bytes) &&
+           !__builtin_mul_overflow(bytes, scalar, &bytes);
+}
+
+// Tensors of a model file saved in the other precision are converted as they are copied in
+template <typename T>
+Matrix<T> copy_tensor(const ModelFile& model, const ModelFile::Section& section) {
+    Matrix<T> mat(section.width, section.height);
+    if (model.getScalarBytes() == sizeof(float)) {
+        std::copy_n(static_cast<const float*>(model.data(section)), mat.getValuesVector().size(),
+                    mat.data());
+    } else {
+        std::copy_n(static_cast<const double*>(model.data(section)), mat.getValuesVector().size(),
+                    mat.data());
     }
-    Layer lastLayer(layersConfig[layersConfig.size() - 1], layersConfig[layersConfig.size() - 2],
-                    Layer::SOFTMAX);
-    this->layers.push_back(lastLayer);
+    return mat;
 }
 
-void NeuralNetwork::setLayersConfig(std::vector<int> layersConfig) {
+template <typename T> void NeuralNetwork<T>::setLayersConfig(std::vector<int> layersConfig) {
+    this->modelFile.reset();
     this->layers.clear();
     this->layersConfig = layersConfig;
     for (size_t i = 1; i < layersConfig.size() - 1;
          ++i) { // Creates the layers ignoring the first one since it doesnt need weights or biases
-        Layer newLayer(layersConfig[i], layersConfig[i - 1], Layer::RELU);
-        this->layers.push_back(newLayer);
+        this->layers.emplace_back(layersConfig[i], layersConfig[i - 1], Layer<T>::RELU);
+    }
+    this->layers.emplace_back(layersConfig[layersConfig.size() - 1],
+                              layersConfig[layersConfig.size() - 2], Layer<T>::SOFTMAX);
+    this->layers[0].setSparseInput(SPARSE_INPUT_DENSITY);
+}
+
+template <typename T> void NeuralNetwork<T>::setPipeline(int stages, int microBatches) {
+    if (stages < 1 || microBatches < 1) {
+        throw std::invalid_argument("Pipeline needs at least one stage and one micro-batch");
     }
-    Layer lastLayer(layersConfig[layersConfig.size() - 1], layersConfig[layersConfig.size() - 2],
-                    Layer::SOFTMAX);
-    this->layers.push_back(lastLayer);
+    this->pipelineStages = stages;
+    this->pipelineMicroBatches = microBatches;
+}
+
+template <typename T> void NeuralNetwork<T>::setDataParallel(int workers, bool hogwild) {
+    if (workers < 1) {
+        throw std::invalid_argument("Data-parallel training needs at least one worker");
+    }
+    this->dataParallelWorkers = workers;
+    this->hogwild = hogwild;
+}
+
+template <typename T> void NeuralNetwork<T>::setDistributed(std::shared_ptr<Transport> transport) {
+    this->transport = std::move(transport);
 }
 
-void NeuralNetwork::setLayerWeights(size_t layerIt, Matrix<double> weights) {
-    this->layers[layerIt].setWeights(weights);
+template <typename T>
+void NeuralNetwork<T>::setDataLoader(int threads, int prefetch,
+                                     typename BatchLoader<T>::Transform transform) {
+    if (threads < 1 || prefetch < 1) {
+        throw std::invalid_argument("Batch loading needs at least one thread and one batch ahead");
+    }
+    this->loaderThreads = threads;
+    this->prefetchBatches = prefetch;
+    this->batchTransform = std::move(transform);
 }
 
-void NeuralNetwork::setLayerBiases(size_t layerIt, Matrix<double> biases) {
-    this->layers[layerIt].setBiases(biases);
+template <typename T> void NeuralNetwork<T>::setValidation(int interval, int patience) {
+    if (interval < 0 || patience < 0) {
+        throw std::invalid_argument("Validation interval and patience can't be negative");
+    }
+    this->validationInterval = interval;
+    this->validationPatience = patience;
 }
 
-void NeuralNetwork::randomize() {
+template <typename T>
+void NeuralNetwork<T>::setOptimizer(std::shared_ptr<const Optimizer<T>> optimizer) {
+    if (!optimizer) {
+        throw std::invalid_argument("Optimizer can't be null");
+    }
+    this->optimizer = std::move(optimizer);
+    for (size_t i = 0; i < this->layers.size(); i++) {
+        this->layers[i].resetOptimizer();
+    }
+}
+
+template <typename T> void NeuralNetwork<T>::setCheckpoints(std::string path, int interval) {
+    if (interval < 0 || (interval > 0 && path.empty())) {
+        throw std::invalid_argument("Checkpoints need a path and an interval of 0 or more");
+    }
+    this->checkpointPath = std::move(path);
+    this->checkpointInterval = interval;
+}
+
+template <typename T> bool NeuralNetwork<T>::resume(std::string path) {
+    auto checkpoint = std::make_shared<Checkpoint<T>>();
+    if (!checkpoint->load(path)) {
+        return false;
+    }
+    if (this->layersConfig.empty()) {
+        this->setLayersConfig(checkpoint->layersConfig);
+    } else if (checkpoint->layersConfig != this->layersConfig) {
+        std::cerr << "Checkpoint " << path << " was taken with other layers" << std::endl;
+        return false;
+    }
+    // Setting the parameters drops the optimizer state, so it goes in last
+    for (size_t i = 0; i < this->layers.size(); ++i) {
+        this->setLayerWeights(i, checkpoint->weights[i]);
+        this->setLayerBiases(i, checkpoint->biases[i]);
+        this->layers[i].setOptimizerState(checkpoint->optimizerStates[i]);
+    }
+    this->resumeState = std::move(checkpoint);
+    return true;
+}
+
+template <typename T> void NeuralNetwork<T>::capture(Checkpoint<T>& checkpoint) const {
+    checkpoint.layersConfig = this->layersConfig;
+    checkpoint.weights.resize(this->layers.size());
+    checkpoint.biases.resize(this->layers.size());
+    checkpoint.optimizerStates.resize(this->layers.size());
+    for (size_t i = 0; i < this->layers.size(); ++i) {
+        checkpoint.weights[i] = this->layers[i].getWeights();
+        checkpoint.biases[i] = this->layers[i].getBiases();
+        this->layers[i].copyOptimizerState(checkpoint.optimizerStates[i]);
+    }
+}
+
+template <typename T> void NeuralNetwork<T>::setLayerWeights(size_t layerIt, Matrix<T> weights) {
+    this->layers[layerIt].setWeights(std::move(weights));
+}
+
+template <typename T> void NeuralNetwork<T>::setLayerBiases(size_t layerIt, Matrix<T> biases) {
+    this->layers[layerIt].setBiases(std::move(biases));
+}
+
+template <typename T> void NeuralNetwork<T>::reserveWorkspace(int batchSize) {
+    for (size_t i = 0; i < this->layers.size(); i++) {
+        this->layers[i].reserve(batchSize);
+    }
+    this->output.resize(batchSize, this->layersConfig[this->layersConfig.size() - 1]);
+}
+
+template <typename T> void NeuralNetwork<T>::randomize() {
     for (size_t i = 0; i < this->layers.size(); i++) {
         this->layers[i].initRandom();
     }
 }
 
-Matrix<double> NeuralNetwork::foward(Matrix<double> input) {
+template <typename T> const Matrix<T>& NeuralNetwork<T>::foward(MatrixView<const T> input) {
+    MatrixView<const T> current = input;
+    for (size_t i = 0; i < this->layers.size(); i++) {
+        current = this->layers[i].foward(current);
+    }
+    this->output = current;
+    return this->output;
+}
+
+template <typename T>
+typename NeuralNetwork<T>::Scratch NeuralNetwork<T>::makeScratch(int batchSize) const {
+    if (batchSize < 1) {
+        throw std::invalid_argument("Scratch needs room for at least one sample");
+    }
+    Scratch scratch;
+    scratch.caches.resize(this->layers.size());
     for (size_t i = 0; i < this->layers.size(); i++) {
-        input = this->layers[i].foward(input);
+        scratch.caches[i].activations.resize(batchSize, this->layers[i].getNodeCount());
     }
-    this->output = input;
-    return input;
+    return scratch;
 }
 
-void NeuralNetwork::backwards(Matrix<double> target) {
-    Matrix<double> firstStepDeltas = (output - target);
+template <typename T>
+const Matrix<T>& NeuralNetwork<T>::infer(MatrixView<const T> input, Scratch& scratch) const {
+    if (this->layers.empty()) {
+        throw std::invalid_argument("Network has no layers to run");
+    }
+    if (scratch.caches.size() != this->layers.size()) {
+        scratch.caches.resize(this->layers.size());
+    }
+    MatrixView<const T> current = input;
+    for (size_t i = 0; i < this->layers.size(); i++) {
+        current = this->layers[i].foward(current, scratch.caches[i]);
+    }
+    return scratch.caches.back().activations;
+}
+
+template <typename T> const std::vector<Layer<T>>& NeuralNetwork<T>::getLayers() const {
+    return this->layers;
+}
+
+template <typename T> void NeuralNetwork<T>::backwards(MatrixView<const T> target) {
+    // The cached output is turned into the output layer deltas in place
+    this->output -= target;
     this->layers[this->layers.size() - 1].setDeltas(
-        firstStepDeltas); // Set the deltas of the output layer as the cost function
-    Matrix<double> backwardsResultDeltas = firstStepDeltas;
+        this->output); // Set the deltas of the output layer as the cost function
+    const Matrix<T>* backwardsResultDeltas = &this->output;
     for (int i = this->layers.size() - 2; i >= 0; --i) {
         backwardsResultDeltas =
-            this->layers[i].backwards(this->layers[i + 1].getWeights(), backwardsResultDeltas);
+            &this->layers[i].backwards(this->layers[i + 1].getWeights(), *backwardsResultDeltas);
     }
 }
 
-void NeuralNetwork::update(double learningRate) {
+template <typename T> void NeuralNetwork<T>::update(double learningRate) {
+    // Clipping looks at the norm of the whole gradient, every layer gets the same scale
+    double scale = 1;
+    if (this->optimizer->getMaxGradientNorm() > 0) {
+        double squaredNorm = 0;
+        for (size_t i = 0; i < this->layers.size(); i++) {
+            squaredNorm += this->layers[i].squaredGradientNorm();
+        }
+        scale = this->optimizer->clipScale(squaredNorm);
+    }
     for (size_t i = 0; i < this->layers.size(); i++) {
-        this->layers[i].update(learningRate);
+        this->layers[i].update(*this->optimizer, learningRate, scale);
     }
 }
 
-NeuralNetwork::TrainResponse NeuralNetwork::train(std::vector<std::vector<double>> inputs,
-                                                  std::vector<std::vector<double>> outputs,
-                                                  float trainingUseRatio, int epochs, int batchSize,
-                                                  double learningRate, double learningRateUpdate) {
-    if (inputs[0].size() != this->layersConfig[0]) {
+template <typename T>
+typename NeuralNetwork<T>::TrainingRun
+NeuralNetwork<T>::beginTraining(int featureCount, int targetCount, size_t sampleCount,
+                                size_t orderSize) {
+    if (featureCount != this->layersConfig[0]) {
         throw std::invalid_argument("Input sample size doesn't match the input layer size");
     }
-    if (outputs[0].size() != this->layersConfig[this->layersConfig.size() - 1]) {
+    if (targetCount != this->layersConfig[this->layersConfig.size() - 1]) {
         throw std::invalid_argument("Output sample size doesn't match the output layer size");
     }
-    if (inputs.size() != outputs.size()) {
-        throw std::invalid_argument("Input and output vector sizes must match");
+    if (this->pipelineStages > 1 && this->dataParallelWorkers > 1) {
+        throw std::invalid_argument("Pipeline and data-parallel training can't be combined");
+    }
+    if (this->transport && this->dataParallelWorkers > 1 && this->hogwild) {
+        throw std::invalid_argument("Hogwild workers can't be combined with distributed training");
+    }
+    TrainingRun run;
+    run.rank = 0;
+    run.worldSize = 1;
+    if (this->transport) {
+        run.allreduce = std::make_unique<RingAllreduce<T>>(this->transport, this->layers);
+        run.rank = run.allreduce->getRank();
+        run.worldSize = run.allreduce->getWorldSize();
+    }
+    run.resumed = std::move(this->resumeState);
+    if (run.allreduce) {
+        bool resuming = static_cast<bool>(run.resumed);
+        run.allreduce->broadcast(&resuming, sizeof(resuming));
+        if (resuming != static_cast<bool>(run.resumed)) {
+            throw std::invalid_argument("Either every rank resumes or none does");
+        }
+    }
+    if (run.resumed) {
+        // The shuffle state is the one the checkpointed epoch began with
+        if (run.resumed->order.size() != orderSize) {
+            throw std::invalid_argument("Checkpoint was taken training on other samples");
+        }
+        for (int index : run.resumed->order) {
+            if (index < 0 || static_cast<size_t>(index) >= orderSize) {
+                throw std::invalid_argument("Checkpoint order is out of range");
+            }
+        }
+        run.generator = run.resumed->generator;
+        run.order = run.resumed->order;
+    } else {
+        // Every rank shuffles with rank 0's seed, so they agree on the split and the batch order
+        std::random_device rand_dev;
+        unsigned int seed = rand_dev();
+        if (run.allreduce) {
+            run.allreduce->broadcast(&seed, sizeof(seed));
+        }
+        run.generator.seed(seed);
+        run.order.resize(orderSize);
+        std::iota(run.order.begin(), run.order.end(), 0);
     }
-    std::random_device rand_dev;
-    std::mt19937 generator(rand_dev());
 
-    std::vector<NeuralNetwork::Sample> samples = create_sample_vector(inputs, outputs);
-    int split_index = inputs.size() * trainingUseRatio;
+    if (run.allreduce) {
+        size_t first_count = sampleCount;
+        run.allreduce->broadcast(&first_count, sizeof(first_count));
+        if (first_count != sampleCount) {
+            throw std::invalid_argument("Every rank must train on the same samples");
+        }
+    }
+    return run;
+}
 
-    std::shuffle(samples.begin(), samples.end(), generator);
-    std::vector<Sample> training_data(samples.begin(), samples.begin() + split_index);
-    std::vector<Sample> testing_data(samples.begin() + split_index, samples.end());
-    samples.clear();
+template <typename T>
+void NeuralNetwork<T>::trainEpochs(TrainingRun& run, BatchLoader<T>& loader,
+                                   const std::function<int(int firstStep)>& beginEpoch,
+                                   const std::function<Evaluation()>& validate, int epochs,
+                                   int batchSize, double learningRate, double learningRateUpdate,
+                                   TrainResponse& response) {
+    // Resumed ranks all loaded the same checkpoint, and broadcasting would drop its optimizer state
+    if (!run.resumed) {
+        this->randomize();
+        if (run.allreduce) {
+            run.allreduce->broadcastParameters(this->layers);
+        }
+    }
+
+    // Every per-batch buffer is sized here once and reused by every step
+    this->reserveWorkspace(batchSize);
+    std::unique_ptr<Pipeline<T>> pipeline;
+    if (this->pipelineStages > 1) {
+        pipeline = std::make_unique<Pipeline<T>>(this->layers, this->pipelineStages,
+                                                 this->pipelineMicroBatches, batchSize);
+    }
+    std::unique_ptr<DataParallel<T>> dataParallel;
+    if (this->dataParallelWorkers > 1) {
+        dataParallel = std::make_unique<DataParallel<T>>(
+            this->layers, this->dataParallelWorkers, batchSize,
+            this->hogwild ? this->optimizer.get() : nullptr);
+    }
+    size_t warmAllocations = 0;
+    bool warm = false;
+    double bestCrossEntropy = INFINITY;
+    int staleValidations = 0;
+    int first_epoch = 0, first_step = 0;
+    if (run.resumed) {
+        first_epoch = run.resumed->epoch;
+        first_step = run.resumed->step;
+        bestCrossEntropy = run.resumed->bestCrossEntropy;
+        staleValidations = run.resumed->staleValidations;
+        for (int e = 1; e < first_epoch; ++e) {
+            if (e % 10 != 0) {
+                learningRate *= learningRateUpdate;
+            }
+        }
+    }
+    response.epochsTrained = std::min(first_epoch, epochs);
 
-    this->randomize();
+    std::unique_ptr<CheckpointWriter<T>> checkpoints;
+    if (this->checkpointInterval > 0 && run.rank == 0) {
+        checkpoints = std::make_unique<CheckpointWriter<T>>(this->checkpointPath);
+    }
+    std::mt19937 epoch_generator; // shuffle state as the current epoch began
+    std::vector<int> epoch_order;
+    long trained_steps = 0;
+    bool first_validation = true;
+    bool first_checkpoint = true;
+    auto checkpoint = [&](int epoch, int step, const std::mt19937& generator,
+                          const std::vector<int>& order) {
+        // The snapshot's buffers are sized by the first one, which counts as warming up
+        size_t coldAllocations = Arena::systemBlocks();
+        bool queued = checkpoints->write([&](Checkpoint<T>& snapshot) {
+            this->capture(snapshot);
+            snapshot.epoch = epoch;
+            snapshot.step = step;
+            snapshot.generator = generator;
+            snapshot.order = order;
+            snapshot.bestCrossEntropy = bestCrossEntropy;
+            snapshot.staleValidations = staleValidations;
+        });
+        if (queued && first_checkpoint) {
+            warmAllocations += Arena::systemBlocks() - coldAllocations;
+            first_checkpoint = false;
+        }
+    };
 
-    for (size_t epochs_it = 0; epochs_it < epochs; ++epochs_it) {
+    for (int epochs_it = first_epoch; epochs_it < epochs; ++epochs_it) {
         std::cout << "Epoch " << epochs_it + 1 << std::endl;
         if (epochs_it % 10 != 0 && epochs_it != 0) {
             learningRate *= learningRateUpdate;
         }
-        std::shuffle(training_data.begin(), training_data.end(), generator);
-        Matrix<double> batch_input(batchSize, training_data[0].input.getHeight());
-        Matrix<double> batch_output(batchSize, training_data[0].output.getHeight());
-        for (size_t training_vector_it = 0; (training_vector_it + batchSize) < training_data.size();
-             training_vector_it += batchSize) {
-            for (size_t batch_it = 0; batch_it < batchSize; ++batch_it) {
-                for (size_t input_sample_it = 0; // Copies the input batch into a matrix of
-                                                 // batchSize cols and input height rows
-                     input_sample_it <
-                     training_data[training_vector_it + batch_it].input.getHeight();
-                     ++input_sample_it) {
-                    batch_input.setValue(
-                        batch_it, input_sample_it,
-                        training_data[training_vector_it + batch_it].input.getValue(
-                            0, input_sample_it));
-                }
-                for (size_t output_sample_it = 0; // Copies the output batch into a matrix of
-                                                  // batchSize cols and output height rows
-                     output_sample_it <
-                     training_data[training_vector_it + batch_it].output.getHeight();
-                     ++output_sample_it) {
-                    batch_output.setValue(
-                        batch_it, output_sample_it,
-                        training_data[training_vector_it + batch_it].output.getValue(
-                            0, output_sample_it));
+        if (checkpoints) {
+            epoch_generator = run.generator;
+            epoch_order = run.order;
+        }
+        int steps = beginEpoch(epochs_it == first_epoch ? first_step : 0);
+        bool epoch_checkpoint = false;
+        for (int step = epochs_it == first_epoch ? first_step : 0; step < steps; ++step) {
+            typename BatchLoader<T>::Batch batch = loader.next();
+            if (pipeline) {
+                pipeline->step(batch.input, batch.target);
+            } else if (dataParallel) {
+                dataParallel->step(batch.input, batch.target, learningRate);
+            } else {
+                this->foward(batch.input);
+                this->backwards(batch.target);
+            }
+            if (run.allreduce) {
+                run.allreduce->averageGradients(this->layers);
+            }
+            if (!dataParallel || !dataParallel->isHogwild()) {
+                this->update(learningRate);
+            }
+            if (!warm) { // Everything after the first step counts as steady state
+                warmAllocations = Arena::systemBlocks();
+                warm = true;
+            }
+            if (checkpoints && ++trained_steps % this->checkpointInterval == 0) {
+                // One after an epoch's last step waits for its validation and starts the next
+                if (step + 1 < steps) {
+                    checkpoint(epochs_it, step + 1, epoch_generator, epoch_order);
+                } else {
+                    epoch_checkpoint = true;
                 }
             }
-            this->foward(batch_input);
-            this->backwards(batch_output);
-            this->update(learningRate);
-        }
-    }
-    double cost = 0, maxCost = -MAXFLOAT, minCost = MAXFLOAT;
-    int tsamples = 0;
-    int hits = 0;
-    for (size_t test_vector_it = 0; test_vector_it < testing_data.size(); ++test_vector_it) {
-        Matrix<double> output = this->foward(testing_data[test_vector_it].input);
-        double auxCost = 0;
-        int posMax = 0;
-        double maxVal = 0;
-        for (int j = 0; j < output.getHeight(); ++j) {
-            auxCost +=
-                pow(testing_data[test_vector_it].output.getValue(0, j) - output.getValue(0, j), 2);
-            if (auxCost > maxCost) {
-                maxCost = auxCost;
+        }
+        response.epochsTrained = epochs_it + 1;
+        int interval = this->validationInterval;
+        if (interval > 0 && response.epochsTrained % interval == 0) {
+            // The first evaluation sizes its buffers, which counts as warming up like step one
+            size_t coldAllocations = Arena::systemBlocks();
+            Evaluation validation = validate();
+            if (first_validation) {
+                warmAllocations += Arena::systemBlocks() - coldAllocations;
+                first_validation = false;
+            }
+            std::cout << "Validation accuracy " << validation.accuracy << "%, cross-entropy "
+                      << validation.crossEntropy << std::endl;
+            bool stop = false;
+            if (validation.crossEntropy < bestCrossEntropy) {
+                bestCrossEntropy = validation.crossEntropy;
+                staleValidations = 0;
+            } else {
+                stop = this->validationPatience > 0 &&
+                       ++staleValidations >= this->validationPatience;
             }
-            if (auxCost < minCost) {
-                minCost = auxCost;
+            // Ranks hold the same weights and samples, rank 0 decides so rounding can't split them
+            if (run.allreduce) {
+                run.allreduce->broadcast(&stop, sizeof(stop));
             }
-            if (output.getValue(0, j) > maxVal) {
-                maxVal = output.getValue(0, j);
-                posMax = j;
+            if (stop) {
+                std::cout << "Stopping early, no improvement in " << staleValidations
+                          << " validations" << std::endl;
+                break;
             }
         }
-        if (testing_data[test_vector_it].output.getValue(0, posMax) == 1) {
-            hits++;
+        if (epoch_checkpoint) {
+            checkpoint(epochs_it + 1, 0, run.generator, run.order);
         }
-        cost += (auxCost / output.getHeight());
-        tsamples++;
     }
-    return NeuralNetwork::TrainResponse((cost / tsamples), maxCost, minCost,
-                                        ((double)hits / tsamples) * 100);
+    response.steadyStateSystemBlocks = warm ? Arena::systemBlocks() - warmAllocations : 0;
 }
 
-void NeuralNetwork::saveWeights(std::string path) {
-    std::ofstream file(path.c_str(), std::ios::binary);
-    if (!file.is_open()) {
-        std::cerr << "Couldnt create file" << std::endl;
-        return;
+template <typename T> void NeuralNetwork<T>::reserveEvaluation() {
+    if (this->evaluationScratch.caches.size() != this->layers.size()) {
+        this->evaluationScratch = this->makeScratch(EVALUATION_BATCH);
     }
-    size_t layersNum = this->layersConfig.size();
-    file.write(reinterpret_cast<const char*>(&layersNum), sizeof(layersNum));
-    file.write(reinterpret_cast<const char*>(this->layersConfig.data()), layersNum * sizeof(int));
+    this->evaluationInput.resize(this->layersConfig[0], EVALUATION_BATCH);
+    this->evaluationTarget.resize(this->layersConfig[this->layersConfig.size() - 1],
+                                  EVALUATION_BATCH);
+}
+
+template <typename T>
+typename NeuralNetwork<T>::Evaluation
+NeuralNetwork<T>::evaluate(const std::function<bool(T* features, T* target)>& next) {
+    this->reserveEvaluation();
+    int featureCount = this->layersConfig[0];
+    int targetCount = this->layersConfig[this->layersConfig.size() - 1];
+    Evaluation evaluation = {};
+    evaluation.confusion.assign(targetCount * targetCount, 0);
+    size_t* confusion = evaluation.confusion.data();
+    size_t cells = evaluation.confusion.size();
+    size_t hits = 0;
+    double cost = 0, entropy = 0, minCost = INFINITY, maxCost = 0;
+    for (;;) {
+        int size = 0;
+        while (size < EVALUATION_BATCH &&
+               next(this->evaluationInput.data() + (size * featureCount),
+                    this->evaluationTarget.data() + (size * targetCount))) {
+            size++;
+        }
+        if (size == 0) {
+            break;
+        }
+        const MatrixView<const T> output = this->infer(
+            this->evaluationInput.view().rows(0, size).transpose(), this->evaluationScratch);
+        const MatrixView<const T> target = this->evaluationTarget.view().rows(0, size).transpose();
+#pragma omp parallel for schedule(static) if (size >= PARALLEL_EVALUATION)                         \
+    reduction(+ : hits, cost, entropy, confusion[:cells]) reduction(min : minCost)                 \
+    reduction(max : maxCost)
+        for (int n = 0; n < size; ++n) {
+            int label = 0, predicted = 0;
+            double squared = 0, sampleEntropy = 0;
+            for (int o = 0; o < targetCount; ++o) {
+                double expected = target.getValue(n, o);
+                double value = output.getValue(n, o);
+                squared += (expected - value) * (expected - value);
+                if (expected != 0) {
+                    sampleEntropy -= expected * std::log(std::max(value, MIN_PROBABILITY));
+                }
+                if (expected > target.getValue(n, label)) {
+                    label = o;
+                }
+                if (value > output.getValue(n, predicted)) {
+                    predicted = o;
+                }
+            }
+            double sampleCost = squared / targetCount;
+            cost += sampleCost;
+            minCost = std::min(minCost, sampleCost);
+            maxCost = std::max(maxCost, sampleCost);
+            entropy += sampleEntropy;
+            hits += label == predicted;
+            confusion[(label * targetCount) + predicted]++;
+        }
+        evaluation.samples += size;
+    }
+    if (evaluation.samples != 0) {
+        evaluation.accuracy = 100.0 * hits / evaluation.samples;
+        evaluation.crossEntropy = entropy / evaluation.samples;
+        evaluation.averageCost = cost / evaluation.samples;
+        evaluation.minCost = minCost;
+        evaluation.maxCost = maxCost;
+    }
+    return evaluation;
+}
+
+template <typename T>
+typename NeuralNetwork<T>::Evaluation
+NeuralNetwork<T>::evaluate(const Dataset<T>& data, const std::vector<int>& samples) {
+    if (data.getFeatureCount() != this->layersConfig[0] ||
+        data.getTargetCount() != this->layersConfig[this->layersConfig.size() - 1]) {
+        throw std::invalid_argument("Sample sizes don't match the input and output layers");
+    }
+    size_t sample_it = 0;
+    return this->evaluate([&](T* features, T* target) {
+        if (sample_it >= samples.size()) {
+            return false;
+        }
+        data.copyFeatures(samples[sample_it], features);
+        std::copy_n(data.targetOf(samples[sample_it]), data.getTargetCount(), target);
+        sample_it++;
+        return true;
+    });
+}
+
+template <typename T>
+typename NeuralNetwork<T>::TrainResponse NeuralNetwork<T>::respond(const Evaluation& test) {
+    TrainResponse response = {};
+    response.averageCost = test.averageCost;
+    response.minCost = test.minCost;
+    response.maxCost = test.maxCost;
+    response.hitPercentage = test.accuracy;
+    response.crossEntropy = test.crossEntropy;
+    response.confusion = test.confusion;
+    return response;
+}
+
+template <typename T>
+typename NeuralNetwork<T>::TrainResponse
+NeuralNetwork<T>::train(const Dataset<T>& data, float trainingUseRatio, int epochs, int batchSize,
+                        double learningRate, double learningRateUpdate) {
+    TrainingRun run = this->beginTraining(data.getFeatureCount(), data.getTargetCount(),
+                                          data.size(), data.size());
+    int sample_count = data.size();
+    int split_index = sample_count * trainingUseRatio;
+
+    // The samples stay where they are, the split and every epoch's order are shuffled indices. A
+    // resumed run keeps the split it was checkpointed with
+    std::vector<int>& order = run.order;
+    if (!run.resumed) {
+        std::shuffle(order.begin(), order.end(), run.generator);
+    }
+
+    // The loader gathers the samples of each batch while the previous one trains
+    BatchLoader<T> loader(data, batchSize, this->prefetchBatches, this->loaderThreads,
+                          this->batchTransform);
+    std::vector<int> epoch_order;
+    // Each step covers one batch per rank, rank r taking the r-th
+    int stride = batchSize * run.worldSize;
+    int steps = std::max(0, (split_index - 1) / stride);
+    epoch_order.reserve(steps * batchSize);
+    auto begin_epoch = [&](int firstStep) {
+        std::shuffle(order.begin(), order.begin() + split_index, run.generator);
+        epoch_order.clear();
+        for (int step = firstStep; step < steps; ++step) {
+            auto first = order.begin() + (step * stride) + (run.rank * batchSize);
+            epoch_order.insert(epoch_order.end(), first, first + batchSize);
+        }
+        loader.beginEpoch(epoch_order);
+        return steps;
+    };
+    // The held-out samples validate during training and test after it
+    std::vector<int> held_out(order.begin() + split_index, order.end());
+    if (this->validationInterval > 0 && held_out.empty()) {
+        throw std::invalid_argument("Validation needs held-out samples");
+    }
+    auto validate = [&]() { return this->evaluate(data, held_out); };
+    TrainResponse progress;
+    this->trainEpochs(run, loader, begin_epoch, validate, epochs, batchSize, learningRate,
+                      learningRateUpdate, progress);
+
+    TrainResponse response = this->respond(validate());
+    response.steadyStateSystemBlocks = progress.steadyStateSystemBlocks;
+    response.epochsTrained = progress.epochsTrained;
+    response.dataStallSeconds = loader.getStallSeconds();
+    return response;
+}
+
+template <typename T>
+typename NeuralNetwork<T>::TrainResponse
+NeuralNetwork<T>::train(const ShardedDataset<T>& data, float trainingUseRatio, int epochs,
+                        int batchSize, double learningRate, double learningRateUpdate) {
+    using Range = typename ShardedDataset<T>::Range;
+    // Shards are cut by sample, the one holding the split trains on its start and tests on the rest
+    size_t split_index = data.size() * trainingUseRatio;
+    std::vector<Range> training, testing;
+    size_t first = 0;
+    for (int shard = 0; shard < data.shardCount(); ++shard) {
+        size_t end = first + data.shardSize(shard);
+        if (first < split_index) {
+            training.push_back({shard, 0, std::min(end, split_index) - first});
+        }
+        if (end > split_index) {
+            testing.push_back({shard, std::max(first, split_index) - first, end - first});
+        }
+        first = end;
+    }
+    TrainingRun run = this->beginTraining(data.getFeatureCount(), data.getTargetCount(),
+                                          data.size(), training.size());
+    if (training.size() < static_cast<size_t>(run.worldSize)) {
+        throw std::invalid_argument("Every rank needs at least one training shard");
+    }
+    if (this->validationInterval > 0 && testing.empty()) {
+        throw std::invalid_argument("Validation needs held-out samples");
+    }
+
+    // A single loader drains the stream, which maps one shard at a time
+    typename ShardedDataset<T>::Stream stream(data, data.getShuffleBuffer());
+    BatchLoader<T> loader(
+        [&](T* features, T* target) { return stream.next(features, target); },
+        data.getFeatureCount(), data.getTargetCount(), batchSize, this->prefetchBatches,
+        this->batchTransform);
+    std::vector<Range> rank_shards;
+    auto begin_epoch = [&](int firstStep) {
+        // Every rank shuffles the shards alike and takes every worldSize-th one from its rank on
+        std::shuffle(run.order.begin(), run.order.end(), run.generator);
+        rank_shards.clear();
+        size_t fewest = data.size();
+        for (int r = 0; r < run.worldSize; ++r) {
+            size_t samples = 0;
+            for (size_t i = r; i < training.size(); i += run.worldSize) {
+                const Range& range = training[run.order[i]];
+                samples += range.end - range.first;
+                if (r == run.rank) {
+                    rank_shards.push_back(range);
+                }
+            }
+            fewest = std::min(fewest, samples);
+        }
+        stream.reset(rank_shards, run.generator());
+        // A resumed epoch reads past the samples its first steps trained on
+        stream.skip(static_cast<size_t>(firstStep) * batchSize);
+        int steps = fewest / batchSize;
+        loader.beginEpoch(steps - firstStep);
+        return steps;
+    };
+    // The held-out samples validate during training and test after it, read in order
+    typename ShardedDataset<T>::Stream held_out(data, 0);
+    auto validate = [&]() {
+        held_out.reset(testing, 0);
+        return this->evaluate(
+            [&](T* features, T* target) { return held_out.next(features, target); });
+    };
+    TrainResponse progress;
+    this->trainEpochs(run, loader, begin_epoch, validate, epochs, batchSize, learningRate,
+                      learningRateUpdate, progress);
+
+    TrainResponse response = this->respond(validate());
+    response.steadyStateSystemBlocks = progress.steadyStateSystemBlocks;
+    response.epochsTrained = progress.epochsTrained;
+    response.dataStallSeconds = loader.getStallSeconds();
+    return response;
+}
+
+template <typename T> void NeuralNetwork<T>::saveWeights(std::string path) const {
+    // The layer sizes, then the activation of every layer after the input
+    std::vector<int32_t> layout(this->layersConfig.begin(), this->layersConfig.end());
+    for (const Layer<T>& layer : this->layers) {
+        layout.push_back(layer.getActivationFunction());
+    }
+    std::vector<ModelFile::Blob> blobs;
+    blobs.push_back({ModelFile::LAYERS, 0, static_cast<uint32_t>(this->layersConfig.size()), 1,
+                     layout.data(), layout.size() * sizeof(int32_t)});
+    auto add_tensor = [&](ModelFile::SectionKind kind, uint32_t layer, MatrixView<const T> mat) {
+        blobs.push_back({kind, layer, static_cast<uint32_t>(mat.getWidth()),
+                         static_cast<uint32_t>(mat.getHeight()), mat.data(),
+                         mat.getWidth() * mat.getHeight() * sizeof(T)});
+    };
     for (size_t i = 0; i < this->layers.size(); ++i) {
-        std::vector<double> weights = this->layers[i].getWeights().getValuesVector();
-        std::vector<double> biases = this->layers[i].getBiases().getValuesVector();
-        file.write(reinterpret_cast<const char*>(weights.data()), weights.size() * sizeof(double));
-        file.write(reinterpret_cast<const char*>(biases.data()), biases.size() * sizeof(double));
+        add_tensor(ModelFile::WEIGHTS, i, this->layers[i].getWeights());
+        add_tensor(ModelFile::BIASES, i, this->layers[i].getBiases());
+        // Saved packed too, so loading doesn't have to pack them
+        if (this->layers[i].getPackedWeights().data()) {
+            add_tensor(ModelFile::PACKED, i, this->layers[i].getPackedWeights());
+        }
     }
-    file.close();
+    ModelFile::write(path, sizeof(T), blobs);
+}
+
+template <typename T> void NeuralNetwork<T>::loadWeights(std::string path, bool verify) {
+    if (!ModelFile::recognizes(path)) {
+        this->loadLegacyWeights(path);
+        return;
+    }
+    auto model = std::make_shared<ModelFile>();
+    if (!model->open(path)) {
+        return;
+    }
+    const ModelFile::Section* layout = model->find(ModelFile::LAYERS);
+    if (!layout || layout->width < 2 ||
+        layout->bytes != ((2 * static_cast<uint64_t>(layout->width)) - 1) * sizeof(int32_t)) {
+        std::cerr << "Model " << path << " has no layer table" << std::endl;
+        return;
+    }
+    const int32_t* sizes = static_cast<const int32_t*>(model->data(*layout));
+    const int32_t* activations = sizes + layout->width;
+    std::vector<int> config(sizes, sizes + layout->width);
+    // Every section is checked before the network changes
+    size_t scalar = model->getScalarBytes();
+    bool inPlace = scalar == sizeof(T);
+    bool valid = !verify || model->intact(*layout);
+    std::vector<const ModelFile::Section*> weights, biases, packed;
+    for (int nodes : config) {
+        valid = valid && nodes > 0;
+    }
+    for (uint32_t i = 0; valid && i + 1 < config.size(); ++i) {
+        weights.push_back(model->find(ModelFile::WEIGHTS, i));
+        biases.push_back(model->find(ModelFile::BIASES, i));
+        packed.push_back(inPlace ? model->find(ModelFile::PACKED, i) : nullptr);
+        const ModelFile::Section* w = weights.back();
+        const ModelFile::Section* b = biases.back();
+        const ModelFile::Section* p = packed.back();
+        uint64_t inputs = config[i], nodes = config[i + 1];
+        uint64_t panel = SparseInput<T>::panelWidth();
+        uint64_t weightBytes, packedBytes;
+        valid = w && b && activations[i] >= Layer<T>::SIGMOID &&
+                activations[i] <= Layer<T>::SOFTMAX && w->width == inputs && w->height == nodes &&
+                tensor_bytes(inputs, nodes, scalar, weightBytes) && w->bytes == weightBytes &&
+                b->width == 1 && b->height == nodes && b->bytes == nodes * scalar &&
+                (!p || (p->width == panel && p->height == (nodes + panel - 1) / panel * inputs &&
+                        tensor_bytes(p->width, p->height, scalar, packedBytes) &&
+                        p->bytes == packedBytes)) &&
+                ((inPlace && !verify) ||
+                 (model->intact(*w) && model->intact(*b) && (!p || model->intact(*p))));
+    }
+    if (!valid) {
+        std::cerr << "Model " << path << " is damaged" << std::endl;
+        return;
+    }
+
+    // Layers of this precision are built straight over the mapping, nothing is allocated or copied
+    auto tensor = [&](const ModelFile::Section* section) {
+        if (!section) {
+            return MatrixView<const T>();
+        }
+        return MatrixView<const T>(static_cast<const T*>(model->data(*section)), section->width,
+                                   section->height, section->width);
+    };
+    this->layersConfig = config;
+    this->layers.clear();
+    this->layers.reserve(config.size() - 1);
+    for (size_t i = 0; i < weights.size(); ++i) {
+        auto activation = static_cast<typename Layer<T>::ActivationFunction>(activations[i]);
+        if (inPlace) {
+            this->layers.emplace_back(tensor(weights[i]), tensor(biases[i]), activation,
+                                      tensor(packed[i]));
+        } else {
+            this->layers.emplace_back(config[i + 1], config[i], activation);
+            this->setLayerWeights(i, copy_tensor<T>(*model, *weights[i]));
+            this->setLayerBiases(i, copy_tensor<T>(*model, *biases[i]));
+        }
+    }
+    this->layers[0].setSparseInput(SPARSE_INPUT_DENSITY);
+    this->modelFile = inPlace ? std::move(model) : nullptr;
 }
 
-void NeuralNetwork::loadWeights(std::string path) {
-    std::ifstream file(path.c_str(), std::ios::binary);
+template <typename T> void NeuralNetwork<T>::loadLegacyWeights(std::string path) {
+    std::ifstream file(path.c_str(), std::ios::binary | std::ios::ate);
     if (!file.is_open()) {
         std::cerr << "Couldnt open file" << std::endl;
         return;
     }
-    size_t size;
-    file.read(reinterpret_cast<char*>(&size), sizeof(size));
-    if (size <= 0) {
+    uint64_t fileBytes = file.tellg();
+    file.seekg(0);
+    // Every size is checked against the file before anything is allocated for it
+    uint64_t size;
+    if (!file.read(reinterpret_cast<char*>(&size), sizeof(size)) || size < 2 ||
+        size > (fileBytes - sizeof(size)) / sizeof(int)) {
         std::cerr << "Error reading network config" << std::endl;
         return;
     }
     std::vector<int> config(size, 0);
-    std::cout << size << std::endl;
-    file.read(reinterpret_cast<char*>(config.data()), size * sizeof(int));
-    for (int i : config) {
-        std::cout << i << " ";
+    uint64_t expected = sizeof(size) + (size * sizeof(int));
+    bool valid = static_cast<bool>(
+        file.read(reinterpret_cast<char*>(config.data()), size * sizeof(int)));
+    for (size_t i = 0; valid && i < config.size(); ++i) {
+        uint64_t weightBytes;
+        valid = config[i] > 0 &&
+                (i == 0 || (tensor_bytes(config[i - 1], config[i], sizeof(double), weightBytes) &&
+                            !__builtin_add_overflow(expected, weightBytes, &expected) &&
+                            !__builtin_add_overflow(expected, config[i] * sizeof(double),
+                                                    &expected)));
+    }
+    if (!valid || expected > fileBytes) {
+        std::cerr << "Model " << path << " is damaged" << std::endl;
+        return;
     }
-    std::cout << std::endl;
     this->setLayersConfig(config);
     for (size_t i = 1; i < config.size(); ++i) {
-        std::vector<double> weightsVec(config[i] * config[i - 1], 0);
-        file.read(reinterpret_cast<char*>(weightsVec.data()),
-                  (config[i] * config[i - 1]) * sizeof(double));
-        Matrix layerWeights(config[i - 1], config[i], weightsVec);
-        this->setLayerWeights(i - 1, layerWeights);
-        std::vector<double> biasesVec(config[i]);
-        file.read(reinterpret_cast<char*>(biasesVec.data()), config[i] * sizeof(double));
-        Matrix layerBiases(1, config[i], biasesVec);
-        this->setLayerBiases(i - 1, layerBiases);
+        this->setLayerWeights(i - 1, read_matrix<T>(file, config[i - 1], config[i]));
+        this->setLayerBiases(i - 1, read_matrix<T>(file, 1, config[i]));
     }
     file.close();
-}
\ No newline at end of file
+}
+
+template class NeuralNetwork<float>;
+template class NeuralNetwork<double>;
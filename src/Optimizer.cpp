@@ -0,0 +1,237 @@
+#include "../include/Optimizer.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define OPTIMIZER_X86
+#endif
+
+// Below this many parameters the OpenMP fork costs more than it saves
+static constexpr size_t PARALLEL_THRESHOLD = 1 << 15;
+// Parameters one thread updates at a time
+static constexpr size_t CHUNK = 4096;
+
+// Calls update on every CHUNK values of the tensors, one parallel loop over the chunks of all of
+// them, so a layer's weights and biases take a single fork and join
+template <typename T, typename Update>
+static void for_each_chunk(std::span<const typename Optimizer<T>::Tensor> tensors,
+                           const Update& update) {
+    size_t chunks = 0, count = 0;
+    for (const typename Optimizer<T>::Tensor& tensor : tensors) {
+        chunks += (tensor.count + CHUNK - 1) / CHUNK;
+        count += tensor.count;
+    }
+#pragma omp parallel for schedule(static) if (count > PARALLEL_THRESHOLD)
+    for (size_t c = 0; c < chunks; ++c) {
+        size_t tensorIt = 0, chunk = c;
+        for (size_t own; chunk >= (own = (tensors[tensorIt].count + CHUNK - 1) / CHUNK);
+             chunk -= own) {
+            ++tensorIt;
+        }
+        const typename Optimizer<T>::Tensor& tensor = tensors[tensorIt];
+        size_t first = chunk * CHUNK;
+        update(typename Optimizer<T>::Tensor{
+            tensor.params + first, tensor.grads + first,
+            tensor.first != nullptr ? tensor.first + first : nullptr,
+            tensor.second != nullptr ? tensor.second + first : nullptr,
+            std::min(CHUNK, tensor.count - first)});
+    }
+}
+
+template <typename T> Optimizer<T>::Optimizer() {
+    this->maxGradientNorm = 0;
+}
+
+template <typename T> void Optimizer<T>::clipGradients(double maxNorm) {
+    if (maxNorm < 0) {
+        throw std::invalid_argument("Gradient norm limit can't be negative");
+    }
+    this->maxGradientNorm = maxNorm;
+}
+
+template <typename T> double Optimizer<T>::getMaxGradientNorm() const {
+    return this->maxGradientNorm;
+}
+
+template <typename T> double Optimizer<T>::clipScale(double squaredNorm) const {
+    double norm = std::sqrt(squaredNorm);
+    if (this->maxGradientNorm > 0 && norm > this->maxGradientNorm) {
+        return this->maxGradientNorm / norm;
+    }
+    return 1;
+}
+
+template <typename T> SGD<T>::SGD(double momentum, bool nesterov) {
+    if (momentum < 0 || momentum >= 1) {
+        throw std::invalid_argument("Momentum must be in [0, 1)");
+    }
+    if (nesterov && momentum == 0) {
+        throw std::invalid_argument("Nesterov momentum needs a nonzero momentum");
+    }
+    this->momentum = momentum;
+    this->nesterov = nesterov;
+}
+
+template <typename T> int SGD<T>::stateBuffers() const {
+    return this->momentum != 0 ? 1 : 0;
+}
+
+// Plain: p -= lr * g. Momentum keeps the velocity v = mu * v + g and steps by lr * v, Nesterov by
+// lr * (g + mu * v), looking ahead along the updated velocity
+template <typename T>
+void SGD<T>::update(std::span<const typename Optimizer<T>::Tensor> tensors, T learningRate,
+                    T gradientScale, long) const {
+    const T mu = this->momentum;
+    const bool nesterov = this->nesterov;
+    for_each_chunk<T>(tensors, [&](const typename Optimizer<T>::Tensor& tensor) {
+        T* p = tensor.params;
+        const T* g = tensor.grads;
+        T* v = tensor.first;
+        size_t count = tensor.count;
+        if (mu == 0) {
+#pragma omp simd
+            for (size_t i = 0; i < count; ++i) {
+                p[i] -= learningRate * (g[i] * gradientScale);
+            }
+        } else if (nesterov) {
+#pragma omp simd
+            for (size_t i = 0; i < count; ++i) {
+                T grad = g[i] * gradientScale;
+                v[i] = (mu * v[i]) + grad;
+                p[i] -= learningRate * (grad + (mu * v[i]));
+            }
+        } else {
+#pragma omp simd
+            for (size_t i = 0; i < count; ++i) {
+                v[i] = (mu * v[i]) + (g[i] * gradientScale);
+                p[i] -= learningRate * v[i];
+            }
+        }
+    });
+}
+
+template <typename T>
+Adam<T>::Adam(double beta1, double beta2, double epsilon, double weightDecay) {
+    if (beta1 < 0 || beta1 >= 1 || beta2 < 0 || beta2 >= 1) {
+        throw std::invalid_argument("Adam betas must be in [0, 1)");
+    }
+    if (epsilon <= 0 || weightDecay < 0) {
+        throw std::invalid_argument("Adam needs a positive epsilon and a non-negative decay");
+    }
+    this->beta1 = beta1;
+    this->beta2 = beta2;
+    this->epsilon = epsilon;
+    this->weightDecay = weightDecay;
+}
+
+template <typename T> int Adam<T>::stateBuffers() const {
+    return 2;
+}
+
+// Per-step constants of the Adam update, bias corrections folded in
+template <typename T> struct AdamStep {
+    T beta1;
+    T beta2;
+    T stepSize;    // learning rate / (1 - beta1^t)
+    T secondScale; // 1 / (1 - beta2^t)
+    T epsilon;
+    T decay; // 1 - learning rate * weight decay
+    T gradientScale;
+};
+
+// m = b1 * m + (1 - b1) * g, v = b2 * v + (1 - b2) * g^2, p = p * decay - step * m / (sqrt(v) + e)
+// with m and v bias corrected. The square root and division make it the one update that isn't
+// bound by memory, so it gets compiled per instruction set like the activation kernels
+template <typename T>
+[[gnu::always_inline]] inline void adam_values(T* p, const T* g, T* m, T* v, size_t count,
+                                               const AdamStep<T>& s) {
+#pragma omp simd
+    for (size_t i = 0; i < count; ++i) {
+        T grad = g[i] * s.gradientScale;
+        m[i] = (s.beta1 * m[i]) + ((1 - s.beta1) * grad);
+        v[i] = (s.beta2 * v[i]) + ((1 - s.beta2) * grad * grad);
+        T denominator = std::sqrt(v[i] * s.secondScale) + s.epsilon;
+        p[i] = (p[i] * s.decay) - (s.stepSize * m[i] / denominator);
+    }
+}
+
+template <typename T> using AdamKernel = void (*)(T*, const T*, T*, T*, size_t, const AdamStep<T>&);
+
+template <typename T>
+static void adamGeneric(T* p, const T* g, T* m, T* v, size_t count, const AdamStep<T>& s) {
+    adam_values(p, g, m, v, count, s);
+}
+
+#ifdef OPTIMIZER_X86
+template <typename T>
+__attribute__((target("avx2,fma"))) static void adamAvx2(T* p, const T* g, T* m, T* v,
+                                                          size_t count, const AdamStep<T>& s) {
+    adam_values(p, g, m, v, count, s);
+}
+template <typename T>
+__attribute__((target("avx512f"))) static void adamAvx512(T* p, const T* g, T* m, T* v,
+                                                           size_t count, const AdamStep<T>& s) {
+    adam_values(p, g, m, v, count, s);
+}
+#endif
+
+// Follows NN_GEMM_ISA like the gemm kernels
+template <typename T> static AdamKernel<T> detectKernel() {
+    const char* forced = std::getenv("NN_GEMM_ISA");
+    std::string name(forced != nullptr ? forced : "");
+    if (name == "reference" || name == "generic") {
+        return adamGeneric<T>;
+    }
+#ifdef OPTIMIZER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && name != "avx2") {
+        return adamAvx512<T>;
+    } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return adamAvx2<T>;
+    }
+#endif
+    return adamGeneric<T>;
+}
+
+template <typename T> static AdamKernel<T> adamKernel() {
+    static const AdamKernel<T> selected = detectKernel<T>();
+    return selected;
+}
+
+template <typename T>
+void Adam<T>::update(std::span<const typename Optimizer<T>::Tensor> tensors, T learningRate,
+                     T gradientScale, long step) const {
+    AdamStep<T> s;
+    s.beta1 = this->beta1;
+    s.beta2 = this->beta2;
+    s.stepSize = learningRate / (1 - std::pow(static_cast<double>(this->beta1), step));
+    s.secondScale = 1 / (1 - std::pow(static_cast<double>(this->beta2), step));
+    s.epsilon = this->epsilon;
+    s.decay = 1 - (learningRate * this->weightDecay);
+    s.gradientScale = gradientScale;
+    AdamKernel<T> kernel = adamKernel<T>();
+    for_each_chunk<T>(tensors, [&](const typename Optimizer<T>::Tensor& tensor) {
+        kernel(tensor.params, tensor.grads, tensor.first, tensor.second, tensor.count, s);
+    });
+}
+
+template <typename T> double squaredNorm(const T* values, size_t count) {
+    double sum = 0;
+#pragma omp parallel for simd schedule(static) reduction(+ : sum) if (count > PARALLEL_THRESHOLD)
+    for (size_t i = 0; i < count; ++i) {
+        sum += static_cast<double>(values[i]) * values[i];
+    }
+    return sum;
+}
+
+template class Optimizer<float>;
+template class Optimizer<double>;
+template class SGD<float>;
+template class SGD<double>;
+template class Adam<float>;
+template class Adam<double>;
+template double squaredNorm(const float*, size_t);
+template double squaredNorm(const double*, size_t);
@@ -0,0 +1,165 @@
+#include "../include/Pipeline.hpp"
+#include "../include/Threads.hpp"
+#include <algorithm>
+#include <stdexcept>
+
+// Multiply-adds per sample, what the stage split balances
+template <typename T> static size_t layer_cost(const Layer<T>& layer) {
+    return layer.getWeights().getWidth() * layer.getWeights().getHeight();
+}
+
+template <typename T>
+Pipeline<T>::Pipeline(std::vector<Layer<T>>& layers, int stageCount, int microBatches,
+                      int batchSize)
+    : layers(layers), generation(0), pending(0), stopping(false) {
+    if (stageCount < 1 || microBatches < 1) {
+        throw std::invalid_argument("Pipeline needs at least one stage and one micro-batch");
+    }
+    if (batchSize % microBatches != 0) {
+        throw std::invalid_argument("Batch size must be a multiple of the micro-batch count");
+    }
+    this->microBatches = microBatches;
+    this->microBatchSize = batchSize / microBatches;
+    stageCount = std::min<int>(stageCount, layers.size());
+
+    // Split the layers so every stage gets about the same share of the work
+    size_t total = 0;
+    for (const Layer<T>& layer : layers) {
+        total += layer_cost(layer);
+    }
+    size_t first = 0, done = 0;
+    for (int s = 0; s < stageCount; ++s) {
+        size_t end = first + 1;
+        done += layer_cost(layers[first]);
+        size_t goal = total * (s + 1) / stageCount;
+        while (end < layers.size() - (stageCount - 1 - s)) {
+            size_t cost = layer_cost(layers[end]);
+            if (s != stageCount - 1 && done + (cost / 2) > goal) {
+                break;
+            }
+            done += cost;
+            ++end;
+        }
+        std::unique_ptr<Stage> stage = std::make_unique<Stage>();
+        stage->firstLayer = first;
+        stage->endLayer = end;
+        this->stages.push_back(std::move(stage));
+        first = end;
+    }
+
+    for (int s = 0; s < stageCount; ++s) {
+        this->stages[s]->cores = core_share(s, stageCount);
+    }
+
+    this->caches.resize(layers.size());
+    for (size_t l = 0; l < layers.size(); ++l) {
+        this->caches[l].resize(microBatches);
+        for (int m = 0; m < microBatches; ++m) {
+            layers[l].reserve(this->caches[l][m], this->microBatchSize);
+        }
+    }
+
+    for (size_t s = 0; s < this->stages.size(); ++s) {
+        this->stages[s]->worker = std::thread(&Pipeline<T>::run, this, s);
+    }
+}
+
+template <typename T> Pipeline<T>::~Pipeline() {
+    this->stopping = true;
+    this->generation.fetch_add(1);
+    this->generation.notify_all();
+    for (std::unique_ptr<Stage>& stage : this->stages) {
+        stage->worker.join();
+    }
+}
+
+template <typename T> int Pipeline<T>::getStageCount() const {
+    return this->stages.size();
+}
+
+template <typename T> void Pipeline<T>::run(size_t stageIt) {
+    pin_thread(this->stages[stageIt]->cores);
+    int seen = 0;
+    while (true) {
+        this->generation.wait(seen);
+        seen = this->generation.load();
+        if (this->stopping) {
+            return;
+        }
+        this->runStep(stageIt);
+        if (this->pending.fetch_sub(1) == 1) {
+            this->pending.notify_all();
+        }
+    }
+}
+
+template <typename T> void Pipeline<T>::runStep(size_t stageIt) {
+    Stage& stage = *this->stages[stageIt];
+    Stage* previous = stageIt > 0 ? this->stages[stageIt - 1].get() : nullptr;
+    Stage* next = stageIt + 1 < this->stages.size() ? this->stages[stageIt + 1].get() : nullptr;
+    int size = this->microBatchSize;
+
+    for (int m = 0; m < this->microBatches; ++m) {
+        MatrixView<const T> current;
+        if (previous != nullptr) {
+            wait_for(previous->fowardDone, m + 1);
+            current = this->caches[stage.firstLayer - 1][m].activations;
+        } else {
+            current = this->input.columns(m * size, size);
+        }
+        for (size_t l = stage.firstLayer; l < stage.endLayer; ++l) {
+            current = this->layers[l].foward(current, this->caches[l][m]);
+        }
+        stage.fowardDone.store(m + 1);
+        stage.fowardDone.notify_all();
+    }
+
+    // Backward runs the micro-batches in reverse, the last one forwarded is the first one ready
+    for (int k = 0; k < this->microBatches; ++k) {
+        int m = this->microBatches - 1 - k;
+        if (next != nullptr) {
+            wait_for(next->backwardDone, k + 1);
+        }
+        for (size_t l = stage.endLayer; l-- > stage.firstLayer;) {
+            typename Layer<T>::Cache& cache = this->caches[l][m];
+            if (l == this->layers.size() - 1) {
+                // Output layer deltas are the output minus the target, built in place
+                cache.activations -= this->target.columns(m * size, size);
+                this->layers[l].setDeltas(cache.activations, cache, k > 0);
+            } else {
+                this->layers[l].backwards(this->layers[l + 1].getWeights(),
+                                          this->caches[l + 1][m].deltas, cache, k > 0);
+            }
+        }
+        stage.backwardDone.store(k + 1);
+        stage.backwardDone.notify_all();
+    }
+
+    for (size_t l = stage.firstLayer; l < stage.endLayer; ++l) {
+        this->layers[l].averageGradients(size * this->microBatches);
+    }
+}
+
+template <typename T>
+void Pipeline<T>::step(MatrixView<const T> input, MatrixView<const T> target) {
+    if (input.getWidth() != this->microBatchSize * this->microBatches ||
+        target.getWidth() != input.getWidth()) {
+        throw std::invalid_argument("Pipeline step batch size doesn't match its micro-batches");
+    }
+    this->input = input;
+    this->target = target;
+    for (std::unique_ptr<Stage>& stage : this->stages) {
+        stage->fowardDone.store(0);
+        stage->backwardDone.store(0);
+    }
+    this->pending.store(this->stages.size());
+    this->generation.fetch_add(1);
+    this->generation.notify_all();
+    int left;
+    while ((left = this->pending.load()) != 0) {
+        this->pending.wait(left);
+    }
+}
+
+template class Pipeline<float>;
+template class Pipeline<double>;
@@ -0,0 +1,541 @@
+#include "../include/QuantizedNetwork.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define QUANTIZED_X86
+#endif
+
+static constexpr uint32_t MAGIC = 0x3851'4e4e; // "NNQ8"
+static constexpr size_t K_STEP = 64;      // activation row padding, keeps rows cache aligned
+static constexpr size_t ROW_TILE = 32;    // output rows per kernel call
+static constexpr size_t SAMPLE_TILE = 4;  // samples per kernel call
+static constexpr size_t SAMPLE_BLOCK = 32; // samples swept per row tile, kept in L1/L2
+// Bytes of a layer in the file before its tensors: inputs, outputs, relu, input scale and offset
+static constexpr size_t LAYER_HEADER_BYTES = sizeof(int) + sizeof(int) + sizeof(bool) +
+                                             sizeof(float) + sizeof(int);
+
+// Weights are packed per tile of ROW_TILE output rows as [k / 4][row][k % 4], so one 32-bit lane
+// holds four consecutive weights of one row. A sample's four matching activations are broadcast
+// to every lane and vpdpbusd (or vpmaddubsw + vpmaddwd) adds the four products into that row's
+// lane. Accumulators are indexed by output row, nothing needs a horizontal sum.
+static size_t packedIndex(size_t stride, int o, int k) {
+    return ((o / ROW_TILE) * ROW_TILE * stride) + ((k / 4) * ROW_TILE * 4) +
+           ((o % ROW_TILE) * 4) + (k % 4);
+}
+
+// Activations are unsigned (ReLU outputs, or inputs shifted by a zero point) and weights signed,
+// the operand order of vpmaddubsw and vpdpbusd. Activations stay within 0-127 so the pairwise
+// 16-bit sums of the AVX2 path can't saturate. Each kernel computes one tile against
+// SAMPLE_TILE samples, out[s * ROW_TILE + r] = row r . sample s
+using DotKernel = void (*)(const int8_t* w, size_t stride, const uint8_t* const* x, int32_t* out);
+
+static void dotGeneric(const int8_t* w, size_t stride, const uint8_t* const* x, int32_t* out) {
+    for (size_t i = 0; i < SAMPLE_TILE * ROW_TILE; ++i) {
+        out[i] = 0;
+    }
+    for (size_t g = 0; g < stride / 4; ++g) {
+        const int8_t* wg = w + (g * ROW_TILE * 4);
+        for (size_t s = 0; s < SAMPLE_TILE; ++s) {
+            const uint8_t* xg = x[s] + (g * 4);
+            for (size_t r = 0; r < ROW_TILE; ++r) {
+                int32_t sum = 0;
+                for (size_t b = 0; b < 4; ++b) {
+                    sum += static_cast<int32_t>(wg[(r * 4) + b]) * xg[b];
+                }
+                out[(s * ROW_TILE) + r] += sum;
+            }
+        }
+    }
+}
+
+#ifdef QUANTIZED_X86
+static int32_t loadGroup(const uint8_t* x) {
+    int32_t group;
+    std::memcpy(&group, x, sizeof(group));
+    return group;
+}
+
+// Two passes of 16 rows each, 8 accumulators plus operands fit the 16 ymm registers
+__attribute__((target("avx2"))) static void dotAvx2(const int8_t* w, size_t stride,
+                                                    const uint8_t* const* x, int32_t* out) {
+    const __m256i ones = _mm256_set1_epi16(1);
+    for (size_t half = 0; half < ROW_TILE; half += 16) {
+        __m256i acc[SAMPLE_TILE][2];
+        for (size_t s = 0; s < SAMPLE_TILE; ++s) {
+            acc[s][0] = _mm256_setzero_si256();
+            acc[s][1] = _mm256_setzero_si256();
+        }
+        for (size_t g = 0; g < stride / 4; ++g) {
+            const int8_t* wg = w + (g * ROW_TILE * 4) + (half * 4);
+            __m256i w0 = _mm256_load_si256((const __m256i*)wg);
+            __m256i w1 = _mm256_load_si256((const __m256i*)(wg + 32));
+            for (size_t s = 0; s < SAMPLE_TILE; ++s) {
+                __m256i xv = _mm256_set1_epi32(loadGroup(x[s] + (g * 4)));
+                __m256i p0 = _mm256_madd_epi16(_mm256_maddubs_epi16(xv, w0), ones);
+                __m256i p1 = _mm256_madd_epi16(_mm256_maddubs_epi16(xv, w1), ones);
+                acc[s][0] = _mm256_add_epi32(acc[s][0], p0);
+                acc[s][1] = _mm256_add_epi32(acc[s][1], p1);
+            }
+        }
+        for (size_t s = 0; s < SAMPLE_TILE; ++s) {
+            _mm256_storeu_si256((__m256i*)(out + (s * ROW_TILE) + half), acc[s][0]);
+            _mm256_storeu_si256((__m256i*)(out + (s * ROW_TILE) + half + 8), acc[s][1]);
+        }
+    }
+}
+
+__attribute__((target("avx512f,avx512vnni"))) static void
+dotAvx512(const int8_t* w, size_t stride, const uint8_t* const* x, int32_t* out) {
+    __m512i acc[SAMPLE_TILE][2];
+    for (size_t s = 0; s < SAMPLE_TILE; ++s) {
+        acc[s][0] = _mm512_setzero_si512();
+        acc[s][1] = _mm512_setzero_si512();
+    }
+    for (size_t g = 0; g < stride / 4; ++g) {
+        const int8_t* wg = w + (g * ROW_TILE * 4);
+        __m512i w0 = _mm512_load_si512(wg);
+        __m512i w1 = _mm512_load_si512(wg + 64);
+        for (size_t s = 0; s < SAMPLE_TILE; ++s) {
+            __m512i xv = _mm512_set1_epi32(loadGroup(x[s] + (g * 4)));
+            acc[s][0] = _mm512_dpbusd_epi32(acc[s][0], xv, w0);
+            acc[s][1] = _mm512_dpbusd_epi32(acc[s][1], xv, w1);
+        }
+    }
+    for (size_t s = 0; s < SAMPLE_TILE; ++s) {
+        _mm512_storeu_si512(out + (s * ROW_TILE), acc[s][0]);
+        _mm512_storeu_si512(out + (s * ROW_TILE) + 16, acc[s][1]);
+    }
+}
+#endif
+
+// Follows NN_GEMM_ISA like the float kernels, so both can be pinned to the same instruction set
+static DotKernel detectKernel() {
+    const char* forced = std::getenv("NN_GEMM_ISA");
+    std::string name(forced != nullptr ? forced : "");
+    if (name == "reference" || name == "generic") {
+        return dotGeneric;
+    }
+#ifdef QUANTIZED_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512vnni") && name != "avx2") {
+        return dotAvx512;
+    } else if (__builtin_cpu_supports("avx2")) {
+        return dotAvx2;
+    }
+#endif
+    return dotGeneric;
+}
+
+static DotKernel dotKernel() {
+    static const DotKernel kernel = detectKernel();
+    return kernel;
+}
+
+static size_t roundUp(size_t value, size_t multiple) {
+    return ((value + multiple - 1) / multiple) * multiple;
+}
+
+// Rounds to nearest after clamping into [low, high] (within +-127). Shifting to positive first
+// makes the truncating conversion a floor, which keeps std::lrint's libm call off the input path
+static int quantize(float value, int low, int high) {
+    value = std::min(std::max(value, static_cast<float>(low)), static_cast<float>(high));
+    return static_cast<int>(value + 128.5f) - 128;
+}
+
+// Scales read from a file must be usable as multipliers, calibration never makes others
+static bool positive_finite(float scale) {
+    return std::isfinite(scale) && scale > 0;
+}
+
+template <MatrixExpression E> static int column_argmax(const E& values, int column) {
+    int best = 0;
+    for (int j = 1; j < values.getHeight(); ++j) {
+        if (values.getValue(column, j) > values.getValue(column, best)) {
+            best = j;
+        }
+    }
+    return best;
+}
+
+QuantizedNetwork::QuantizedNetwork() {}
+
+template <typename T>
+QuantizedNetwork::QuantizedNetwork(const NeuralNetwork<T>& model,
+                                   std::type_identity_t<MatrixView<const T>> calibration) {
+    const std::vector<Layer<T>>& fpLayers = model.getLayers();
+    if (fpLayers.empty()) {
+        throw std::invalid_argument("Can't quantize a network without layers");
+    }
+
+    // Each layer's input scale covers the largest activation the calibration set feeds it. Hidden
+    // activations come out of a ReLU, the network input may need a zero point to stay unsigned
+    std::vector<float> inputScales(fpLayers.size());
+    std::vector<typename Layer<T>::Cache> caches(fpLayers.size());
+    MatrixView<const T> current = calibration;
+    int inputOffset = 0;
+    for (size_t l = 0; l < fpLayers.size(); ++l) {
+        float maxValue = 0, minValue = 0;
+        for (int j = 0; j < current.getHeight(); ++j) {
+            for (int i = 0; i < current.getWidth(); ++i) {
+                float value = current.getValue(i, j);
+                maxValue = std::max(maxValue, std::abs(value));
+                minValue = std::min(minValue, value);
+            }
+        }
+        if (l == 0 && minValue < 0) {
+            inputOffset = 64; // signed inputs get 63 levels each way around the zero point
+        }
+        int levels = l == 0 ? 127 - inputOffset : 127;
+        inputScales[l] = maxValue > 0 ? maxValue / levels : 1;
+        current = fpLayers[l].foward(current, caches[l]);
+    }
+
+    for (size_t l = 0; l < fpLayers.size(); ++l) {
+        const Layer<T>& fp = fpLayers[l];
+        bool last = l == fpLayers.size() - 1;
+        if (fp.getActivationFunction() != (last ? Layer<T>::SOFTMAX : Layer<T>::RELU)) {
+            throw std::invalid_argument(
+                "Quantized inference needs ReLU hidden layers and a softmax output");
+        }
+        MatrixView<const T> w = fp.getWeights();
+        QuantizedLayer layer;
+        layer.inputs = w.getWidth();
+        layer.outputs = w.getHeight();
+        layer.relu = !last;
+        layer.inputScale = inputScales[l];
+        layer.inputOffset = l == 0 ? inputOffset : 0;
+        this->allocate(layer);
+        for (int o = 0; o < layer.outputs; ++o) {
+            float maxWeight = 0;
+            for (int k = 0; k < layer.inputs; ++k) {
+                maxWeight = std::max(maxWeight, static_cast<float>(std::abs(w.getValue(k, o))));
+            }
+            float weightScale = maxWeight > 0 ? maxWeight / 127 : 1;
+            int32_t rowSum = 0;
+            for (int k = 0; k < layer.inputs; ++k) {
+                int q = quantize(w.getValue(k, o) / weightScale, -127, 127);
+                layer.weights[packedIndex(layer.stride, o, k)] = q;
+                rowSum += q;
+            }
+            layer.scales[o] = weightScale * layer.inputScale;
+            // The zero point adds offset * rowSum to every dot product, the bias takes it back
+            layer.biases[o] = std::lrint(fp.getBiases().getValue(0, o) / layer.scales[o]) -
+                              (layer.inputOffset * rowSum);
+            if (layer.relu) {
+                layer.requant[o] = layer.scales[o] / inputScales[l + 1];
+            }
+        }
+        this->layers.push_back(std::move(layer));
+    }
+}
+
+// Sizes the padded buffers of a layer whose inputs and outputs are set, padding stays zero
+void QuantizedNetwork::allocate(QuantizedLayer& layer) {
+    layer.stride = roundUp(layer.inputs, K_STEP);
+    layer.rows = roundUp(layer.outputs, ROW_TILE);
+    layer.weights.assign(layer.rows * layer.stride, 0); // packed tiles, see packedIndex
+    layer.scales.assign(layer.rows, 0);
+    layer.requant.assign(layer.relu ? layer.rows : 0, 0);
+    layer.biases.assign(layer.rows, 0);
+}
+
+const Matrix<float>& QuantizedNetwork::foward(MatrixView<const float> input) {
+    return this->run(input);
+}
+
+const Matrix<float>& QuantizedNetwork::foward(MatrixView<const double> input) {
+    return this->run(input);
+}
+
+template <typename T> const Matrix<float>& QuantizedNetwork::run(MatrixView<const T> input) {
+    if (this->layers.empty()) {
+        throw std::invalid_argument("Quantized network has no layers");
+    }
+    if (input.getHeight() != this->layers[0].inputs) {
+        throw std::invalid_argument("Input height doesn't match the input layer size");
+    }
+    int batch = input.getWidth();
+    this->inputs.resize(this->layers.size());
+    for (size_t l = 0; l < this->layers.size(); ++l) {
+        size_t size = batch * this->layers[l].stride;
+        if (this->inputs[l].size() != size) {
+            this->inputs[l].assign(size, 0);
+        }
+    }
+
+    const QuantizedLayer& first = this->layers[0];
+    float inverse = 1 / first.inputScale;
+    int low = -first.inputOffset, high = 127 - first.inputOffset;
+#pragma omp parallel for
+    for (int n = 0; n < batch; ++n) {
+        uint8_t* row = this->inputs[0].data() + (n * first.stride);
+        for (int k = 0; k < first.inputs; ++k) {
+            row[k] = quantize(input.getValue(n, k) * inverse, low, high) + first.inputOffset;
+        }
+    }
+
+    const DotKernel kernel = dotKernel();
+    for (size_t l = 0; l < this->layers.size(); ++l) {
+        const QuantizedLayer& layer = this->layers[l];
+        const uint8_t* x = this->inputs[l].data();
+        uint8_t* next = layer.relu ? this->inputs[l + 1].data() : nullptr;
+        size_t nextStride = layer.relu ? this->layers[l + 1].stride : 0;
+        int tiles = layer.rows / ROW_TILE;
+        int sampleBlocks = (batch + SAMPLE_BLOCK - 1) / SAMPLE_BLOCK;
+        if (!layer.relu) {
+            this->logits.resize(batch * layer.rows);
+        }
+#pragma omp parallel for collapse(2) schedule(static)
+        for (int sb = 0; sb < sampleBlocks; ++sb) {
+            for (int t = 0; t < tiles; ++t) {
+                const int8_t* w = layer.weights.data() + (t * ROW_TILE * layer.stride);
+                int blockEnd = std::min<int>((sb + 1) * SAMPLE_BLOCK, batch);
+                for (int n0 = sb * SAMPLE_BLOCK; n0 < blockEnd; n0 += SAMPLE_TILE) {
+                    // A short last tile repeats its final sample and drops the extra results
+                    const uint8_t* samples[SAMPLE_TILE];
+                    for (size_t s = 0; s < SAMPLE_TILE; ++s) {
+                        samples[s] = x + (std::min<int>(n0 + s, blockEnd - 1) * layer.stride);
+                    }
+                    alignas(64) int32_t acc[SAMPLE_TILE * ROW_TILE];
+                    kernel(w, layer.stride, samples, acc);
+                    int rowEnd = std::min<int>(ROW_TILE, layer.outputs - (t * ROW_TILE));
+                    for (size_t s = 0; s < std::min<size_t>(SAMPLE_TILE, blockEnd - n0); ++s) {
+                        int n = n0 + s;
+                        const int32_t* dots = acc + (s * ROW_TILE);
+                        int o = t * ROW_TILE;
+                        const int32_t* bias = layer.biases.data() + o;
+                        if (layer.relu) {
+                            // Requantize and ReLU in one integer clamp. Accumulators are bounded
+                            // by 127 * 127 * inputs, so the conversion can't overflow, and the
+                            // branch-free loop vectorizes where a float clamp wouldn't
+                            uint8_t* y = next + (n * nextStride) + o;
+                            for (int r = 0; r < rowEnd; ++r) {
+                                float scaled = (dots[r] + bias[r]) * layer.requant[o + r];
+                                y[r] = std::clamp(static_cast<int>(scaled + 0.5f), 0, 127);
+                            }
+                        } else {
+                            float* z = this->logits.data() + (n * layer.rows) + o;
+                            for (int r = 0; r < rowEnd; ++r) {
+                                z[r] = (dots[r] + bias[r]) * layer.scales[o + r];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    const QuantizedLayer& last = this->layers.back();
+    this->output.resize(batch, last.outputs);
+#pragma omp parallel for
+    for (int n = 0; n < batch; ++n) {
+        const float* z = this->logits.data() + (n * last.rows);
+        float maxVal = *std::max_element(z, z + last.outputs);
+        float sum = 0;
+        for (int o = 0; o < last.outputs; ++o) {
+            sum += std::exp(z[o] - maxVal);
+        }
+        for (int o = 0; o < last.outputs; ++o) {
+            this->output.setValue(n, o, std::exp(z[o] - maxVal) / sum);
+        }
+    }
+    return this->output;
+}
+
+template <typename T>
+QuantizedNetwork::Report
+QuantizedNetwork::compare(const NeuralNetwork<T>& model,
+                          std::type_identity_t<MatrixView<const T>> samples,
+                          std::type_identity_t<MatrixView<const T>> labels, int batchSize) {
+    Report report = {};
+    int floatHits = 0, quantizedHits = 0, agreed = 0;
+    int count = samples.getWidth();
+    typename NeuralNetwork<T>::Scratch scratch = model.makeScratch(batchSize);
+    for (int first = 0; first < count; first += batchSize) {
+        int size = std::min(batchSize, count - first);
+        MatrixView<const T> batch = samples.columns(first, size);
+        auto start = std::chrono::steady_clock::now();
+        const Matrix<T>& fp = model.infer(batch, scratch);
+        auto middle = std::chrono::steady_clock::now();
+        const Matrix<float>& q = this->foward(batch);
+        auto end = std::chrono::steady_clock::now();
+        report.floatSeconds += std::chrono::duration<double>(middle - start).count();
+        report.quantizedSeconds += std::chrono::duration<double>(end - middle).count();
+
+        for (int n = 0; n < size; ++n) {
+            int label = column_argmax(labels, first + n);
+            int fpClass = column_argmax(fp, n);
+            int qClass = column_argmax(q, n);
+            floatHits += fpClass == label;
+            quantizedHits += qClass == label;
+            agreed += fpClass == qClass;
+            for (int o = 0; o < fp.getHeight(); ++o) {
+                report.maxProbabilityError =
+                    std::max(report.maxProbabilityError,
+                             static_cast<double>(std::abs(fp.getValue(n, o) - q.getValue(n, o))));
+            }
+        }
+    }
+    report.floatAccuracy = 100.0 * floatHits / count;
+    report.quantizedAccuracy = 100.0 * quantizedHits / count;
+    report.agreement = 100.0 * agreed / count;
+    return report;
+}
+
+size_t QuantizedNetwork::weightBytes() const {
+    size_t bytes = 0;
+    for (const QuantizedLayer& layer : this->layers) {
+        bytes += layer.inputs * layer.outputs; // int8 weights
+        bytes += layer.outputs * (sizeof(float) + sizeof(int32_t));
+    }
+    return bytes;
+}
+
+void QuantizedNetwork::save(std::string path) {
+    std::ofstream file(path.c_str(), std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Couldnt create file" << std::endl;
+        return;
+    }
+    size_t layerCount = this->layers.size();
+    file.write(reinterpret_cast<const char*>(&MAGIC), sizeof(MAGIC));
+    file.write(reinterpret_cast<const char*>(&layerCount), sizeof(layerCount));
+    for (const QuantizedLayer& layer : this->layers) {
+        file.write(reinterpret_cast<const char*>(&layer.inputs), sizeof(layer.inputs));
+        file.write(reinterpret_cast<const char*>(&layer.outputs), sizeof(layer.outputs));
+        file.write(reinterpret_cast<const char*>(&layer.relu), sizeof(layer.relu));
+        file.write(reinterpret_cast<const char*>(&layer.inputScale), sizeof(layer.inputScale));
+        file.write(reinterpret_cast<const char*>(&layer.inputOffset), sizeof(layer.inputOffset));
+        file.write(reinterpret_cast<const char*>(layer.scales.data()),
+                   layer.outputs * sizeof(float));
+        if (layer.relu) {
+            file.write(reinterpret_cast<const char*>(layer.requant.data()),
+                       layer.outputs * sizeof(float));
+        }
+        file.write(reinterpret_cast<const char*>(layer.biases.data()),
+                   layer.outputs * sizeof(int32_t));
+        // Weights go to disk row by row, unpacked, so the file doesn't depend on the tile size
+        std::vector<int8_t> row(layer.inputs);
+        for (int o = 0; o < layer.outputs; ++o) {
+            for (int k = 0; k < layer.inputs; ++k) {
+                row[k] = layer.weights[packedIndex(layer.stride, o, k)];
+            }
+            file.write(reinterpret_cast<const char*>(row.data()), layer.inputs);
+        }
+    }
+    file.close();
+}
+
+bool QuantizedNetwork::load(std::string path) {
+    std::ifstream file(path.c_str(), std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Couldnt open file" << std::endl;
+        return false;
+    }
+    std::error_code error;
+    size_t fileBytes = std::filesystem::file_size(path, error);
+    uint32_t magic = 0;
+    size_t layerCount = 0;
+    file.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+    file.read(reinterpret_cast<char*>(&layerCount), sizeof(layerCount));
+    if (magic != MAGIC || !file || error) {
+        std::cerr << "Not a quantized model file" << std::endl;
+        return false;
+    }
+    this->layers.clear();
+    this->inputs.clear();
+    size_t read = sizeof(magic) + sizeof(layerCount);
+    if (layerCount == 0 || layerCount > (fileBytes - read) / LAYER_HEADER_BYTES) {
+        std::cerr << "Quantized model file claims " << layerCount << " layers" << std::endl;
+        return false;
+    }
+    for (size_t l = 0; l < layerCount; ++l) {
+        QuantizedLayer layer;
+        uint8_t relu = 0;
+        file.read(reinterpret_cast<char*>(&layer.inputs), sizeof(layer.inputs));
+        file.read(reinterpret_cast<char*>(&layer.outputs), sizeof(layer.outputs));
+        file.read(reinterpret_cast<char*>(&relu), sizeof(layer.relu));
+        file.read(reinterpret_cast<char*>(&layer.inputScale), sizeof(layer.inputScale));
+        file.read(reinterpret_cast<char*>(&layer.inputOffset), sizeof(layer.inputOffset));
+        read += LAYER_HEADER_BYTES;
+        layer.relu = relu == 1;
+        // Only the network input has a zero point, it keeps some of the 127 levels each way
+        int maxOffset = l == 0 ? 127 : 0;
+        if (!file || layer.inputs <= 0 || layer.outputs <= 0 || relu > 1 ||
+            !positive_finite(layer.inputScale) || layer.inputOffset < 0 ||
+            layer.inputOffset > maxOffset) {
+            std::cerr << "Error reading quantized layer" << std::endl;
+            this->layers.clear();
+            return false;
+        }
+        // Each layer takes the outputs of the one before, and all but the last apply relu, which
+        // run relies on to size and index the activations between them
+        if (l > 0 && layer.inputs != this->layers.back().outputs) {
+            std::cerr << "Quantized layer " << l << " doesnt take the outputs of the one before"
+                      << std::endl;
+            this->layers.clear();
+            return false;
+        }
+        if (layer.relu != (l + 1 < layerCount)) {
+            std::cerr << "Quantized layer " << l << " has the wrong activation" << std::endl;
+            this->layers.clear();
+            return false;
+        }
+        size_t tensorBytes = static_cast<size_t>(layer.outputs) *
+                             ((layer.relu ? 2 : 1) * sizeof(float) + sizeof(int32_t) +
+                              static_cast<size_t>(layer.inputs));
+        if (tensorBytes > fileBytes - read) {
+            std::cerr << "Quantized model file is truncated" << std::endl;
+            this->layers.clear();
+            return false;
+        }
+        read += tensorBytes;
+        this->allocate(layer);
+        file.read(reinterpret_cast<char*>(layer.scales.data()), layer.outputs * sizeof(float));
+        if (layer.relu) {
+            file.read(reinterpret_cast<char*>(layer.requant.data()),
+                      layer.outputs * sizeof(float));
+        }
+        file.read(reinterpret_cast<char*>(layer.biases.data()), layer.outputs * sizeof(int32_t));
+        for (int o = 0; o < layer.outputs; ++o) {
+            if (!positive_finite(layer.scales[o]) ||
+                (layer.relu && !positive_finite(layer.requant[o]))) {
+                std::cerr << "Quantized layer " << l << " has a broken scale" << std::endl;
+                this->layers.clear();
+                return false;
+            }
+        }
+        std::vector<int8_t> row(layer.inputs);
+        for (int o = 0; o < layer.outputs; ++o) {
+            file.read(reinterpret_cast<char*>(row.data()), layer.inputs);
+            for (int k = 0; k < layer.inputs; ++k) {
+                layer.weights[packedIndex(layer.stride, o, k)] = row[k];
+            }
+        }
+        this->layers.push_back(std::move(layer));
+    }
+    if (!file) {
+        std::cerr << "Quantized model file is truncated" << std::endl;
+        this->layers.clear();
+        return false;
+    }
+    file.close();
+    return true;
+}
+
+template QuantizedNetwork::QuantizedNetwork(const NeuralNetwork<float>&, MatrixView<const float>);
+template QuantizedNetwork::QuantizedNetwork(const NeuralNetwork<double>&, MatrixView<const double>);
+template QuantizedNetwork::Report QuantizedNetwork::compare(const NeuralNetwork<float>&,
+                                                            MatrixView<const float>,
+                                                            MatrixView<const float>, int);
+template QuantizedNetwork::Report QuantizedNetwork::compare(const NeuralNetwork<double>&,
+                                                            MatrixView<const double>,
+                                                            MatrixView<const double>, int);
@@ -0,0 +1,141 @@
+#include "../include/RingAllreduce.hpp"
+#include <algorithm>
+#include <stdexcept>
+
+// Bytes a broadcast forwards at a time, so later ranks start receiving before rank 0 is done
+static constexpr size_t BROADCAST_PIECE = 1 << 18;
+
+template <typename T>
+RingAllreduce<T>::RingAllreduce(std::shared_ptr<Transport> transport, std::vector<Layer<T>>& layers)
+    : transport(std::move(transport)) {
+    if (!this->transport) {
+        throw std::invalid_argument("Allreduce needs a transport");
+    }
+    size_t count = 0;
+    for (Layer<T>& layer : layers) {
+        layer.reserve(layer.getGradients());
+        count += layer.getGradients().dW.getValuesVector().size();
+        count += layer.getGradients().db.getValuesVector().size();
+    }
+    this->values.resize(count);
+    this->incoming.resize((count / this->getWorldSize()) + 1);
+}
+
+template <typename T> int RingAllreduce<T>::getRank() const {
+    return this->transport->getRank();
+}
+
+template <typename T> int RingAllreduce<T>::getWorldSize() const {
+    return this->transport->getWorldSize();
+}
+
+template <typename T> void RingAllreduce<T>::sum(T* values, size_t count) {
+    int n = this->getWorldSize();
+    int rank = this->getRank();
+    if (n == 1 || count == 0) {
+        return;
+    }
+    if (this->incoming.size() < (count / n) + 1) {
+        this->incoming.resize((count / n) + 1);
+    }
+    auto begin = [&](int chunk) { return (count * chunk) / n; };
+    auto size = [&](int chunk) { return begin(chunk + 1) - begin(chunk); };
+
+    // Step s passes on chunk rank - s and adds the previous rank's partial sum of rank - s - 1
+    for (int s = 0; s < n - 1; ++s) {
+        int out = (rank - s + n) % n;
+        int in = (rank - s - 1 + n) % n;
+        this->transport->exchange(values + begin(out), size(out) * sizeof(T),
+                                  this->incoming.data(), size(in) * sizeof(T));
+        T* target = values + begin(in);
+        const T* partial = this->incoming.data();
+        size_t length = size(in);
+#pragma omp simd
+        for (size_t i = 0; i < length; ++i) {
+            target[i] += partial[i];
+        }
+    }
+    // Chunk rank + 1 is complete here, step s passes on the one completed s steps ago
+    for (int s = 0; s < n - 1; ++s) {
+        int out = (rank + 1 - s + n) % n;
+        int in = (rank - s + n) % n;
+        this->transport->exchange(values + begin(out), size(out) * sizeof(T), values + begin(in),
+                                  size(in) * sizeof(T));
+    }
+}
+
+template <typename T> void RingAllreduce<T>::broadcast(void* data, size_t bytes) {
+    int n = this->getWorldSize();
+    int rank = this->getRank();
+    unsigned char* values = static_cast<unsigned char*>(data);
+    for (size_t first = 0; first < bytes; first += BROADCAST_PIECE) {
+        size_t piece = std::min(BROADCAST_PIECE, bytes - first);
+        if (rank != 0) {
+            this->transport->exchange(nullptr, 0, values + first, piece);
+        }
+        if (rank != n - 1) {
+            this->transport->exchange(values + first, piece, nullptr, 0);
+        }
+    }
+}
+
+template <typename T> void RingAllreduce<T>::averageGradients(std::vector<Layer<T>>& layers) {
+    if (this->getWorldSize() == 1) {
+        return;
+    }
+    // One allreduce over every gradient, a message per layer would pay the ring latency each time
+    T* packed = this->values.data();
+    for (Layer<T>& layer : layers) {
+        typename Layer<T>::Gradients& gradients = layer.getGradients();
+        packed = std::copy_n(gradients.dW.data(), gradients.dW.getValuesVector().size(), packed);
+        packed = std::copy_n(gradients.db.data(), gradients.db.getValuesVector().size(), packed);
+    }
+    this->sum(this->values.data(), this->values.size());
+
+    const T scale = static_cast<T>(1) / this->getWorldSize();
+    const T* summed = this->values.data();
+    for (Layer<T>& layer : layers) {
+        typename Layer<T>::Gradients& gradients = layer.getGradients();
+        for (Matrix<T>* part : {&gradients.dW, &gradients.db}) {
+            T* out = part->data();
+            size_t count = part->getValuesVector().size();
+#pragma omp simd
+            for (size_t i = 0; i < count; ++i) {
+                out[i] = summed[i] * scale;
+            }
+            summed += count;
+        }
+    }
+}
+
+template <typename T> void RingAllreduce<T>::broadcastParameters(std::vector<Layer<T>>& layers) {
+    if (this->getWorldSize() == 1) {
+        return;
+    }
+    // Weights and biases take as many values as their gradients, the gradient buffer fits them
+    T* packed = this->values.data();
+    for (const Layer<T>& layer : layers) {
+        MatrixView<const T> weights = layer.getWeights();
+        MatrixView<const T> biases = layer.getBiases();
+        packed = std::copy_n(weights.data(), weights.getWidth() * weights.getHeight(), packed);
+        packed = std::copy_n(biases.data(), biases.getHeight(), packed);
+    }
+    this->broadcast(this->values.data(), this->values.size() * sizeof(T));
+    if (this->getRank() == 0) {
+        return;
+    }
+    const T* received = this->values.data();
+    for (Layer<T>& layer : layers) {
+        Matrix<T> weights = layer.getWeights();
+        Matrix<T> biases = layer.getBiases();
+        std::copy_n(received, weights.getValuesVector().size(), weights.data());
+        received += weights.getValuesVector().size();
+        std::copy_n(received, biases.getValuesVector().size(), biases.data());
+        received += biases.getValuesVector().size();
+        layer.setWeights(std::move(weights));
+        layer.setBiases(std::move(biases));
+    }
+}
+
+template class RingAllreduce<float>;
+template class RingAllreduce<double>;
@@ -0,0 +1,344 @@
+#include "../include/ShardedDataset.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static constexpr char SHARD_MAGIC[8] = "NNSHARD";
+static constexpr uint32_t SHARD_VERSION = 1;
+static constexpr size_t SHARD_ALIGNMENT = 64;
+
+struct ShardHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t featureBytes; // 1 for bytes, 4 for float, 8 for double
+    uint64_t samples;
+    uint32_t featureCount;
+    uint32_t targetCount;
+    double byteScale;
+    char reserved[24];
+};
+static_assert(sizeof(ShardHeader) == SHARD_ALIGNMENT, "Shard data starts one block in");
+
+static std::string shard_path(const std::string& prefix, size_t shard) {
+    char number[16];
+    std::snprintf(number, sizeof(number), "-%05zu", shard);
+    return prefix + number + ".shard";
+}
+
+static size_t align_up(size_t bytes) {
+    return (bytes + SHARD_ALIGNMENT - 1) / SHARD_ALIGNMENT * SHARD_ALIGNMENT;
+}
+
+// Bytes of samples rows of width values, scalar bytes each, false when the product overflows, as it
+// can for a damaged header
+static bool block_bytes(uint64_t samples, uint64_t width, uint64_t scalar, uint64_t& bytes) {
+    return !__builtin_mul_overflow(samples, width, &bytes) &&
+           !__builtin_mul_overflow(bytes, scalar, &bytes);
+}
+
+static void pad(std::ofstream& file) {
+    static const char zeros[SHARD_ALIGNMENT] = {};
+    size_t written = file.tellp();
+    file.write(zeros, align_up(written) - written);
+}
+
+template <typename T> ShardedDataset<T>::ShardedDataset() {
+    this->featureCount = 0;
+    this->targetCount = 0;
+    this->sampleCount = 0;
+    this->shuffleBuffer = 0;
+}
+
+template <typename T> ShardedDataset<T>::ShardedDataset(std::string prefix, size_t shuffleBuffer) {
+    this->featureCount = 0;
+    this->targetCount = 0;
+    this->sampleCount = 0;
+    this->shuffleBuffer = shuffleBuffer;
+    for (size_t i = 0;; ++i) {
+        std::string path = shard_path(prefix, i);
+        if (!std::filesystem::exists(path)) {
+            break;
+        }
+        std::ifstream file(path, std::ios::binary);
+        ShardHeader header;
+        if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+            std::memcmp(header.magic, SHARD_MAGIC, sizeof(SHARD_MAGIC)) != 0 ||
+            header.version != SHARD_VERSION) {
+            std::cerr << "Couldnt read shard " << path << std::endl;
+            *this = ShardedDataset();
+            return;
+        }
+        if (header.featureCount == 0 || header.featureCount > INT32_MAX ||
+            header.targetCount == 0 || header.targetCount > INT32_MAX) {
+            std::cerr << "Shard " << path << " is damaged" << std::endl;
+            *this = ShardedDataset();
+            return;
+        }
+        if (i == 0) {
+            this->featureCount = header.featureCount;
+            this->targetCount = header.targetCount;
+        }
+        Shard shard;
+        shard.path = path;
+        shard.samples = header.samples;
+        shard.featureBytes = header.featureBytes;
+        shard.byteScale = header.byteScale;
+        shard.featuresOffset = sizeof(ShardHeader);
+        shard.fileBytes = std::filesystem::file_size(path);
+        // Each size is checked against the file before the next is built on it, so none can wrap
+        uint64_t featureBytes, targetBytes;
+        bool sized =
+            block_bytes(shard.samples, header.featureCount, shard.featureBytes, featureBytes) &&
+            featureBytes <= shard.fileBytes &&
+            block_bytes(shard.samples, header.targetCount, sizeof(float), targetBytes) &&
+            targetBytes <= shard.fileBytes;
+        shard.targetsOffset = shard.featuresOffset + (sized ? align_up(featureBytes) : 0);
+        sized = sized && shard.targetsOffset + targetBytes <= shard.fileBytes;
+        bool known = shard.featureBytes == 1 || shard.featureBytes == sizeof(float) ||
+                     shard.featureBytes == sizeof(double);
+        if (static_cast<int>(header.featureCount) != this->featureCount ||
+            static_cast<int>(header.targetCount) != this->targetCount || !known || !sized) {
+            std::cerr << "Shard " << path << " doesn't match the others" << std::endl;
+            *this = ShardedDataset();
+            return;
+        }
+        this->sampleCount += shard.samples;
+        this->shards.push_back(std::move(shard));
+    }
+    if (this->shards.empty()) {
+        std::cerr << "Couldnt find shards at " << prefix << std::endl;
+    }
+}
+
+template <typename T>
+std::vector<std::string> ShardedDataset<T>::write(const Dataset<T>& data,
+                                                  const std::vector<int>& order,
+                                                  std::string prefix, size_t samplesPerShard) {
+    if (samplesPerShard == 0) {
+        throw std::invalid_argument("Shards need at least one sample");
+    }
+    size_t featureCount = data.getFeatureCount();
+    size_t targetCount = data.getTargetCount();
+    uint32_t featureBytes = data.hasByteFeatures() ? 1 : sizeof(T);
+    std::vector<float> target(targetCount);
+    std::vector<std::string> paths;
+    for (size_t first = 0; first < order.size(); first += samplesPerShard) {
+        size_t samples = std::min(samplesPerShard, order.size() - first);
+        std::string path = shard_path(prefix, paths.size());
+        std::ofstream file(path, std::ios::binary);
+        if (!file.is_open()) {
+            std::cerr << "Couldnt create file " << path << std::endl;
+            return {};
+        }
+        ShardHeader header = {};
+        std::memcpy(header.magic, SHARD_MAGIC, sizeof(SHARD_MAGIC));
+        header.version = SHARD_VERSION;
+        header.featureBytes = featureBytes;
+        header.samples = samples;
+        header.featureCount = featureCount;
+        header.targetCount = targetCount;
+        header.byteScale = data.getByteScale();
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (size_t i = first; i < first + samples; ++i) {
+            const void* row = data.hasByteFeatures()
+                                  ? static_cast<const void*>(data.bytesOf(order[i]))
+                                  : static_cast<const void*>(data.featuresOf(order[i]));
+            file.write(static_cast<const char*>(row), featureCount * featureBytes);
+        }
+        pad(file);
+        for (size_t i = first; i < first + samples; ++i) {
+            std::copy_n(data.targetOf(order[i]), targetCount, target.data());
+            file.write(reinterpret_cast<const char*>(target.data()), targetCount * sizeof(float));
+        }
+        if (!file) {
+            std::cerr << "Couldnt write shard " << path << std::endl;
+            return {};
+        }
+        paths.push_back(path);
+    }
+    // Shards left over from a bigger dataset written to the same prefix would be read back with it
+    for (size_t i = paths.size(); std::filesystem::exists(shard_path(prefix, i)); ++i) {
+        std::filesystem::remove(shard_path(prefix, i));
+    }
+    return paths;
+}
+
+template <typename T> size_t ShardedDataset<T>::size() const {
+    return this->sampleCount;
+}
+
+template <typename T> int ShardedDataset<T>::getFeatureCount() const {
+    return this->featureCount;
+}
+
+template <typename T> int ShardedDataset<T>::getTargetCount() const {
+    return this->targetCount;
+}
+
+template <typename T> int ShardedDataset<T>::shardCount() const {
+    return this->shards.size();
+}
+
+template <typename T> size_t ShardedDataset<T>::shardSize(int shard) const {
+    return this->shards[shard].samples;
+}
+
+template <typename T> size_t ShardedDataset<T>::getShuffleBuffer() const {
+    return this->shuffleBuffer;
+}
+
+template <typename T>
+ShardedDataset<T>::Stream::Stream(const ShardedDataset& data, size_t shuffleBuffer)
+    : data(data), rangeIt(0), position(0), mappedShard(-1), mapped(nullptr), mappedBytes(0),
+      capacity(shuffleBuffer), buffered(0) {
+    this->bufferFeatures.resize(shuffleBuffer * data.featureCount);
+    this->bufferTargets.resize(shuffleBuffer * data.targetCount);
+}
+
+template <typename T> ShardedDataset<T>::Stream::~Stream() {
+    this->unmap();
+}
+
+template <typename T>
+void ShardedDataset<T>::Stream::reset(std::vector<Range> ranges, unsigned int seed) {
+    this->ranges = std::move(ranges);
+    this->rangeIt = 0;
+    this->position = this->ranges.empty() ? 0 : this->ranges[0].first;
+    this->buffered = 0;
+    this->generator.seed(seed);
+    if (!this->ranges.empty() && this->ranges[0].shard != this->mappedShard) {
+        this->unmap();
+    }
+}
+
+template <typename T> void ShardedDataset<T>::Stream::unmap() {
+    if (this->mapped) {
+        munmap(const_cast<unsigned char*>(this->mapped), this->mappedBytes);
+    }
+    this->mapped = nullptr;
+    this->mappedBytes = 0;
+    this->mappedShard = -1;
+}
+
+template <typename T> void ShardedDataset<T>::Stream::map(int shard) {
+    // Pages of a finished shard leave this process with its mapping, the page cache keeps them
+    // only while memory is free
+    this->unmap();
+    const Shard& file = this->data.shards[shard];
+    int fd = open(file.path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Couldnt open shard " + file.path);
+    }
+    void* mapping = mmap(nullptr, file.fileBytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        throw std::runtime_error("Couldnt map shard " + file.path);
+    }
+    madvise(mapping, file.fileBytes, MADV_SEQUENTIAL);
+    this->mapped = static_cast<const unsigned char*>(mapping);
+    this->mappedBytes = file.fileBytes;
+    this->mappedShard = shard;
+    this->readAhead();
+}
+
+template <typename T> void ShardedDataset<T>::Stream::readAhead() {
+    // The kernel starts reading the next shard while this one is trained on
+    for (size_t i = this->rangeIt + 1; i < this->ranges.size(); ++i) {
+        if (this->ranges[i].shard != this->mappedShard) {
+            const Shard& next = this->data.shards[this->ranges[i].shard];
+            int fd = open(next.path.c_str(), O_RDONLY);
+            if (fd >= 0) {
+                posix_fadvise(fd, 0, next.fileBytes, POSIX_FADV_WILLNEED);
+                close(fd);
+            }
+            return;
+        }
+    }
+}
+
+template <typename T> bool ShardedDataset<T>::Stream::read(T* features, T* target) {
+    while (this->rangeIt < this->ranges.size() &&
+           this->position >= this->ranges[this->rangeIt].end) {
+        if (++this->rangeIt < this->ranges.size()) {
+            this->position = this->ranges[this->rangeIt].first;
+        }
+    }
+    if (this->rangeIt >= this->ranges.size()) {
+        return false;
+    }
+    int shardIt = this->ranges[this->rangeIt].shard;
+    if (shardIt != this->mappedShard) {
+        this->map(shardIt);
+    }
+    const Shard& shard = this->data.shards[shardIt];
+    int count = this->data.featureCount;
+    const unsigned char* row =
+        this->mapped + shard.featuresOffset + (this->position * count * shard.featureBytes);
+    if (shard.featureBytes == 1) {
+        const T scale = shard.byteScale;
+#pragma omp simd
+        for (int i = 0; i < count; ++i) {
+            features[i] = row[i] * scale;
+        }
+    } else if (shard.featureBytes == sizeof(float)) {
+        std::copy_n(reinterpret_cast<const float*>(row), count, features);
+    } else {
+        std::copy_n(reinterpret_cast<const double*>(row), count, features);
+    }
+    const float* targets = reinterpret_cast<const float*>(this->mapped + shard.targetsOffset);
+    std::copy_n(targets + (this->position * this->data.targetCount), this->data.targetCount,
+                target);
+    this->position++;
+    return true;
+}
+
+template <typename T> bool ShardedDataset<T>::Stream::next(T* features, T* target) {
+    if (this->capacity == 0) {
+        return this->read(features, target);
+    }
+    int featureCount = this->data.featureCount;
+    int targetCount = this->data.targetCount;
+    while (this->buffered < this->capacity &&
+           this->read(this->bufferFeatures.data() + (this->buffered * featureCount),
+                      this->bufferTargets.data() + (this->buffered * targetCount))) {
+        this->buffered++;
+    }
+    if (this->buffered == 0) {
+        return false;
+    }
+    // The pick is handed out and the last buffered sample takes its place
+    size_t pick = std::uniform_int_distribution<size_t>(0, this->buffered - 1)(this->generator);
+    size_t last = --this->buffered;
+    T* pickFeatures = this->bufferFeatures.data() + (pick * featureCount);
+    T* pickTarget = this->bufferTargets.data() + (pick * targetCount);
+    std::copy_n(pickFeatures, featureCount, features);
+    std::copy_n(pickTarget, targetCount, target);
+    if (pick != last) {
+        std::copy_n(this->bufferFeatures.data() + (last * featureCount), featureCount,
+                    pickFeatures);
+        std::copy_n(this->bufferTargets.data() + (last * targetCount), targetCount, pickTarget);
+    }
+    return true;
+}
+
+template <typename T> size_t ShardedDataset<T>::Stream::skip(size_t samples) {
+    // Drawn like any other sample so the shuffle buffer ends up as it would have
+    std::vector<T> features(this->data.featureCount);
+    std::vector<T> target(this->data.targetCount);
+    size_t skipped = 0;
+    while (skipped < samples && this->next(features.data(), target.data())) {
+        skipped++;
+    }
+    return skipped;
+}
+
+template class ShardedDataset<float>;
+template class ShardedDataset<double>;
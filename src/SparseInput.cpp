@@ -0,0 +1,379 @@
+#include "../include/SparseInput.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SPARSE_X86
+#endif
+
+// Output columns one row accumulates at a time, 512 bytes so the running sums fill eight AVX-512
+// registers
+template <typename T> static constexpr int SLICE = 512 / sizeof(T);
+
+// The compacted weight gradient still writes all of dW and pays for gathering the input, so it only
+// runs when the batch leaves at least this fraction of the features unused
+static constexpr double UNUSED_FEATURES = 0.5;
+
+// Below this many multiply-adds the OpenMP fork costs more than it saves
+static constexpr size_t PARALLEL_THRESHOLD = 64 * 64 * 64;
+
+// sums = sum over the count entries of values[p] * row index[p] of the panel
+template <typename T> using RowKernel = void (*)(const int* index, const T* values, int count,
+                                                 const T* panel, T* sums);
+
+template <typename T>
+static void rowsGeneric(const int* index, const T* values, int count, const T* panel, T* sums) {
+    std::fill_n(sums, SLICE<T>, static_cast<T>(0));
+    for (int p = 0; p < count; ++p) {
+        const T value = values[p];
+        const T* row = panel + (index[p] * SLICE<T>);
+        for (int j = 0; j < SLICE<T>; ++j) {
+            sums[j] += value * row[j];
+        }
+    }
+}
+
+#ifdef SPARSE_X86
+// AVX2 has half the register width, so the slice is summed as two halves of eight registers
+__attribute__((target("avx2,fma"))) static void rowsAvx2(const int* index, const double* values,
+                                                          int count, const double* panel,
+                                                          double* sums) {
+    for (int half = 0; half < 2; ++half) {
+        __m256d acc[8];
+#pragma GCC unroll 8
+        for (int i = 0; i < 8; ++i) {
+            acc[i] = _mm256_setzero_pd();
+        }
+        const double* base = panel + (half * 32);
+        for (int p = 0; p < count; ++p) {
+            __m256d value = _mm256_broadcast_sd(values + p);
+            const double* row = base + (index[p] * 64);
+#pragma GCC unroll 8
+            for (int i = 0; i < 8; ++i) {
+                acc[i] = _mm256_fmadd_pd(value, _mm256_loadu_pd(row + (i * 4)), acc[i]);
+            }
+        }
+#pragma GCC unroll 8
+        for (int i = 0; i < 8; ++i) {
+            _mm256_storeu_pd(sums + (half * 32) + (i * 4), acc[i]);
+        }
+    }
+}
+
+__attribute__((target("avx2,fma"))) static void rowsAvx2(const int* index, const float* values,
+                                                          int count, const float* panel,
+                                                          float* sums) {
+    for (int half = 0; half < 2; ++half) {
+        __m256 acc[8];
+#pragma GCC unroll 8
+        for (int i = 0; i < 8; ++i) {
+            acc[i] = _mm256_setzero_ps();
+        }
+        const float* base = panel + (half * 64);
+        for (int p = 0; p < count; ++p) {
+            __m256 value = _mm256_broadcast_ss(values + p);
+            const float* row = base + (index[p] * 128);
+#pragma GCC unroll 8
+            for (int i = 0; i < 8; ++i) {
+                acc[i] = _mm256_fmadd_ps(value, _mm256_loadu_ps(row + (i * 8)), acc[i]);
+            }
+        }
+#pragma GCC unroll 8
+        for (int i = 0; i < 8; ++i) {
+            _mm256_storeu_ps(sums + (half * 64) + (i * 8), acc[i]);
+        }
+    }
+}
+
+__attribute__((target("avx512f"))) static void rowsAvx512(const int* index, const double* values,
+                                                         int count, const double* panel,
+                                                         double* sums) {
+    __m512d acc[8];
+#pragma GCC unroll 8
+    for (int i = 0; i < 8; ++i) {
+        acc[i] = _mm512_setzero_pd();
+    }
+    for (int p = 0; p < count; ++p) {
+        __m512d value = _mm512_set1_pd(values[p]);
+        const double* row = panel + (index[p] * 64);
+#pragma GCC unroll 8
+        for (int i = 0; i < 8; ++i) {
+            acc[i] = _mm512_fmadd_pd(value, _mm512_loadu_pd(row + (i * 8)), acc[i]);
+        }
+    }
+#pragma GCC unroll 8
+    for (int i = 0; i < 8; ++i) {
+        _mm512_storeu_pd(sums + (i * 8), acc[i]);
+    }
+}
+
+__attribute__((target("avx512f"))) static void rowsAvx512(const int* index, const float* values,
+                                                         int count, const float* panel,
+                                                         float* sums) {
+    __m512 acc[8];
+#pragma GCC unroll 8
+    for (int i = 0; i < 8; ++i) {
+        acc[i] = _mm512_setzero_ps();
+    }
+    for (int p = 0; p < count; ++p) {
+        __m512 value = _mm512_set1_ps(values[p]);
+        const float* row = panel + (index[p] * 128);
+#pragma GCC unroll 8
+        for (int i = 0; i < 8; ++i) {
+            acc[i] = _mm512_fmadd_ps(value, _mm512_loadu_ps(row + (i * 16)), acc[i]);
+        }
+    }
+#pragma GCC unroll 8
+    for (int i = 0; i < 8; ++i) {
+        _mm512_storeu_ps(sums + (i * 16), acc[i]);
+    }
+}
+#endif
+
+// Follows NN_GEMM_ISA like the dense kernels
+template <typename T> static RowKernel<T> detectKernel() {
+    const char* forced = std::getenv("NN_GEMM_ISA");
+    std::string name(forced != nullptr ? forced : "");
+    if (name == "reference" || name == "generic") {
+        return rowsGeneric<T>;
+    }
+#ifdef SPARSE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && name != "avx2") {
+        return rowsAvx512;
+    } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return rowsAvx2;
+    }
+#endif
+    return rowsGeneric<T>;
+}
+
+template <typename T> static RowKernel<T> rowKernel() {
+    static const RowKernel<T> kernel = detectKernel<T>();
+    return kernel;
+}
+
+// Row r of the sum over its entries of values[p] * row index[p] of the packed operand is written
+// as column r of out, which has one row per output
+template <typename T, typename Indices, typename Values>
+static void sparse_product(const Indices& starts, const Indices& index, const Values& values,
+                           const T* packed, int panelRows, int outputs, T* out, bool accumulate) {
+    int rows = starts.size() - 1;
+    int slices = (outputs + SLICE<T> - 1) / SLICE<T>;
+    RowKernel<T> kernel = rowKernel<T>();
+    bool parallel = values.size() * outputs > PARALLEL_THRESHOLD;
+#pragma omp parallel for collapse(2) schedule(static) if (parallel)
+    for (int s = 0; s < slices; ++s) {
+        for (int r = 0; r < rows; ++r) {
+            alignas(64) T sums[SLICE<T>];
+            kernel(index.data() + starts[r], values.data() + starts[r], starts[r + 1] - starts[r],
+                   packed + (s * panelRows * SLICE<T>), sums);
+            int first = s * SLICE<T>;
+            int count = std::min(SLICE<T>, outputs - first);
+            T* dst = out + (first * rows) + r;
+            for (int j = 0; j < count; ++j) {
+                dst[j * rows] = accumulate ? dst[j * rows] + sums[j] : sums[j];
+            }
+        }
+    }
+}
+
+template <typename T> SparseInput<T>::SparseInput() {
+    this->active = false;
+    this->features = 0;
+    this->samples = 0;
+}
+
+template <typename T> int SparseInput<T>::panelWidth() {
+    return SLICE<T>;
+}
+
+template <typename T> void SparseInput<T>::pack(MatrixView<const T> weights, Matrix<T>& packed) {
+    int rows = weights.getHeight();
+    int cols = weights.getWidth();
+    int slices = (rows + SLICE<T> - 1) / SLICE<T>;
+    packed.resize(SLICE<T>, slices * cols);
+    T* out = packed.data();
+    const T* in = weights.data();
+    size_t rowStride = weights.getRowStride();
+    size_t colStride = weights.getColStride();
+    // Blocks of 16 columns so both the reads along a weight row and the writes into the panel rows
+    // stay within a few cache lines
+    bool parallel = static_cast<size_t>(rows) * cols > PARALLEL_THRESHOLD;
+#pragma omp parallel for collapse(2) schedule(static) if (parallel)
+    for (int s = 0; s < slices; ++s) {
+        for (int block = 0; block < cols; block += 16) {
+            int end = std::min(block + 16, cols);
+            for (int j = 0; j < SLICE<T>; ++j) {
+                int row = (s * SLICE<T>) + j;
+                T* panel = out + ((s * cols) * SLICE<T>) + j;
+                if (row >= rows) {
+                    for (int c = block; c < end; ++c) {
+                        panel[c * SLICE<T>] = 0;
+                    }
+                    continue;
+                }
+                const T* source = in + (row * rowStride);
+                for (int c = block; c < end; ++c) {
+                    panel[c * SLICE<T>] = source[c * colStride];
+                }
+            }
+        }
+    }
+}
+
+// Most entries an input build indexes may have
+static size_t max_entries(int features, int samples, double maxDensity) {
+    return maxDensity * features * samples;
+}
+
+template <typename T> bool SparseInput<T>::build(MatrixView<const T> input, double maxDensity) {
+    this->active = false;
+    if (maxDensity <= 0) {
+        return false;
+    }
+    this->input = input;
+    this->features = input.getHeight();
+    this->samples = input.getWidth();
+    size_t limit = max_entries(this->features, this->samples, maxDensity);
+    this->starts.resize(this->samples + 1);
+    this->indices.clear();
+    this->values.clear();
+    this->slots.assign(this->features, -1);
+
+    // Samples are stored feature after feature, so this walks each one contiguously in the usual
+    // batch views
+    for (int n = 0; n < this->samples; ++n) {
+        this->starts[n] = this->indices.size();
+        const T* column = input.data() + (n * input.getColStride());
+        for (int k = 0; k < this->features; ++k) {
+            T value = column[k * input.getRowStride()];
+            if (value != 0) {
+                this->indices.push_back(k);
+                this->values.push_back(value);
+                this->slots[k] = 0;
+            }
+        }
+        if (this->indices.size() > limit) {
+            return false;
+        }
+    }
+    this->starts[this->samples] = this->indices.size();
+
+    this->used.clear();
+    for (int k = 0; k < this->features; ++k) {
+        if (this->slots[k] == 0) {
+            this->slots[k] = this->used.size();
+            this->used.push_back(k);
+        }
+    }
+    this->active = true;
+    return true;
+}
+
+template <typename T>
+void SparseInput<T>::reserve(int features, int samples, int outputs, double maxDensity) {
+    // build notices an input is too dense at the end of the sample that crosses the limit
+    this->starts.reserve(samples + 1);
+    this->indices.reserve(max_entries(features, samples, maxDensity) + features);
+    this->values.reserve(max_entries(features, samples, maxDensity) + features);
+    this->used.reserve(features);
+    this->slots.reserve(features);
+    // The compacted product never has more columns than features, the dense one exactly that many
+    this->compacted.resize(features, samples);
+    this->product.resize(features, outputs);
+    gemmReserve<T>(outputs, features, samples);
+}
+
+template <typename T> bool SparseInput<T>::isActive() const {
+    return this->active;
+}
+
+template <typename T> double SparseInput<T>::density() const {
+    if (this->features == 0 || this->samples == 0) {
+        return 0;
+    }
+    return static_cast<double>(this->values.size()) / (this->features * this->samples);
+}
+
+template <typename T>
+void SparseInput<T>::multiply(MatrixView<const T> packedWeights, int outputs, Matrix<T>& out,
+                              bool accumulate) const {
+    if (!this->active) {
+        throw std::invalid_argument("Sparse product needs an indexed input");
+    }
+    int slices = (outputs + SLICE<T> - 1) / SLICE<T>;
+    if (packedWeights.getHeight() != slices * this->features) {
+        throw std::invalid_argument("Packed weights don't match the input features");
+    }
+    if (accumulate) {
+        if (out.getWidth() != this->samples || out.getHeight() != outputs) {
+            throw std::invalid_argument("Matrix dimensions must match the sparse product");
+        }
+    } else {
+        out.resize(this->samples, outputs);
+    }
+    sparse_product(this->starts, this->indices, this->values, packedWeights.data(),
+                   this->features, outputs, out.data(), accumulate);
+}
+
+template <typename T>
+void SparseInput<T>::multiplyTransposed(MatrixView<const T> deltas, Matrix<T>& out,
+                                        bool accumulate) {
+    if (!this->active) {
+        throw std::invalid_argument("Sparse product needs an indexed input");
+    }
+    if (deltas.getWidth() != this->samples) {
+        throw std::invalid_argument("Deltas width must match the input samples");
+    }
+    int outputs = deltas.getHeight();
+    if (accumulate) {
+        if (out.getWidth() != this->features || out.getHeight() != outputs) {
+            throw std::invalid_argument("Matrix dimensions must match the sparse product");
+        }
+    } else {
+        out.resize(this->features, outputs);
+    }
+    if (this->used.size() > (1 - UNUSED_FEATURES) * this->features) {
+        if (accumulate) {
+            out.addProduct(deltas, this->input, false, true);
+        } else {
+            out.assignProduct(deltas, this->input, false, true);
+        }
+        return;
+    }
+
+    // Only the features some sample uses get a gradient, so the dense product runs over those
+    // columns alone and the rest of out is left (or set to) zero
+    int usedCount = this->used.size();
+    this->compacted.resize(usedCount, this->samples);
+    std::fill_n(this->compacted.data(), usedCount * this->samples, static_cast<T>(0));
+    for (int n = 0; n < this->samples; ++n) {
+        T* row = this->compacted.data() + (n * usedCount);
+        for (int p = this->starts[n]; p < this->starts[n + 1]; ++p) {
+            row[this->slots[this->indices[p]]] = this->values[p];
+        }
+    }
+    if (usedCount > 0) {
+        this->product.assignProduct(deltas, this->compacted);
+    }
+
+    bool parallel = static_cast<size_t>(outputs) * this->features > PARALLEL_THRESHOLD;
+#pragma omp parallel for schedule(static) if (parallel)
+    for (int j = 0; j < outputs; ++j) {
+        T* row = out.data() + (j * this->features);
+        const T* sums = this->product.data() + (j * usedCount);
+        if (!accumulate) {
+            std::fill_n(row, this->features, static_cast<T>(0));
+        }
+        for (int c = 0; c < usedCount; ++c) {
+            row[this->used[c]] += sums[c];
+        }
+    }
+}
+
+template class SparseInput<float>;
+template class SparseInput<double>;
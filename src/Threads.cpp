@@ -0,0 +1,97 @@
+#include "../include/Threads.hpp"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Cores in the affinity mask of the calling thread, so a process started on one NUMA node (or
+// pinned to it by numa_share) splits only that node
+static std::vector<int> available_cores() {
+    std::vector<int> cores;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int core = 0; core < CPU_SETSIZE; ++core) {
+            if (CPU_ISSET(core, &set)) {
+                cores.push_back(core);
+            }
+        }
+    }
+#endif
+    if (cores.empty()) {
+        int count = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+        for (int core = 0; core < count; ++core) {
+            cores.push_back(core);
+        }
+    }
+    return cores;
+}
+
+std::vector<int> core_share(int index, int parts) {
+    std::vector<int> available = available_cores();
+    int cores = available.size();
+    int perPart = std::max(1, cores / parts);
+    std::vector<int> share;
+    for (int c = 0; c < perPart; ++c) {
+        share.push_back(available[((index * perPart) + c) % cores]);
+    }
+    return share;
+}
+
+// Node core lists look like "0-7,16-23"
+std::vector<int> numa_share(int index) {
+    const std::filesystem::path nodes("/sys/devices/system/node");
+    int count = 0;
+    while (std::filesystem::exists(nodes / ("node" + std::to_string(count)))) {
+        ++count;
+    }
+    std::vector<int> cores;
+    if (count == 0) {
+        return cores;
+    }
+    std::ifstream list(nodes / ("node" + std::to_string(index % count)) / "cpulist");
+    std::string range;
+    while (std::getline(list, range, ',')) {
+        int first = 0, last = 0;
+        char dash = 0;
+        std::istringstream parts(range);
+        parts >> first;
+        last = (parts >> dash >> last) ? last : first;
+        for (int core = first; core <= last; ++core) {
+            cores.push_back(core);
+        }
+    }
+    return cores;
+}
+
+void pin_thread(const std::vector<int>& cores) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int core : cores) {
+        CPU_SET(core, &set);
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+#ifdef _OPENMP
+    // Matrix ops inside the thread open their own teams, sized to the cores it owns
+    omp_set_num_threads(cores.size());
+#endif
+}
+
+void wait_for(std::atomic<int>& counter, int value) {
+    int current;
+    while ((current = counter.load()) < value) {
+        counter.wait(current);
+    }
+}
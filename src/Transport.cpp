@@ -0,0 +1,348 @@
+#include "../include/Transport.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <new>
+#include <poll.h>
+#include <signal.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+// How long a rank waits for its neighbours to show up before giving up
+static constexpr std::chrono::seconds RENDEZVOUS_TIMEOUT(120);
+// Empty polls of a shared memory ring before the thread starts yielding
+static constexpr int SPINS = 64;
+// Yields between checks that the peer process is still there
+static constexpr int LIVENESS_INTERVAL = 1 << 14;
+static constexpr uint32_t RING_READY = 0x4e4e5247;
+
+Transport::Transport(int rank, int worldSize) {
+    if (worldSize < 1 || rank < 0 || rank >= worldSize) {
+        throw std::invalid_argument("Rank must be in [0, world size)");
+    }
+    this->rank = rank;
+    this->worldSize = worldSize;
+}
+
+int Transport::getRank() const {
+    return this->rank;
+}
+
+int Transport::getWorldSize() const {
+    return this->worldSize;
+}
+
+static bool process_alive(int pid) {
+    return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+static void wait_for_peer(int& idle, int peer) {
+    if (++idle < SPINS) {
+        return;
+    }
+    std::this_thread::yield();
+    if (idle % LIVENESS_INTERVAL == 0 && !process_alive(peer)) {
+        throw std::runtime_error("Peer rank exited during an exchange");
+    }
+}
+
+// Header of a link segment, the ring's bytes follow it. Only the sender moves head and only the
+// receiver moves tail, each on its own cache line
+struct SharedMemoryTransport::Ring {
+    std::atomic<uint32_t> ready;
+    std::atomic<uint32_t> attached;
+    std::atomic<int> producer; // pids, to notice a peer that died
+    std::atomic<int> consumer;
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+
+    unsigned char* bytes() {
+        return reinterpret_cast<unsigned char*>(this + 1);
+    }
+};
+
+// Copies count bytes in or out of a ring starting at stream position, wrapping at the end
+static void ring_write(unsigned char* ring, size_t capacity, uint64_t position,
+                       const unsigned char* values, size_t count) {
+    size_t offset = position % capacity;
+    size_t first = std::min(count, capacity - offset);
+    std::memcpy(ring + offset, values, first);
+    std::memcpy(ring, values + first, count - first);
+}
+
+static void ring_read(const unsigned char* ring, size_t capacity, uint64_t position,
+                      unsigned char* values, size_t count) {
+    size_t offset = position % capacity;
+    size_t first = std::min(count, capacity - offset);
+    std::memcpy(values, ring + offset, first);
+    std::memcpy(values + first, ring, count - first);
+}
+
+SharedMemoryTransport::SharedMemoryTransport(std::string name, int rank, int worldSize,
+                                             size_t capacity)
+    : Transport(rank, worldSize), outgoing(nullptr), incoming(nullptr), capacity(capacity) {
+    if (capacity == 0) {
+        throw std::invalid_argument("Shared memory rings need a nonzero capacity");
+    }
+    if (worldSize == 1) {
+        return;
+    }
+    size_t bytes = sizeof(Ring) + capacity;
+    auto deadline = std::chrono::steady_clock::now() + RENDEZVOUS_TIMEOUT;
+
+    this->outgoingName = "/" + name + "-" + std::to_string(rank);
+    shm_unlink(this->outgoingName.c_str()); // left behind by a run that crashed
+    int fd = shm_open(this->outgoingName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0 || ftruncate(fd, bytes) != 0) {
+        if (fd >= 0) {
+            close(fd);
+            shm_unlink(this->outgoingName.c_str());
+        }
+        throw std::runtime_error("Couldn't create shared memory segment " + this->outgoingName);
+    }
+    void* memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        shm_unlink(this->outgoingName.c_str());
+        throw std::runtime_error("Couldn't map shared memory segment " + this->outgoingName);
+    }
+    this->outgoing = new (memory) Ring();
+    this->outgoing->producer.store(getpid());
+    this->outgoing->ready.store(RING_READY, std::memory_order_release);
+
+    // A segment of the same name whose producer is gone is from an old run, wait for the new one
+    int previous = (rank + worldSize - 1) % worldSize;
+    std::string incomingName = "/" + name + "-" + std::to_string(previous);
+    while (this->incoming == nullptr) {
+        fd = shm_open(incomingName.c_str(), O_RDWR, 0);
+        struct stat status;
+        if (fd >= 0 && fstat(fd, &status) == 0 && static_cast<size_t>(status.st_size) == bytes) {
+            memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            Ring* ring = static_cast<Ring*>(memory);
+            if (memory != MAP_FAILED &&
+                ring->ready.load(std::memory_order_acquire) == RING_READY &&
+                process_alive(ring->producer.load())) {
+                this->incoming = ring;
+            } else if (memory != MAP_FAILED) {
+                munmap(memory, bytes);
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (this->incoming == nullptr) {
+            if (std::chrono::steady_clock::now() > deadline) {
+                this->release();
+                throw std::runtime_error("Timed out waiting for segment " + incomingName);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    this->incoming->consumer.store(getpid());
+    this->incoming->attached.store(1, std::memory_order_release);
+
+    while (this->outgoing->attached.load(std::memory_order_acquire) == 0) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            this->release();
+            throw std::runtime_error("Timed out waiting for the next rank to attach");
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    // Both ends are mapped, the name is no longer needed
+    shm_unlink(this->outgoingName.c_str());
+    this->outgoingName.clear();
+}
+
+SharedMemoryTransport::~SharedMemoryTransport() {
+    this->release();
+}
+
+void SharedMemoryTransport::release() {
+    size_t bytes = sizeof(Ring) + this->capacity;
+    if (this->outgoing != nullptr) {
+        munmap(this->outgoing, bytes);
+        this->outgoing = nullptr;
+    }
+    if (this->incoming != nullptr) {
+        munmap(this->incoming, bytes);
+        this->incoming = nullptr;
+    }
+    if (!this->outgoingName.empty()) {
+        shm_unlink(this->outgoingName.c_str());
+        this->outgoingName.clear();
+    }
+}
+
+void SharedMemoryTransport::exchange(const void* send, size_t sendBytes, void* receive,
+                                     size_t receiveBytes) {
+    const unsigned char* out = static_cast<const unsigned char*>(send);
+    unsigned char* in = static_cast<unsigned char*>(receive);
+    if (this->getWorldSize() == 1) {
+        std::memcpy(in, out, std::min(sendBytes, receiveBytes));
+        return;
+    }
+    size_t sent = 0, received = 0;
+    int idle = 0;
+    while (sent < sendBytes || received < receiveBytes) {
+        bool progress = false;
+        if (sent < sendBytes) {
+            uint64_t head = this->outgoing->head.load(std::memory_order_relaxed);
+            uint64_t used = head - this->outgoing->tail.load(std::memory_order_acquire);
+            size_t count = std::min<size_t>(this->capacity - used, sendBytes - sent);
+            if (count > 0) {
+                ring_write(this->outgoing->bytes(), this->capacity, head, out + sent, count);
+                this->outgoing->head.store(head + count, std::memory_order_release);
+                sent += count;
+                progress = true;
+            }
+        }
+        if (received < receiveBytes) {
+            uint64_t tail = this->incoming->tail.load(std::memory_order_relaxed);
+            uint64_t available = this->incoming->head.load(std::memory_order_acquire) - tail;
+            size_t count = std::min<size_t>(available, receiveBytes - received);
+            if (count > 0) {
+                ring_read(this->incoming->bytes(), this->capacity, tail, in + received, count);
+                this->incoming->tail.store(tail + count, std::memory_order_release);
+                received += count;
+                progress = true;
+            }
+        }
+        if (progress) {
+            idle = 0;
+        } else {
+            wait_for_peer(idle, sent < sendBytes ? this->outgoing->consumer.load()
+                                                 : this->incoming->producer.load());
+        }
+    }
+}
+
+static sockaddr_un socket_address(const std::string& path) {
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw std::invalid_argument("Socket path is too long: " + path);
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size());
+    return address;
+}
+
+SocketTransport::SocketTransport(std::string path, int rank, int worldSize)
+    : Transport(rank, worldSize), next(-1), previous(-1) {
+    if (worldSize == 1) {
+        return;
+    }
+    auto deadline = std::chrono::steady_clock::now() + RENDEZVOUS_TIMEOUT;
+    this->listenPath = path + "-" + std::to_string(rank) + ".sock";
+    sockaddr_un own = socket_address(this->listenPath);
+    sockaddr_un target = socket_address(path + "-" + std::to_string((rank + 1) % worldSize) +
+                                        ".sock");
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(this->listenPath.c_str()); // left behind by a run that crashed
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&own), sizeof(own)) != 0 ||
+        listen(listener, 1) != 0) {
+        if (listener >= 0) {
+            close(listener);
+        }
+        throw std::runtime_error("Couldn't listen on " + this->listenPath);
+    }
+
+    // Every rank listens before it connects, so the ring closes whatever order ranks start in
+    while (this->next < 0) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&target), sizeof(target)) == 0) {
+            this->next = fd;
+        } else {
+            if (fd >= 0) {
+                close(fd);
+            }
+            if (std::chrono::steady_clock::now() > deadline) {
+                close(listener);
+                this->release();
+                throw std::runtime_error("Timed out connecting to " + std::string(target.sun_path));
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+    pollfd waiting = {listener, POLLIN, 0};
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - std::chrono::steady_clock::now());
+    if (poll(&waiting, 1, std::max<long>(0, left.count())) == 1) {
+        this->previous = accept(listener, nullptr, nullptr);
+    }
+    close(listener);
+    if (this->previous < 0) {
+        this->release();
+        throw std::runtime_error("Timed out waiting for the previous rank to connect");
+    }
+    unlink(this->listenPath.c_str());
+    this->listenPath.clear();
+    fcntl(this->next, F_SETFL, fcntl(this->next, F_GETFL) | O_NONBLOCK);
+    fcntl(this->previous, F_SETFL, fcntl(this->previous, F_GETFL) | O_NONBLOCK);
+}
+
+SocketTransport::~SocketTransport() {
+    this->release();
+}
+
+void SocketTransport::release() {
+    if (this->next >= 0) {
+        close(this->next);
+        this->next = -1;
+    }
+    if (this->previous >= 0) {
+        close(this->previous);
+        this->previous = -1;
+    }
+    if (!this->listenPath.empty()) {
+        unlink(this->listenPath.c_str());
+        this->listenPath.clear();
+    }
+}
+
+void SocketTransport::exchange(const void* send, size_t sendBytes, void* receive,
+                               size_t receiveBytes) {
+    const unsigned char* out = static_cast<const unsigned char*>(send);
+    unsigned char* in = static_cast<unsigned char*>(receive);
+    if (this->getWorldSize() == 1) {
+        std::memcpy(in, out, std::min(sendBytes, receiveBytes));
+        return;
+    }
+    // Both directions are polled together, a rank blocked on a full send would never drain the
+    // rank sending to it
+    size_t sent = 0, received = 0;
+    while (sent < sendBytes || received < receiveBytes) {
+        pollfd fds[2] = {{sent < sendBytes ? this->next : -1, POLLOUT, 0},
+                         {received < receiveBytes ? this->previous : -1, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("Polling the rank connections failed");
+        }
+        if (fds[0].revents != 0) {
+            ssize_t count = ::send(this->next, out + sent, sendBytes - sent, MSG_NOSIGNAL);
+            if (count < 0 && errno != EAGAIN && errno != EINTR) {
+                throw std::runtime_error("Lost the connection to the next rank");
+            }
+            sent += std::max<ssize_t>(0, count);
+        }
+        if (fds[1].revents != 0) {
+            ssize_t count = recv(this->previous, in + received, receiveBytes - received, 0);
+            if (count == 0 || (count < 0 && errno != EAGAIN && errno != EINTR)) {
+                throw std::runtime_error("Lost the connection to the previous rank");
+            }
+            received += std::max<ssize_t>(0, count);
+        }
+    }
+}
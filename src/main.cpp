@@ -1,19 +1,36 @@
 #include "../include/Canvas.hpp"
+#include "../include/InferenceServer.hpp"
 #include "../include/NeuralNetwork.hpp"
+#include "../include/QuantizedNetwork.hpp"
+#include "../include/ShardedDataset.hpp"
+#include "../include/StaticNetwork.hpp"
+#include "../include/Threads.hpp"
+#include "../include/Transport.hpp"
 #include <SDL3/SDL_rect.h>
 #include <SDL3/SDL_render.h>
 #include <SDL3/SDL_video.h>
+#include <algorithm>
+#include <array>
 #include <chrono>
+#include <cmath>
 #include <cstdint>
 #include <cstring>
+#include <filesystem>
 #include <iomanip>
 #include <iostream>
+#ifdef HAVE_MATIO
 #include <matio.h>
+#endif
+#include <memory>
+#include <numeric>
 #include <random>
 #include <string>
 
-void load_data(std::string path, std::vector<std::vector<double>>& images,
-               std::vector<std::vector<double>>& labels) {
+// Fills data with the samples of a .mat file, leaving it empty when the file can't be read
+template <typename T> void read_mat(std::string path, Dataset<T>& data) {
+#ifndef HAVE_MATIO
+    std::cerr << "Built without matio, use the IDX or CSV files of the dataset" << std::endl;
+#else
     mat_t* dataset = Mat_Open(path.c_str(), MAT_ACC_RDONLY);
     if (!dataset) {
         std::cerr << "Couldn't open the file" << std::endl;
@@ -39,31 +56,34 @@ void load_data(std::string path, std::vector<std::vector<double>>& images,
     std::cout << "Data dimensions: " << rows << " x " << cols << std::endl;
     std::cout << "Data class type: " << dataVar->class_type << std::endl;
 
-    images = std::vector<std::vector<double>>(cols, std::vector<double>(rows, 0));
-
     // Handle different data types
     if (dataVar->class_type == MAT_C_DOUBLE) {
-        double* data = static_cast<double*>(dataVar->data);
+        double* values = static_cast<double*>(dataVar->data);
 
         // Some MNIST .mat files store pixels as double in [0,255].
         // Detect that case and normalize to [0,1] to avoid sigmoid saturation.
         double maxPixel = 0.0;
         for (size_t idx = 0; idx < rows * cols; ++idx) {
-            if (data[idx] > maxPixel) {
-                maxPixel = data[idx];
+            if (values[idx] > maxPixel) {
+                maxPixel = values[idx];
             }
         }
         const double scale = (maxPixel > 1.0) ? 255.0 : 1.0;
 
-        for (size_t c = 0; c < cols; ++c)
-            for (size_t r = 0; r < rows; ++r)
-                images[c][r] = data[r + c * rows] / scale;
+        data = Dataset<T>(cols, rows, 10);
+        for (size_t c = 0; c < cols; ++c) {
+            T* features = data.featuresOf(c);
+            for (size_t r = 0; r < rows; ++r) {
+                features[r] = static_cast<T>(values[r + c * rows] / scale);
+            }
+        }
     } else if (dataVar->class_type == MAT_C_UINT8) {
-        uint8_t* data = static_cast<uint8_t*>(dataVar->data);
-        for (size_t c = 0; c < cols; ++c)
-            for (size_t r = 0; r < rows; ++r)
-                images[c][r] =
-                    static_cast<double>(data[r + c * rows]) / 255.0; // Normalize to [0, 1]
+        // Pixels stay as bytes, scaled to [0, 1] as batches are gathered
+        uint8_t* values = static_cast<uint8_t*>(dataVar->data);
+        data = Dataset<T>(cols, rows, 10, 1.0 / 255.0);
+        for (size_t c = 0; c < cols; ++c) {
+            std::copy_n(values + c * rows, rows, data.bytesOf(c));
+        }
     } else {
         std::cerr << "Unsupported data type: " << dataVar->class_type << std::endl;
         Mat_VarFree(dataVar);
@@ -77,26 +97,63 @@ void load_data(std::string path, std::vector<std::vector<double>>& images,
     matvar_t* labelVar = Mat_VarRead(dataset, "label");
     if (!labelVar) {
         std::cerr << "Cannot find variable 'label'\n";
+        data = Dataset<T>();
         Mat_Close(dataset);
         return;
     }
 
     if (!labelVar->data) {
         std::cerr << "Label variable has no data\n";
+        data = Dataset<T>();
         Mat_VarFree(labelVar);
         Mat_Close(dataset);
         return;
     }
 
     double* labels_raw = static_cast<double*>(labelVar->data);
-    labels = std::vector<std::vector<double>>(cols, std::vector<double>(10, 0));
-
     for (size_t i = 0; i < cols; ++i) {
-        labels[i][static_cast<int>(labels_raw[i])] = 1;
+        data.targetOf(i)[static_cast<int>(labels_raw[i])] = 1;
     }
 
     Mat_VarFree(labelVar);
     Mat_Close(dataset);
+#endif
+}
+
+// MNIST's IDX images, whose labels are in the file named the same with labels for images and idx1
+// for idx3, as in train-images-idx3-ubyte and train-labels-idx1-ubyte
+bool is_idx_images(const std::string& path) {
+    return path.find("images") != std::string::npos && path.find("idx3") != std::string::npos;
+}
+
+bool is_data_file(const std::string& path) {
+    return path.ends_with(".mat") || path.ends_with(".csv") || is_idx_images(path);
+}
+
+// Fills data with the samples of a CSV, IDX or .mat file, see is_data_file. CSVs and IDX files are
+// read at disk speed, a .mat goes through matio so the first run also saves its samples as a
+// packed cache next to it, and later runs read the cache instead until the .mat changes
+template <typename T> void load_data(std::string path, Dataset<T>& data) {
+    if (path.ends_with(".csv")) {
+        data.loadCsv(path, 1.0 / 255.0); // pixel exports scaled to [0, 1] like the .mat ones
+        return;
+    }
+    if (is_idx_images(path)) {
+        std::string labels = path;
+        labels.replace(labels.rfind("images"), 6, "labels");
+        labels.replace(labels.rfind("idx3"), 4, "idx1");
+        data.loadIdx(path, labels);
+        return;
+    }
+    std::string cache_path = path + ".cache";
+    if (data.loadCache(cache_path, path)) {
+        std::cout << "Data read from " << cache_path << std::endl;
+        return;
+    }
+    read_mat(path, data);
+    if (data.size() != 0 && data.saveCache(cache_path, path)) {
+        std::cout << "Data cached in " << cache_path << std::endl;
+    }
 }
 
 // Given a canvas with a certain number drawn, finds the bounding box of the drawing, downscales it
@@ -189,43 +246,439 @@ uint32_t* center_canvas_image(Canvas* canvas) {
     return buffer;
 }
 
+// Optimizer for a --optimizer name (sgd, momentum, nesterov, adam or adamw), null when unknown
+template <typename T> std::shared_ptr<const Optimizer<T>> make_optimizer(std::string name) {
+    if (name == "sgd") {
+        return std::make_shared<SGD<T>>();
+    } else if (name == "momentum") {
+        return std::make_shared<SGD<T>>(0.9);
+    } else if (name == "nesterov") {
+        return std::make_shared<SGD<T>>(0.9, true);
+    } else if (name == "adam") {
+        return std::make_shared<Adam<T>>();
+    } else if (name == "adamw") {
+        return std::make_shared<Adam<T>>(0.9, 0.999, 1e-8, 0.01);
+    }
+    return nullptr;
+}
+
+// Learning rate used when --learning-rate isn't given, momentum takes bigger effective steps and
+// Adam normalizes its steps, so both want smaller rates than plain SGD
+double default_learning_rate(std::string optimizer) {
+    if (optimizer == "momentum" || optimizer == "nesterov") {
+        return 0.01;
+    } else if (optimizer == "adam" || optimizer == "adamw") {
+        return 0.001;
+    }
+    return 0.09;
+}
+
+// Command line settings of a training run
+struct TrainOptions {
+    int batchSize = 50;
+    int pipelineStages = 1; // Layer groups trained on their own cores, see Pipeline
+    int microBatches = 5;
+    int workers = 1; // Threads each batch is split over, see DataParallel
+    bool hogwild = false;
+    int loaderThreads = 1; // Background threads assembling batches, see BatchLoader
+    int prefetch = 2;
+    std::string optimizer = "sgd";
+    double learningRate = 0; // 0 picks the optimizer's default
+    int rank = 0;            // This process among worldSize trainers, see RingAllreduce
+    int worldSize = 1;
+    std::string transport = "shm";
+    std::string rendezvous = "nn-train"; // Names the ring's segments or sockets, unique per job
+    std::string shards; // Prefix of shard files streamed instead of --in, see ShardedDataset
+    size_t shuffleBuffer = 4096;
+    int validateEvery = 0; // Epochs between held-out evaluations, see NeuralNetwork::setValidation
+    int patience = 0;
+    std::string checkpoint; // File checkpoints go to, see NeuralNetwork::setCheckpoints
+    int checkpointEvery = 0;
+    std::string resume; // Checkpoint the run carries on from
+};
+
+// Link to the other ranks of a distributed run (shm or socket), null when the name is unknown
+std::shared_ptr<Transport> make_transport(const TrainOptions& options) {
+    if (options.transport == "shm") {
+        return std::make_shared<SharedMemoryTransport>(options.rendezvous, options.rank,
+                                                       options.worldSize);
+    } else if (options.transport == "socket") {
+        std::filesystem::path path = std::filesystem::temp_directory_path() / options.rendezvous;
+        return std::make_shared<SocketTransport>(path.string(), options.rank, options.worldSize);
+    }
+    return nullptr;
+}
+
+template <typename T>
+void train_model(std::string input_path, std::string output_path, const TrainOptions& options) {
+    NeuralNetwork<T> nenu = NeuralNetwork<T>({784, 512, 10});
+    nenu.setPipeline(options.pipelineStages, options.microBatches);
+    nenu.setDataParallel(options.workers, options.hogwild);
+    nenu.setDataLoader(options.loaderThreads, options.prefetch);
+    nenu.setValidation(options.validateEvery, options.patience);
+    std::shared_ptr<const Optimizer<T>> optimizer = make_optimizer<T>(options.optimizer);
+    if (!optimizer) {
+        std::cerr << "Unknown optimizer " << options.optimizer
+                  << ", use sgd, momentum, nesterov, adam or adamw" << std::endl;
+        return;
+    }
+    nenu.setOptimizer(optimizer);
+    if (options.checkpointEvery > 0) {
+        nenu.setCheckpoints(options.checkpoint, options.checkpointEvery);
+    }
+    if (options.resume.size() != 0) {
+        if (!nenu.resume(options.resume)) {
+            return;
+        }
+        std::cout << "Resuming from " << options.resume << std::endl;
+    }
+    if (options.worldSize > 1) {
+        // Ranks sharing a machine keep to their own NUMA node, threads they start split it
+        std::vector<int> node = numa_share(options.rank);
+        if (!node.empty()) {
+            pin_thread(node);
+        }
+        std::shared_ptr<Transport> transport = make_transport(options);
+        if (!transport) {
+            std::cerr << "Unknown transport " << options.transport << ", use shm or socket"
+                      << std::endl;
+            return;
+        }
+        nenu.setDistributed(transport);
+    }
+    double learningRate = options.learningRate;
+    if (learningRate <= 0) {
+        learningRate = default_learning_rate(options.optimizer);
+    }
+
+    typename NeuralNetwork<T>::TrainResponse resp;
+    if (options.shards.size() != 0) {
+        // Only the shard headers are read up front, samples stream in as training goes
+        ShardedDataset<T> shards(options.shards, options.shuffleBuffer);
+        if (shards.size() == 0) {
+            std::cerr << "Error loading data" << std::endl;
+            return;
+        }
+        resp = nenu.train(shards, 0.8, 50, options.batchSize, learningRate, 1);
+    } else {
+        Dataset<T> data;
+        load_data(input_path, data);
+        if (data.size() == 0) {
+            std::cerr << "Error loading data" << std::endl;
+            return;
+        }
+        std::cout << "Data loaded" << std::endl;
+        resp = nenu.train(data, 0.8, 50, options.batchSize, learningRate, 1);
+    }
+    std::cout << resp.averageCost << std::endl;
+    std::cout << resp.maxCost << std::endl;
+    std::cout << resp.minCost << std::endl;
+    std::cout << resp.hitPercentage << std::endl;
+    std::cout << "Cross-entropy: " << resp.crossEntropy << std::endl;
+    std::cout << "Epochs trained: " << resp.epochsTrained << std::endl;
+    // One row per true class, one column per predicted class
+    int classes = std::sqrt(resp.confusion.size());
+    for (int row = 0; row < classes; ++row) {
+        for (int column = 0; column < classes; ++column) {
+            std::cout << std::setw(6) << resp.confusion[(row * classes) + column];
+        }
+        std::cout << std::endl;
+    }
+    std::cout << "Steady state arena blocks from the system: " << resp.steadyStateSystemBlocks
+              << std::endl;
+    std::cout << "Waited for data: " << resp.dataStallSeconds << "s" << std::endl;
+
+    // Every rank ends with the same weights, one copy is enough
+    if (options.rank == 0) {
+        nenu.saveWeights(output_path);
+    }
+}
+
+// Writes the dataset at input_path as shard files for --shards, shuffled once so that every shard
+// holds a mix of the classes
+void make_shards(std::string input_path, std::string prefix, size_t shardSize) {
+    Dataset<float> data;
+    load_data(input_path, data);
+    if (data.size() == 0) {
+        std::cerr << "Error loading data" << std::endl;
+        return;
+    }
+    std::vector<int> order(data.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::random_device rand_dev;
+    std::shuffle(order.begin(), order.end(), std::mt19937(rand_dev()));
+    std::vector<std::string> paths = ShardedDataset<float>::write(data, order, prefix, shardSize);
+    if (paths.size() != 0) {
+        std::cout << "Wrote " << paths.size() << " shards" << std::endl;
+    }
+}
+
+// Builds the int8 version of a saved model, calibrated on the first samples of the dataset, and
+// reports how it compares to the original over the whole dataset
+void quantize_model(std::string model_path, std::string data_path, std::string output_path) {
+    Dataset<double> data;
+    NeuralNetwork<double> nenu;
+    nenu.loadWeights(model_path);
+    if (nenu.getLayers().empty()) {
+        std::cerr << "Error loading model" << std::endl;
+        return;
+    }
+    load_data(data_path, data);
+    if (data.size() == 0) {
+        std::cerr << "Error loading data" << std::endl;
+        return;
+    }
+    int features = data.getFeatureCount();
+    int classes = data.getTargetCount();
+    if (features != nenu.getLayers().front().getWeights().getWidth() ||
+        classes != nenu.getLayers().back().getNodeCount()) {
+        std::cerr << "Model " << model_path << " doesn't fit the samples of " << data_path
+                  << std::endl;
+        return;
+    }
+
+    // One sample per row, the transposed views hand them over as columns
+    Matrix<double> samples(features, data.size());
+    Matrix<double> targets(classes, data.size());
+    for (size_t i = 0; i < data.size(); i++) {
+        data.copyFeatures(i, samples.data() + (i * features));
+        std::copy_n(data.targetOf(i), classes, targets.data() + (i * classes));
+    }
+    int calibrationSize = std::min<int>(1000, data.size());
+    QuantizedNetwork quantized;
+    QuantizedNetwork::Report report;
+    try {
+        quantized = QuantizedNetwork(nenu, samples.view().rows(0, calibrationSize).transpose());
+        report = quantized.compare(nenu, samples.view().transpose(), targets.view().transpose());
+    } catch (const std::exception& error) {
+        std::cerr << "Couldnt quantize " << model_path << ": " << error.what() << std::endl;
+        return;
+    }
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "Float accuracy: " << report.floatAccuracy << "%" << std::endl;
+    std::cout << "Int8 accuracy: " << report.quantizedAccuracy << "%" << std::endl;
+    std::cout << "Agreement: " << report.agreement << "%" << std::endl;
+    std::cout << "Max probability error: " << std::setprecision(4) << report.maxProbabilityError
+              << std::endl;
+    std::cout << "Float time: " << report.floatSeconds << "s, int8 time: "
+              << report.quantizedSeconds << "s (" << std::setprecision(2)
+              << report.floatSeconds / report.quantizedSeconds << "x)" << std::endl;
+    std::cout << "Weights: " << quantized.weightBytes() << " bytes, "
+              << std::filesystem::file_size(model_path) << " bytes in " << model_path
+              << std::endl;
+
+    if (output_path.size() != 0) {
+        quantized.save(output_path);
+    }
+}
+
+// Command line settings of --serve, see InferenceServer
+struct ServeOptions {
+    int maxBatch = 64;
+    int maxDelayMicroseconds = 2000; // Longest a request waits for others to batch with
+    int topK = 1;
+};
+
+// Loads the model once and answers predictions on the Unix socket at serve_path, or on stdin and
+// stdout when it is "-"
+template <typename T>
+void serve_model(std::string model_path, std::string serve_path, const ServeOptions& options) {
+    // A model saved in this precision is served in place from its mapping
+    NeuralNetwork<T> nenu;
+    nenu.loadWeights(model_path);
+    if (nenu.getLayers().empty()) {
+        std::cerr << "Error loading model" << std::endl;
+        return;
+    }
+    int outputCount = nenu.getLayers().back().getNodeCount();
+    if (options.topK < 1 || options.topK > outputCount) {
+        std::cerr << "--top-k must be between 1 and " << outputCount << std::endl;
+        return;
+    }
+    try {
+        InferenceServer<T> server(nenu, options.maxBatch,
+                                  std::chrono::microseconds(options.maxDelayMicroseconds));
+        if (serve_path == "-") {
+            server.serve(std::cin, std::cout, options.topK);
+            typename InferenceServer<T>::Stats stats = server.getStats();
+            std::cerr << stats.requests << " requests in " << stats.batches << " batches, p50 "
+                      << stats.p50Milliseconds << "ms, p99 " << stats.p99Milliseconds << "ms"
+                      << std::endl;
+            return;
+        }
+        std::cout << "Serving " << model_path << " on " << serve_path << std::endl;
+        server.listen(serve_path, options.topK);
+    } catch (const std::exception& error) {
+        std::cerr << error.what() << std::endl;
+    }
+}
+
+// Topology and activations train_model builds, the interactive predictor runs it on the
+// fixed-shape network
+template <typename T>
+using DigitNetwork =
+    StaticNetwork<T, StaticActivations<StaticActivation::RELU, StaticActivation::SOFTMAX>, 784,
+                  512, 10>;
+
+// Null when the model can't be read or has another topology
+template <typename T> std::unique_ptr<DigitNetwork<T>> load_digit_network(std::string model_path) {
+    std::unique_ptr<DigitNetwork<T>> digits = std::make_unique<DigitNetwork<T>>();
+    if (!digits->load(model_path)) {
+        digits.reset();
+    }
+    return digits;
+}
+
+// Class probabilities for one image, from digits when it was loaded and from nenu otherwise,
+// which runs in scratch so that predictions after the first allocate no activations
+template <typename T>
+std::vector<double> predict(const std::array<double, 28 * 28>& pixels, DigitNetwork<T>* digits,
+                            const NeuralNetwork<T>& nenu,
+                            typename NeuralNetwork<T>::Scratch& scratch) {
+    std::array<T, 28 * 28> input;
+    std::copy(pixels.begin(), pixels.end(), input.begin());
+    if (digits != nullptr) {
+        std::span<const T, 10> out = digits->foward(input);
+        return std::vector<double>(out.begin(), out.end());
+    }
+    // The image as a single column
+    const Matrix<T>& out =
+        nenu.infer(MatrixView<const T>(input.data(), 1, input.size(), 1), scratch);
+    return std::vector<double>(out.data(), out.data() + out.getHeight());
+}
+
 int main(int argc, char* argv[]) {
     if (argc < 2) {
-        std::cerr << "Not enough arguments, use --in=<.mat file> and --out<.bin file>" << std::endl;
+        std::cerr << "Not enough arguments, use --in=<data file> and --out<.bin file>" << std::endl;
         return 0;
     }
     std::string input_path;
     std::string output_path;
+    std::string data_path;
+    bool quantize = false;     // Build and evaluate the int8 model of --in, see QuantizedNetwork
+    bool useFloat = false;     // Train or predict in single precision
+    std::string shards_prefix; // Write --in as shards under this prefix
+    size_t shard_size = 10000;
+    std::string serve_path; // Answer predictions from --in here instead of opening the window
+    TrainOptions options;
+    ServeOptions serveOptions;
     for (size_t i = 0; i < argc; ++i) {
         std::string param(argv[i]);
         if (param.find("--in=") != std::string::npos) {
             input_path = param.substr(param.find("=") + 1, param.size());
         } else if (param.find("--out=") != std::string::npos) {
             output_path = param.substr(param.find("=") + 1, param.size());
+        } else if (param.find("--data=") != std::string::npos) {
+            data_path = param.substr(param.find("=") + 1, param.size());
+        } else if (param == "--quantize") {
+            quantize = true;
+        } else if (param == "--float") {
+            useFloat = true;
+        } else if (param.find("--batch-size=") != std::string::npos) {
+            options.batchSize = std::stoi(param.substr(param.find("=") + 1, param.size()));
+        } else if (param.find("--pipeline=") != std::string::npos) {
+            options.pipelineStages = std::stoi(param.substr(param.find("=") + 1, param.size()));
+        } else if (param.find("--micro-batches=") != std::string::npos) {
+            options.microBatches = std::stoi(param.substr(param.find("=") + 1, param.size()));
+        } else if (param.find("--workers=") != std::string::npos) {
+            options.workers = std::stoi(param.substr(param.find("=") + 1, param.size()));
+        } else if (param == "--hogwild") {
+            options.hogwild = true;
+        } else if (param.find("--loader-threads=") != std::string::npos) {
+            options.loaderThreads = std::stoi(param.substr(param.find("=") + 1, param.size()));
+        } else if (param.find("--prefetch=") != std::string::npos) {
+            options.prefetch = std::stoi(param.substr(param.find("=") + 1, param.size()));
+        } else if (param.find("--optimizer=") != std::string::npos) {
+            options.optimizer = param.substr(param.find("=") + 1, param.size());
+        } else if (param.find("--learning-rate=") != std::string::npos) {
+            options.learningRate = std::stod(param.substr(param.find("=") + 1, param.size()));
+        } else if (param.find("--rank=") != std::string::npos) {
+            options.rank = std::stoi(param.substr(param.find("=") + 1, param.size()));
+        } else if (param.find("--world-size=") != std::string::npos) {
+            options.worldSize = std::stoi(param.substr(param.find("=") + 1, param.size()));
+        } else if (param.find("--transport=") != std::string::npos) {
+            options.transport = param.substr(param.find("=") + 1, param.size());
+        } else if (param.find("--rendezvous=") != std::string::npos) {
+            options.rendezvous = param.substr(param.find("=") + 1, param.size());
+        } else if (param.find("--make-shards=") != std::string::npos) {
+            shards_prefix = param.substr(param.find("=") + 1, param.size());
+        } else if (param.find("--shard-size=") != std::string::npos) {
+            shard_size = std::stoul(param.substr(param.find("=") + 1, param.size()));
+        } else if (param.find("--shards=") != std::string::npos) {
+            options.shards = param.substr(param.find("=") + 1, param.size());
+        } else if (param.find("--shuffle-buffer=") != std::string::npos) {
+            options.shuffleBuffer = std::stoul(param.substr(param.find("=") + 1, param.size()));
+        } else if (param.find("--validate-every=") != std::string::npos) {
+            options.validateEvery = std::stoi(param.substr(param.find("=") + 1, param.size()));
+        } else if (param.find("--patience=") != std::string::npos) {
+            options.patience = std::stoi(param.substr(param.find("=") + 1, param.size()));
+        } else if (param.find("--checkpoint=") != std::string::npos) {
+            options.checkpoint = param.substr(param.find("=") + 1, param.size());
+        } else if (param.find("--checkpoint-every=") != std::string::npos) {
+            options.checkpointEvery = std::stoi(param.substr(param.find("=") + 1, param.size()));
+        } else if (param.find("--resume=") != std::string::npos) {
+            options.resume = param.substr(param.find("=") + 1, param.size());
+        } else if (param.find("--serve=") != std::string::npos) {
+            serve_path = param.substr(param.find("=") + 1, param.size());
+        } else if (param.find("--max-batch=") != std::string::npos) {
+            serveOptions.maxBatch = std::stoi(param.substr(param.find("=") + 1, param.size()));
+        } else if (param.find("--max-delay-us=") != std::string::npos) {
+            serveOptions.maxDelayMicroseconds =
+                std::stoi(param.substr(param.find("=") + 1, param.size()));
+        } else if (param.find("--top-k=") != std::string::npos) {
+            serveOptions.topK = std::stoi(param.substr(param.find("=") + 1, param.size()));
         }
     }
-    if (input_path.find(".mat") != std::string::npos && output_path.size() != 0) {
-        std::vector<std::vector<double>> images;
-        std::vector<std::vector<double>> labels;
-        NeuralNetwork nenu = NeuralNetwork({784, 512, 10});
-
-        load_data(input_path, images, labels);
-        if (images.size() == 0 && labels.size() == 0) {
-            std::cerr << "Error loading data" << std::endl;
+    if (quantize) {
+        if (input_path.find(".bin") == std::string::npos || data_path.size() == 0) {
+            std::cerr << "Quantizing needs --in=<.bin file> and --data=<data file>" << std::endl;
             return 0;
         }
-        std::cout << "Data loaded" << std::endl;
-
-        NeuralNetwork::TrainResponse resp = nenu.train(images, labels, 0.8, 50, 50, 0.09, 1);
-        std::cout << resp.averageCost << std::endl;
-        std::cout << resp.maxCost << std::endl;
-        std::cout << resp.minCost << std::endl;
-        std::cout << resp.hitPercentage << std::endl;
-
-        nenu.saveWeights(output_path);
+        quantize_model(input_path, data_path, output_path);
+    } else if (serve_path.size() != 0) {
+        if (input_path.find(".bin") == std::string::npos) {
+            std::cerr << "Serving needs --in=<.bin file>" << std::endl;
+            return 0;
+        }
+        if (useFloat) {
+            serve_model<float>(input_path, serve_path, serveOptions);
+        } else {
+            serve_model<double>(input_path, serve_path, serveOptions);
+        }
+    } else if (shards_prefix.size() != 0) {
+        if (!is_data_file(input_path)) {
+            std::cerr << "Writing shards needs --in=<data file>" << std::endl;
+            return 0;
+        }
+        make_shards(input_path, shards_prefix, shard_size);
+    } else if ((is_data_file(input_path) || options.shards.size() != 0) &&
+               output_path.size() != 0) {
+        if (useFloat) {
+            train_model<float>(input_path, output_path, options);
+        } else {
+            train_model<double>(input_path, output_path, options);
+        }
     } else if (input_path.find(".bin") != std::string::npos) {
-        NeuralNetwork* nenu = new NeuralNetwork();
-        nenu->loadWeights(input_path);
+        std::unique_ptr<DigitNetwork<double>> digits;
+        std::unique_ptr<DigitNetwork<float>> floatDigits;
+        if (useFloat) {
+            floatDigits = load_digit_network<float>(input_path);
+        } else {
+            digits = load_digit_network<double>(input_path);
+        }
+        NeuralNetwork<double>* nenu = new NeuralNetwork<double>();
+        NeuralNetwork<float> floatNenu;
+        if (!digits && !floatDigits) {
+            std::cout << "Falling back to the generic network" << std::endl;
+            if (useFloat) {
+                floatNenu.loadWeights(input_path);
+            } else {
+                nenu->loadWeights(input_path);
+            }
+        }
+        // Kept for the whole session, every prediction reuses the buffers of the first
+        NeuralNetwork<double>::Scratch scratch;
+        NeuralNetwork<float>::Scratch floatScratch;
         SDL_Window* window = SDL_CreateWindow("Test", 1024, 768, SDL_WINDOW_RESIZABLE);
         SDL_Renderer* renderer = SDL_CreateRenderer(window, NULL);
         Canvas* canvas = new Canvas(28, 28, renderer);
@@ -274,15 +727,16 @@ int main(int argc, char* argv[]) {
                     }
                     if (event.key.key == SDLK_RETURN) {
                         uint32_t* buf = center_canvas_image(canvas);
-                        Matrix<double> in(1, 28 * 28);
+                        std::array<double, 28 * 28> pixels;
                         for (size_t i = 0; i < (28 * 28); i++) {
-                            double color = (double)(*(buf + i)) / 0xFFFFFFFF;
-                            in.setValue(0, i, color);
+                            pixels[i] = (double)(*(buf + i)) / 0xFFFFFFFF;
                         }
-                        Matrix<double> out = nenu->foward(in);
-                        for (size_t i = 0; i < out.getHeight(); i++) {
-                            std::cout << i << ": " << std::fixed << std::setprecision(6)
-                                      << out.getValue(0, i) << std::endl;
+                        std::vector<double> out =
+                            useFloat ? predict(pixels, floatDigits.get(), floatNenu, floatScratch)
+                                     : predict(pixels, digits.get(), *nenu, scratch);
+                        for (size_t i = 0; i < out.size(); i++) {
+                            std::cout << i << ": " << std::fixed << std::setprecision(6) << out[i]
+                                      << std::endl;
                             ;
                         }
                         std::cout << std::endl;